@@ -0,0 +1,632 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Checksum filter.  Records pass through unchanged, while their
+   CRC-32C is computed.  The digests are stored in digest records
+   inserted into the stream: with PAXBUF_CSUM_RECORD, one after each
+   group of records whose CRCs fit in it, and in any case a final one
+   at the end, which also holds the CRC of the whole stream.  When
+   reading, the digest records are verified and removed.
+
+   A digest record is laid out as follows; numbers are little-endian:
+
+     0  Magic, "PXCRC32C"
+     8  CRC-32C of the digest record, computed with this field zero
+    12  Flags: CSUM_FINAL for the last one, PAXBUF_CSUM_RECORD
+    16  Number of the first data record covered (64 bits)
+    24  Number of record CRCs that follow
+    28  CRC-32C of the data up to the end of the last record covered
+    32  Number of bytes of data up to that point (64 bits)
+    40  CRCs of the records covered  */
+
+#include <system.h>
+#include <pthread.h>
+#include <ialloc.h>
+#include <paxbuf.h>
+#if defined __x86_64__ && defined __GNUC__
+# define CRC32C_SSE42 1
+#elif defined __aarch64__ && defined __ARM_FEATURE_CRC32
+# include <arm_acle.h>
+# define CRC32C_ARM 1
+#endif
+
+
+/* CRC-32C (Castagnoli), reflected, without the initial and final
+   inversions, which the callers apply.  */
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint_least32_t crc32c_table[8][256];
+
+/* Multiply A and B modulo the CRC polynomial.  */
+static uint_least32_t
+crc32c_multmod (uint_least32_t a, uint_least32_t b)
+{
+  uint_least32_t m = (uint_least32_t) 1 << 31, p = 0;
+
+  for (;;)
+    {
+      if (a & m)
+	{
+	  p ^= b;
+	  if ((a & (m - 1)) == 0)
+	    break;
+	}
+      m >>= 1;
+      b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+  return p;
+}
+
+/* Return x^(8*LEN) modulo the CRC polynomial.  Multiplying a CRC by it
+   appends LEN zero bytes to the data it was computed for.  */
+static uint_least32_t
+crc32c_shift (idx_t len)
+{
+  uint_least32_t p = (uint_least32_t) 1 << 31;   /* x^0 */
+  uint_least32_t q = (uint_least32_t) 1 << 30;   /* x^1 */
+
+  for (uint_least64_t e = 8 * (uint_least64_t) len; e; e >>= 1)
+    {
+      if (e & 1)
+	p = crc32c_multmod (q, p);
+      q = crc32c_multmod (q, q);
+    }
+  return p;
+}
+
+static uint_least32_t
+crc32c_sw (uint_least32_t crc, unsigned char const *p, idx_t len)
+{
+  while (len > 0 && (uintptr_t) p % 8)
+    {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+      len--;
+    }
+  /* Slicing by eight */
+  for (; len >= 8; p += 8, len -= 8)
+    {
+      uint_least32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16)
+				 | ((uint_least32_t) p[3] << 24));
+      crc = crc32c_table[7][lo & 0xff]
+	    ^ crc32c_table[6][(lo >> 8) & 0xff]
+	    ^ crc32c_table[5][(lo >> 16) & 0xff]
+	    ^ crc32c_table[4][lo >> 24]
+	    ^ crc32c_table[3][p[4]]
+	    ^ crc32c_table[2][p[5]]
+	    ^ crc32c_table[1][p[6]]
+	    ^ crc32c_table[0][p[7]];
+    }
+  while (len-- > 0)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if CRC32C_SSE42 || CRC32C_ARM
+/* The hardware instruction has a latency of several cycles but can
+   start one every cycle, so large buffers are processed as three
+   independent streams, whose CRCs are combined afterwards.  */
+enum { CRC32C_STRIPE = 4096 };
+
+static uint_least32_t crc32c_stripe_shift;
+
+# if CRC32C_SSE42
+#  define CRC32C_TARGET __attribute__ ((target ("sse4.2")))
+#  define crc32c_u8(c, v) __builtin_ia32_crc32qi (c, v)
+#  define crc32c_u64(c, v) __builtin_ia32_crc32di (c, v)
+# else
+#  define CRC32C_TARGET
+#  define crc32c_u8(c, v) __crc32cb (c, v)
+#  define crc32c_u64(c, v) __crc32cd (c, v)
+# endif
+
+static uint_least64_t
+load64 (unsigned char const *p)
+{
+  uint_least64_t v;
+  memcpy (&v, p, sizeof v);
+  return v;
+}
+
+CRC32C_TARGET static uint_least32_t
+crc32c_hw (uint_least32_t crc, unsigned char const *p, idx_t len)
+{
+  uint_least64_t c0 = crc;
+
+  while (len > 0 && (uintptr_t) p % 8)
+    {
+      c0 = crc32c_u8 (c0, *p++);
+      len--;
+    }
+  while (len >= 3 * CRC32C_STRIPE)
+    {
+      uint_least64_t c1 = 0, c2 = 0;
+      for (idx_t i = 0; i < CRC32C_STRIPE; i += 8)
+	{
+	  c0 = crc32c_u64 (c0, load64 (p + i));
+	  c1 = crc32c_u64 (c1, load64 (p + CRC32C_STRIPE + i));
+	  c2 = crc32c_u64 (c2, load64 (p + 2 * CRC32C_STRIPE + i));
+	}
+      c0 = crc32c_multmod (crc32c_stripe_shift, c0) ^ c1;
+      c0 = crc32c_multmod (crc32c_stripe_shift, c0) ^ c2;
+      p += 3 * CRC32C_STRIPE;
+      len -= 3 * CRC32C_STRIPE;
+    }
+  for (; len >= 8; p += 8, len -= 8)
+    c0 = crc32c_u64 (c0, load64 (p));
+  while (len-- > 0)
+    c0 = crc32c_u8 (c0, *p++);
+  return c0;
+}
+#endif
+
+static uint_least32_t (*crc32c_update) (uint_least32_t, unsigned char const *,
+					idx_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32c_init (void)
+{
+  for (int i = 0; i < 256; i++)
+    {
+      uint_least32_t c = i;
+      for (int k = 0; k < 8; k++)
+	c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      crc32c_table[0][i] = c;
+    }
+  for (int i = 0; i < 256; i++)
+    for (int k = 1; k < 8; k++)
+      crc32c_table[k][i] = crc32c_table[0][crc32c_table[k - 1][i] & 0xff]
+	                   ^ (crc32c_table[k - 1][i] >> 8);
+
+  crc32c_update = crc32c_sw;
+#if CRC32C_SSE42
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse4.2"))
+    crc32c_update = crc32c_hw;
+#elif CRC32C_ARM
+  crc32c_update = crc32c_hw;
+#endif
+#if CRC32C_SSE42 || CRC32C_ARM
+  crc32c_stripe_shift = crc32c_shift (CRC32C_STRIPE);
+#endif
+}
+
+/* Return the CRC-32C of LEN bytes at DATA, continuing from CRC, which
+   is 0 at the start.  */
+static uint_least32_t
+crc32c (uint_least32_t crc, void const *data, idx_t len)
+{
+  return ~crc32c_update (~crc, data, len);
+}
+
+
+/* Digest records */
+
+#define CSUM_MAGIC "PXCRC32C"
+
+enum
+  {
+    CSUM_HEADER_SIZE = 40,
+    CSUM_FINAL = 0x100        /* Flag: last digest record */
+  };
+
+struct checksum
+{
+  int flags;                  /* PAXBUF_CSUM_* flags */
+  bool writing;               /* Buffer is in write mode */
+  idx_t group_max;            /* Number of records covered by a digest
+				 record, or 0 if only the final one is
+				 written */
+  uint_least32_t *crc;        /* CRCs of the records in the current
+				 group */
+  idx_t ncrc;                 /* Number of them */
+  off_t first;                /* Number of the first record in it */
+  uint_least32_t stream_crc;  /* CRC of the data so far */
+  off_t stream_size;          /* Number of bytes of data so far */
+  idx_t record_size;          /* Size of the records */
+  uint_least32_t record_shift; /* crc32c_shift (RECORD_SIZE) */
+  bool stream_valid;          /* False if part of the data was skipped */
+  bool done;                  /* Final digest record read */
+  paxbuf_layer_t next;        /* Layer the held record belongs to */
+  char *held;                 /* Record read ahead, or nullptr */
+  idx_t held_size;            /* Its size */
+  bool held_last;             /* It is the last record of the stream */
+};
+
+static void
+put_le32 (unsigned char *p, uint_least32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint_least32_t
+get_le32 (unsigned char const *p)
+{
+  return p[0] | (p[1] << 8) | ((uint_least32_t) p[2] << 16)
+         | ((uint_least32_t) p[3] << 24);
+}
+
+static void
+put_le64 (unsigned char *p, uint_least64_t v)
+{
+  put_le32 (p, v);
+  put_le32 (p + 4, v >> 32);
+}
+
+static uint_least64_t
+get_le64 (unsigned char const *p)
+{
+  return get_le32 (p) | ((uint_least64_t) get_le32 (p + 4) << 32);
+}
+
+/* Return true if the SIZE bytes at DATA form a valid digest record.  */
+static bool
+digest_valid (char const *data, idx_t size)
+{
+  unsigned char const *p = (unsigned char const *) data;
+  static unsigned char const zero[4];
+  uint_least32_t crc;
+  idx_t n;
+
+  if (size < CSUM_HEADER_SIZE
+      || memcmp (p, CSUM_MAGIC, sizeof CSUM_MAGIC - 1) != 0)
+    return false;
+  n = get_le32 (p + 24);
+  if (n > (size - CSUM_HEADER_SIZE) / 4)
+    return false;
+  crc = crc32c (0, p, 8);
+  crc = crc32c (crc, zero, sizeof zero);
+  crc = crc32c (crc, p + 12, size - 12);
+  return crc == get_le32 (p + 8);
+}
+
+/* Fill REC, of SIZE bytes, with a digest record for the current
+   group.  */
+static void
+digest_build (struct checksum *cs, char *rec, idx_t size, int flags)
+{
+  unsigned char *p = (unsigned char *) rec;
+  idx_t n = cs->group_max ? cs->ncrc : 0;
+
+  memset (p, 0, size);
+  memcpy (p, CSUM_MAGIC, sizeof CSUM_MAGIC - 1);
+  put_le32 (p + 12, flags | (cs->flags & PAXBUF_CSUM_RECORD));
+  put_le64 (p + 16, cs->first);
+  put_le32 (p + 24, n);
+  put_le32 (p + 28, cs->stream_crc);
+  put_le64 (p + 32, cs->stream_size);
+  for (idx_t i = 0; i < n; i++)
+    put_le32 (p + CSUM_HEADER_SIZE + 4 * i, cs->crc[i]);
+  put_le32 (p + 8, crc32c (0, p, size));
+}
+
+/* Compare the digest record DATA with the data read so far.  */
+static bool
+digest_check (struct checksum *cs, char const *data)
+{
+  unsigned char const *p = (unsigned char const *) data;
+  off_t first = get_le64 (p + 16);
+  idx_t n = get_le32 (p + 24);
+
+  if ((get_le32 (p + 12) & PAXBUF_CSUM_RECORD)
+      != (cs->flags & PAXBUF_CSUM_RECORD))
+    return false;
+  if (cs->stream_valid
+      && (get_le64 (p + 32) != cs->stream_size
+	  || get_le32 (p + 28) != cs->stream_crc))
+    return false;
+  /* After a seek, only part of the group may have been read.  */
+  for (idx_t i = 0; cs->group_max && i < cs->ncrc; i++)
+    {
+      off_t k = cs->first + i - first;
+      if (k < 0 || k >= n
+	  || get_le32 (p + CSUM_HEADER_SIZE + 4 * k) != cs->crc[i])
+	return false;
+    }
+  return true;
+}
+
+/* Account for SIZE bytes of DATA in record number CS->first +
+   CS->ncrc.  The CRC of the stream is obtained by combining the CRCs
+   of the records, so the data is only scanned once.  */
+static void
+record_sum (struct checksum *cs, char const *data, idx_t size)
+{
+  uint_least32_t crc = crc32c (0, data, size);
+
+  if (cs->stream_valid)
+    cs->stream_crc = crc32c_multmod (size == cs->record_size
+				     ? cs->record_shift
+				     : crc32c_shift (size),
+				     cs->stream_crc) ^ crc;
+  cs->stream_size += size;
+  if (cs->group_max)
+    cs->crc[cs->ncrc] = crc;
+  cs->ncrc++;
+}
+
+
+static pax_io_status_t
+checksum_write (void *closure, paxbuf_layer_t next, char *data, idx_t size)
+{
+  struct checksum *cs = closure;
+  idx_t record_size = paxbuf_layer_record_size (next);
+  pax_io_status_t status;
+
+  if (size == 0)
+    {
+      paxbuf_layer_release (next, data);
+      return pax_io_success;
+    }
+  /* Keep the records aligned, so that digest records can be found.  */
+  if (size < record_size)
+    memset (data + size, 0, record_size - size);
+  record_sum (cs, data, record_size);
+  status = paxbuf_layer_write (next, data, record_size);
+  if (status != pax_io_success || !cs->group_max
+      || cs->ncrc < cs->group_max)
+    return status;
+
+  char *rec = paxbuf_layer_alloc (next);
+  if (!rec)
+    {
+      errno = ENOMEM;
+      return pax_io_failure;
+    }
+  digest_build (cs, rec, record_size, 0);
+  cs->first += cs->ncrc;
+  cs->ncrc = 0;
+  return paxbuf_layer_write (next, rec, record_size);
+}
+
+static pax_io_status_t
+checksum_flush (void *closure, paxbuf_layer_t next)
+{
+  struct checksum *cs = closure;
+  idx_t record_size = paxbuf_layer_record_size (next);
+  char *rec = paxbuf_layer_alloc (next);
+
+  if (!rec)
+    {
+      errno = ENOMEM;
+      return pax_io_failure;
+    }
+  digest_build (cs, rec, record_size, CSUM_FINAL);
+  cs->first += cs->ncrc;
+  cs->ncrc = 0;
+  return paxbuf_layer_write (next, rec, record_size);
+}
+
+/* Verify the digest record DATA of SIZE bytes, which must be final if
+   FINAL is true and is released.  Return true if it matches the data
+   read.  */
+static bool
+digest_read (struct checksum *cs, paxbuf_layer_t next, char *data,
+	     idx_t size, bool final)
+{
+  bool ok = (digest_valid (data, size)
+	     && !(get_le32 ((unsigned char *) data + 12) & CSUM_FINAL) == !final
+	     && digest_check (cs, data));
+
+  paxbuf_layer_release (next, data);
+  cs->first += cs->ncrc;
+  cs->ncrc = 0;
+  return ok;
+}
+
+/* Digest records are found by their position: with
+   PAXBUF_CSUM_RECORD, one follows every GROUP_MAX data records, and the
+   final one is the last record of the stream.  A record is therefore
+   only passed on once the next one has been read.  */
+static pax_io_status_t
+checksum_read (void *closure, paxbuf_layer_t next, char **data, idx_t *size)
+{
+  struct checksum *cs = closure;
+  pax_io_status_t status;
+  char *p, *q;
+  idx_t n, m;
+
+  *data = nullptr;
+  *size = 0;
+  if (cs->done)
+    return pax_io_eof;
+
+  for (;;)
+    {
+      if (cs->held)
+	{
+	  p = cs->held;
+	  n = cs->held_size;
+	  status = cs->held_last ? pax_io_eof : pax_io_success;
+	  cs->held = nullptr;
+	}
+      else
+	{
+	  status = paxbuf_layer_read (next, &p, &n);
+	  if (status == pax_io_failure)
+	    {
+	      if (p)
+		paxbuf_layer_release (next, p);
+	      return status;
+	    }
+	  if (n == 0)
+	    {
+	      /* The final digest record is missing.  */
+	      if (p)
+		paxbuf_layer_release (next, p);
+	      errno = EILSEQ;
+	      return pax_io_failure;
+	    }
+	}
+
+      if (cs->group_max && cs->ncrc > 0
+	  && (cs->first + cs->ncrc) % cs->group_max == 0)
+	{
+	  /* A group is complete: this is its digest record.  */
+	  if (!digest_read (cs, next, p, n, false))
+	    {
+	      errno = EILSEQ;
+	      return pax_io_failure;
+	    }
+	  if (status == pax_io_eof)
+	    {
+	      /* The final digest record is missing.  */
+	      errno = EILSEQ;
+	      return pax_io_failure;
+	    }
+	  continue;
+	}
+
+      if (status != pax_io_eof)
+	{
+	  status = paxbuf_layer_read (next, &q, &m);
+	  if (status == pax_io_failure)
+	    {
+	      if (q)
+		paxbuf_layer_release (next, q);
+	      paxbuf_layer_release (next, p);
+	      return status;
+	    }
+	  if (m > 0)
+	    {
+	      cs->next = next;
+	      cs->held = q;
+	      cs->held_size = m;
+	      cs->held_last = status == pax_io_eof;
+	    }
+	  else if (q)
+	    paxbuf_layer_release (next, q);
+	}
+      if (!cs->held)
+	{
+	  /* P is the last record: the final digest record.  */
+	  if (!digest_read (cs, next, p, n, true))
+	    {
+	      errno = EILSEQ;
+	      return pax_io_failure;
+	    }
+	  cs->done = true;
+	  return pax_io_eof;
+	}
+
+      record_sum (cs, p, n);
+      *data = p;
+      *size = n;
+      return pax_io_success;
+    }
+}
+
+/* Give back the record read ahead, if any.  */
+static void
+checksum_drop (struct checksum *cs)
+{
+  if (cs->held)
+    {
+      paxbuf_layer_release (cs->next, cs->held);
+      cs->held = nullptr;
+    }
+}
+
+/* Digest records are not seen by the layers above, so the offset of
+   the record containing OFFSET is adjusted for those preceding it.  */
+static int
+checksum_seek (void *closure, paxbuf_layer_t next, off_t offset)
+{
+  struct checksum *cs = closure;
+  idx_t record_size = paxbuf_layer_record_size (next);
+  off_t rec = offset / record_size;
+  off_t phys = rec;
+
+  /* Seeking while writing would leave stale digests.  */
+  if (cs->writing)
+    {
+      errno = ESPIPE;
+      return -1;
+    }
+  if (cs->group_max)
+    phys += rec / cs->group_max;
+  checksum_drop (cs);
+  if (paxbuf_layer_seek (next, phys * record_size + offset % record_size))
+    return -1;
+  cs->first = rec;
+  cs->ncrc = 0;
+  cs->stream_valid = rec == 0 && offset == 0;
+  cs->stream_crc = 0;
+  cs->stream_size = 0;
+  cs->done = false;
+  return 0;
+}
+
+static void
+checksum_destroy (void *closure)
+{
+  struct checksum *cs = closure;
+  checksum_drop (cs);
+  free (cs->crc);
+  free (cs);
+}
+
+static struct paxbuf_filter checksum_filter = {
+  .read = checksum_read,
+  .write = checksum_write,
+  .flush = checksum_flush,
+  .seek = checksum_seek,
+  .destroy = checksum_destroy
+};
+
+/* Compute the CRC-32C of the data written to BUF and store it in the
+   stream, or verify it for the data read.  With PAXBUF_CSUM_RECORD in
+   FLAGS, the CRC of each record is stored as well.  The same flags
+   must be used when writing and reading.  A mismatch makes the read
+   fail with EILSEQ.  Return 0 on success and an error code
+   otherwise.  */
+int
+paxbuf_push_checksum (paxbuf_t buf, int flags)
+{
+  idx_t record_size = paxbuf_get_record_size (buf);
+  struct checksum *cs;
+
+  if (flags & ~PAXBUF_CSUM_RECORD)
+    return EINVAL;
+  if (record_size < CSUM_HEADER_SIZE + 4)
+    return EINVAL;
+  pthread_once (&crc32c_once, crc32c_init);
+
+  cs = calloc (1, sizeof *cs);
+  if (!cs)
+    return ENOMEM;
+  cs->flags = flags;
+  cs->writing = paxbuf_get_mode (buf) & PAXBUF_WRITE;
+  cs->stream_valid = true;
+  cs->record_size = record_size;
+  cs->record_shift = crc32c_shift (record_size);
+  if (flags & PAXBUF_CSUM_RECORD)
+    {
+      cs->group_max = (record_size - CSUM_HEADER_SIZE) / 4;
+      cs->crc = ireallocarray (nullptr, cs->group_max, sizeof cs->crc[0]);
+      if (!cs->crc)
+	{
+	  free (cs);
+	  return ENOMEM;
+	}
+    }
+  return paxbuf_push_filter (buf, &checksum_filter, cs);
+}
@@ -0,0 +1,1291 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Compression filters.  The data written is split into blocks of
+   COMPRESS_BLOCK_SIZE bytes, which are compressed independently by a
+   pool of worker threads.  Each block becomes a gzip member or a zstd
+   frame, and the results are written in order, so the output is an
+   ordinary multi-member gzip or multi-frame zstd stream.
+
+   Gzip members carry an extra field with subfield ID "PX", holding the
+   compressed size of the member and the uncompressed size of its data,
+   both as 32-bit little-endian numbers.  Readers that know about it can
+   locate members without inflating them; others ignore it.
+
+   The decompression filter splits its input into members or frames,
+   decodes them on the worker pool and returns the data in order.  Gzip
+   members without the PX field are inflated sequentially instead.  The
+   start of each frame is remembered in a seek index, which lets a seek
+   resume decoding at the frame containing the requested offset.  */
+
+#include <system.h>
+#include <pthread.h>
+#include <ialloc.h>
+#include <paxbuf.h>
+#if HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+#if HAVE_ZSTD_H
+# include <zstd.h>
+# include <zstd_errors.h>
+#endif
+
+enum { COMPRESS_BLOCK_SIZE = 1024 * 1024 };
+
+/* Gzip member layout */
+enum
+  {
+    GZ_HEADER_SIZE = 24,      /* Fixed header, XLEN and the PX subfield */
+    GZ_TRAILER_SIZE = 8       /* CRC32 and ISIZE */
+  };
+
+/* A block of data and its compressed form */
+struct zjob
+{
+  struct zjob *next;          /* Next job in the work queue */
+  struct zjob *order;         /* Next job in stream order */
+    /* Compression: the input records, owned by the job */
+  char **rec;                 /* Records */
+  idx_t *len;                 /* Number of bytes used in each */
+  idx_t nrec;                 /* Number of records */
+  idx_t nalloc;               /* Number of slots allocated in REC and LEN */
+    /* Decompression: the compressed frame */
+  char *in;                   /* Frame data */
+  off_t in_off;               /* Its offset in the compressed stream */
+  off_t out_off;              /* Offset of its data, or -1 if unknown */
+  idx_t in_size;              /* Input size */
+  idx_t expect;               /* Expected output size, or -1 if unknown */
+  char *out;                  /* Output data */
+  idx_t out_len;              /* Its length */
+  bool done;                  /* Processing finished */
+  bool failed;                /* Processing failed */
+};
+
+/* A point where decoding can start */
+struct seek_point
+{
+  off_t in;                   /* Offset in the compressed stream */
+  off_t out;                  /* Offset of the data decoded from there */
+};
+
+struct zfilter
+{
+  int codec;                  /* PAXBUF_GZIP or PAXBUF_ZSTD, or 0 if not
+				 known yet */
+  bool decode;                /* Decompressing */
+  int level;                  /* Compression level */
+  int nthreads;               /* Number of workers */
+  pthread_t *threads;         /* Workers, if started */
+  paxbuf_layer_t next;        /* Layer the records belong to */
+
+  pthread_mutex_t mutex;      /* Protects the members below */
+  pthread_cond_t work;        /* Signalled when a job is queued */
+  pthread_cond_t done;        /* Signalled when a job is finished */
+  struct zjob *queue_head;    /* Jobs waiting for a worker */
+  struct zjob *queue_tail;
+  bool stop;                  /* Terminate the workers */
+
+    /* Accessed by the caller only */
+  struct zjob *order_head;    /* Jobs in progress, in stream order */
+  struct zjob *order_tail;
+  idx_t inflight;             /* Number of them */
+
+    /* Compression */
+  struct zjob *cur;           /* Job being filled */
+  char *rec;                  /* Output record being filled */
+  idx_t rec_level;            /* Number of bytes in it */
+
+    /* Decompression */
+  char *in;                   /* Compressed input */
+  idx_t in_alloc;             /* Bytes allocated for it */
+  idx_t in_start;             /* Offset of the first unused byte in it */
+  idx_t in_end;               /* Offset past the last one */
+  off_t in_off;               /* Stream offset of IN[IN_START] */
+  idx_t in_skip;              /* Bytes to drop from the next record read */
+  bool in_eof;                /* The layer below is exhausted */
+  bool end;                   /* No more frames */
+  off_t out_off;              /* Offset of the data of the next frame to
+				 be dispatched, or -1 if unknown */
+  off_t out_pos;              /* Offset of the next byte returned */
+  off_t target;               /* Data below this offset is dropped */
+  struct zjob *emit;          /* Job whose output is being returned */
+  idx_t emit_pos;             /* Number of its bytes returned so far */
+  bool serial;                /* Inflating in the calling thread */
+  bool member;                /* In the middle of a member */
+#if HAVE_ZLIB_H
+  z_stream zs;                /* Inflate state for serial mode */
+  bool zs_init;
+#endif
+  struct seek_point *index;   /* Seek index, sorted by offset */
+  idx_t nindex;               /* Number of entries in it */
+  idx_t index_alloc;          /* Number of entries allocated */
+};
+
+/* Per-worker state */
+struct zworker
+{
+#if HAVE_ZLIB_H
+  z_stream zs;
+  bool zs_init;
+#endif
+#if HAVE_ZSTD_H
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+#endif
+};
+
+static void
+put_le32 (unsigned char *p, uint_least32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint_least32_t
+get_le32 (unsigned char const *p)
+{
+  return p[0] | (p[1] << 8) | ((uint_least32_t) p[2] << 16)
+         | ((uint_least32_t) p[3] << 24);
+}
+
+/* Make room for SIZE bytes of output in JOB.  */
+static bool
+job_out_grow (struct zjob *job, idx_t size)
+{
+  char *p = irealloc (job->out, size);
+  if (!p)
+    return false;
+  job->out = p;
+  return true;
+}
+
+#if HAVE_ZLIB_H
+static bool
+gzip_compress (struct zfilter *z, struct zworker *w, struct zjob *job)
+{
+  z_stream *zs = &w->zs;
+  uLong crc = crc32 (0, Z_NULL, 0);
+  idx_t bound;
+  unsigned char *p;
+  int rc = Z_OK;
+
+  if (!w->zs_init)
+    {
+      if (deflateInit2 (zs, z->level, Z_DEFLATED, -MAX_WBITS, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+	return false;
+      w->zs_init = true;
+    }
+  else
+    deflateReset (zs);
+
+  bound = GZ_HEADER_SIZE + deflateBound (zs, job->in_size) + GZ_TRAILER_SIZE;
+  job->out = malloc (bound);
+  if (!job->out)
+    return false;
+
+  zs->next_out = (Bytef *) job->out + GZ_HEADER_SIZE;
+  zs->avail_out = bound - GZ_HEADER_SIZE - GZ_TRAILER_SIZE;
+  for (idx_t i = 0; i < job->nrec; i++)
+    {
+      zs->next_in = (Bytef *) job->rec[i];
+      zs->avail_in = job->len[i];
+      crc = crc32 (crc, zs->next_in, zs->avail_in);
+      rc = deflate (zs, i + 1 == job->nrec ? Z_FINISH : Z_NO_FLUSH);
+      if (rc != Z_OK && rc != Z_STREAM_END)
+	return false;
+    }
+  if (rc != Z_STREAM_END)
+    return false;
+  job->out_len = GZ_HEADER_SIZE + zs->total_out + GZ_TRAILER_SIZE;
+
+  p = (unsigned char *) job->out;
+  p[0] = 0x1f;                  /* ID1 */
+  p[1] = 0x8b;                  /* ID2 */
+  p[2] = 8;                     /* CM: deflate */
+  p[3] = 4;                     /* FLG: FEXTRA */
+  put_le32 (p + 4, 0);          /* MTIME */
+  p[8] = 0;                     /* XFL */
+  p[9] = 3;                     /* OS: Unix */
+  p[10] = 12;                   /* XLEN */
+  p[11] = 0;
+  p[12] = 'P';                  /* SI1 */
+  p[13] = 'X';                  /* SI2 */
+  p[14] = 8;                    /* LEN */
+  p[15] = 0;
+  /* Sizes that do not fit are stored as 0, meaning unknown.  */
+  put_le32 (p + 16, job->out_len <= UINT32_MAX ? job->out_len : 0);
+  put_le32 (p + 20, job->in_size <= UINT32_MAX ? job->in_size : 0);
+  p += job->out_len - GZ_TRAILER_SIZE;
+  put_le32 (p, crc);
+  put_le32 (p + 4, job->in_size);
+  return true;
+}
+
+/* Inflate a single gzip member.  The trailer is verified by zlib.  */
+static bool
+gzip_decompress (struct zworker *w, struct zjob *job)
+{
+  z_stream *zs = &w->zs;
+  idx_t size = job->expect >= 0 ? job->expect : 4 * job->in_size;
+  int rc;
+
+  if (!w->zs_init)
+    {
+      if (inflateInit2 (zs, 16 + MAX_WBITS) != Z_OK)
+	return false;
+      w->zs_init = true;
+    }
+  else
+    inflateReset (zs);
+
+  zs->next_in = (Bytef *) job->in;
+  zs->avail_in = job->in_size;
+  for (;;)
+    {
+      if (!job_out_grow (job, size + 1))
+	return false;
+      zs->next_out = (Bytef *) job->out + zs->total_out;
+      zs->avail_out = size + 1 - zs->total_out;
+      rc = inflate (zs, Z_FINISH);
+      if (rc == Z_STREAM_END)
+	break;
+      if (rc != Z_BUF_ERROR || zs->avail_out != 0)
+	return false;
+      size *= 2;
+    }
+  job->out_len = zs->total_out;
+  return zs->avail_in == 0;
+}
+#endif
+
+#if HAVE_ZSTD_H
+static bool
+zstd_compress (struct zfilter *z, struct zworker *w, struct zjob *job)
+{
+  ZSTD_outBuffer out;
+
+  if (!w->cctx)
+    {
+      w->cctx = ZSTD_createCCtx ();
+      if (!w->cctx)
+	return false;
+      ZSTD_CCtx_setParameter (w->cctx, ZSTD_c_compressionLevel, z->level);
+      ZSTD_CCtx_setParameter (w->cctx, ZSTD_c_checksumFlag, 1);
+    }
+  else
+    ZSTD_CCtx_reset (w->cctx, ZSTD_reset_session_only);
+  /* Record the content size in the frame header.  */
+  ZSTD_CCtx_setPledgedSrcSize (w->cctx, job->in_size);
+
+  out.size = ZSTD_compressBound (job->in_size);
+  out.dst = job->out = malloc (out.size);
+  out.pos = 0;
+  if (!job->out)
+    return false;
+  for (idx_t i = 0; i < job->nrec; i++)
+    {
+      ZSTD_inBuffer in = { job->rec[i], job->len[i], 0 };
+      ZSTD_EndDirective mode = i + 1 == job->nrec ? ZSTD_e_end
+	                                            : ZSTD_e_continue;
+      size_t rc;
+      do
+	{
+	  rc = ZSTD_compressStream2 (w->cctx, &out, &in, mode);
+	  if (ZSTD_isError (rc))
+	    return false;
+	}
+      while (in.pos < in.size || (mode == ZSTD_e_end && rc != 0));
+    }
+  job->out_len = out.pos;
+  return true;
+}
+
+static bool
+zstd_decompress (struct zworker *w, struct zjob *job)
+{
+  idx_t size = job->expect >= 0 ? job->expect : 4 * job->in_size;
+  ZSTD_inBuffer in = { job->in, job->in_size, 0 };
+  ZSTD_outBuffer out = { nullptr, 0, 0 };
+  size_t rc;
+
+  if (!w->dctx)
+    {
+      w->dctx = ZSTD_createDCtx ();
+      if (!w->dctx)
+	return false;
+    }
+  else
+    ZSTD_DCtx_reset (w->dctx, ZSTD_reset_session_only);
+
+  do
+    {
+      if (out.pos == out.size)
+	{
+	  if (out.size)
+	    size *= 2;
+	  if (!job_out_grow (job, size + 1))
+	    return false;
+	  out.dst = job->out;
+	  out.size = size + 1;
+	}
+      rc = ZSTD_decompressStream (w->dctx, &out, &in);
+      if (ZSTD_isError (rc))
+	return false;
+    }
+  while (rc != 0);
+  job->out_len = out.pos;
+  return in.pos == in.size;
+}
+#endif
+
+static void
+job_free (struct zfilter *z, struct zjob *job)
+{
+  for (idx_t i = 0; i < job->nrec; i++)
+    paxbuf_layer_release (z->next, job->rec[i]);
+  free (job->rec);
+  free (job->len);
+  free (job->in);
+  free (job->out);
+  free (job);
+}
+
+
+/* Worker pool */
+
+static bool
+job_process (struct zfilter *z, struct zworker *w, struct zjob *job)
+{
+  switch (z->codec)
+    {
+#if HAVE_ZLIB_H
+    case PAXBUF_GZIP:
+      return z->decode ? gzip_decompress (w, job) : gzip_compress (z, w, job);
+#endif
+#if HAVE_ZSTD_H
+    case PAXBUF_ZSTD:
+      return z->decode ? zstd_decompress (w, job) : zstd_compress (z, w, job);
+#endif
+    }
+  return false;
+}
+
+static void *
+worker (void *closure)
+{
+  struct zfilter *z = closure;
+  struct zworker w;
+
+  memset (&w, 0, sizeof w);
+  pthread_mutex_lock (&z->mutex);
+  for (;;)
+    {
+      while (!z->queue_head && !z->stop)
+	pthread_cond_wait (&z->work, &z->mutex);
+      if (!z->queue_head)
+	break;
+      struct zjob *job = z->queue_head;
+      z->queue_head = job->next;
+      pthread_mutex_unlock (&z->mutex);
+
+      bool ok = job_process (z, &w, job);
+
+      /* The input is no longer needed.  */
+      for (idx_t i = 0; i < job->nrec; i++)
+	paxbuf_layer_release (z->next, job->rec[i]);
+      job->nrec = 0;
+      free (job->in);
+      job->in = nullptr;
+
+      pthread_mutex_lock (&z->mutex);
+      job->failed = !ok;
+      job->done = true;
+      pthread_cond_broadcast (&z->done);
+    }
+  pthread_mutex_unlock (&z->mutex);
+
+#if HAVE_ZLIB_H
+  if (w.zs_init)
+    {
+      if (z->decode)
+	inflateEnd (&w.zs);
+      else
+	deflateEnd (&w.zs);
+    }
+#endif
+#if HAVE_ZSTD_H
+  ZSTD_freeCCtx (w.cctx);
+  ZSTD_freeDCtx (w.dctx);
+#endif
+  return nullptr;
+}
+
+static int
+workers_start (struct zfilter *z)
+{
+  z->threads = calloc (z->nthreads, sizeof z->threads[0]);
+  if (!z->threads)
+    return ENOMEM;
+  for (int i = 0; i < z->nthreads; i++)
+    {
+      int rc = pthread_create (&z->threads[i], nullptr, worker, z);
+      if (rc)
+	{
+	  if (i == 0)
+	    {
+	      free (z->threads);
+	      z->threads = nullptr;
+	      return rc;
+	    }
+	  /* Do with the ones already running.  */
+	  z->nthreads = i;
+	  break;
+	}
+    }
+  return 0;
+}
+
+static void
+workers_stop (struct zfilter *z)
+{
+  if (!z->threads)
+    return;
+  pthread_mutex_lock (&z->mutex);
+  z->stop = true;
+  pthread_cond_broadcast (&z->work);
+  pthread_mutex_unlock (&z->mutex);
+  for (int i = 0; i < z->nthreads; i++)
+    pthread_join (z->threads[i], nullptr);
+  free (z->threads);
+  z->threads = nullptr;
+  z->stop = false;
+}
+
+/* Queue JOB for processing.  */
+static int
+job_submit (struct zfilter *z, struct zjob *job)
+{
+  if (!z->threads)
+    {
+      int rc = workers_start (z);
+      if (rc)
+	return rc;
+    }
+  if (z->order_tail)
+    z->order_tail->order = job;
+  else
+    z->order_head = job;
+  z->order_tail = job;
+  z->inflight++;
+
+  pthread_mutex_lock (&z->mutex);
+  if (z->queue_head)
+    z->queue_tail->next = job;
+  else
+    z->queue_head = job;
+  z->queue_tail = job;
+  pthread_cond_signal (&z->work);
+  pthread_mutex_unlock (&z->mutex);
+  return 0;
+}
+
+/* Remove the first job in stream order, waiting for it to finish if
+   WAIT is true.  Return nullptr if there is none, or if it is not
+   finished and WAIT is false.  */
+static struct zjob *
+job_next (struct zfilter *z, bool wait)
+{
+  struct zjob *job = z->order_head;
+  bool done;
+
+  if (!job)
+    return nullptr;
+  pthread_mutex_lock (&z->mutex);
+  while (!job->done && wait)
+    pthread_cond_wait (&z->done, &z->mutex);
+  done = job->done;
+  pthread_mutex_unlock (&z->mutex);
+  if (!done)
+    return nullptr;
+
+  z->order_head = job->order;
+  if (!z->order_head)
+    z->order_tail = nullptr;
+  z->inflight--;
+  return job;
+}
+
+/* Discard all jobs in progress.  */
+static void
+jobs_cancel (struct zfilter *z)
+{
+  struct zjob *job;
+
+  /* Jobs not picked up by a worker yet are dropped right away.  */
+  pthread_mutex_lock (&z->mutex);
+  for (job = z->queue_head; job; job = job->next)
+    job->done = job->failed = true;
+  z->queue_head = z->queue_tail = nullptr;
+  pthread_mutex_unlock (&z->mutex);
+
+  while ((job = job_next (z, true)))
+    job_free (z, job);
+}
+
+static void
+zfilter_destroy (void *closure)
+{
+  struct zfilter *z = closure;
+
+  jobs_cancel (z);
+  workers_stop (z);
+  if (z->cur)
+    job_free (z, z->cur);
+  if (z->emit)
+    job_free (z, z->emit);
+  if (z->rec)
+    paxbuf_layer_release (z->next, z->rec);
+#if HAVE_ZLIB_H
+  if (z->zs_init)
+    inflateEnd (&z->zs);
+#endif
+  free (z->in);
+  free (z->index);
+  pthread_cond_destroy (&z->done);
+  pthread_cond_destroy (&z->work);
+  pthread_mutex_destroy (&z->mutex);
+  free (z);
+}
+
+static struct zfilter *
+zfilter_create (int threads)
+{
+  struct zfilter *z = calloc (1, sizeof *z);
+  if (!z)
+    return nullptr;
+  if (threads <= 0)
+    {
+      long n = sysconf (_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? n : 1;
+    }
+  z->nthreads = threads;
+  pthread_mutex_init (&z->mutex, nullptr);
+  pthread_cond_init (&z->work, nullptr);
+  pthread_cond_init (&z->done, nullptr);
+  return z;
+}
+
+
+/* Compression */
+
+/* Copy SIZE bytes of compressed DATA to output records, passing the
+   full ones to NEXT.  */
+static pax_io_status_t
+output (struct zfilter *z, paxbuf_layer_t next, char const *data,
+	idx_t size)
+{
+  idx_t record_size = paxbuf_layer_record_size (next);
+
+  while (size > 0)
+    {
+      if (!z->rec)
+	{
+	  z->rec = paxbuf_layer_alloc (next);
+	  if (!z->rec)
+	    {
+	      errno = ENOMEM;
+	      return pax_io_failure;
+	    }
+	  z->rec_level = 0;
+	}
+      idx_t n = record_size - z->rec_level;
+      if (n > size)
+	n = size;
+      memcpy (z->rec + z->rec_level, data, n);
+      z->rec_level += n;
+      data += n;
+      size -= n;
+      if (z->rec_level == record_size)
+	{
+	  char *p = z->rec;
+	  z->rec = nullptr;
+	  if (paxbuf_layer_write (next, p, record_size) != pax_io_success)
+	    return pax_io_failure;
+	}
+    }
+  return pax_io_success;
+}
+
+/* Write out the finished jobs at the head of the stream.  If ALL is
+   true, wait for all jobs; otherwise wait only while too many are in
+   progress.  */
+static pax_io_status_t
+emit (struct zfilter *z, paxbuf_layer_t next, bool all)
+{
+  pax_io_status_t status = pax_io_success;
+  struct zjob *job;
+
+  while ((job = job_next (z, all || z->inflight > 2 * z->nthreads)))
+    {
+      if (status == pax_io_success)
+	{
+	  if (job->failed)
+	    {
+	      errno = ENOMEM;
+	      status = pax_io_failure;
+	    }
+	  else
+	    status = output (z, next, job->out, job->out_len);
+	}
+      job_free (z, job);
+    }
+  return status;
+}
+
+static pax_io_status_t
+compress_write (void *closure, paxbuf_layer_t next, char *data, idx_t size)
+{
+  struct zfilter *z = closure;
+  struct zjob *job;
+
+  /* Workers release the input records to this layer.  */
+  if (!z->next)
+    z->next = next;
+  if (size == 0)
+    {
+      paxbuf_layer_release (next, data);
+      return pax_io_success;
+    }
+  if (!z->cur)
+    {
+      z->cur = calloc (1, sizeof *z->cur);
+      if (!z->cur)
+	{
+	  paxbuf_layer_release (next, data);
+	  errno = ENOMEM;
+	  return pax_io_failure;
+	}
+    }
+  job = z->cur;
+  if (job->nrec == job->nalloc)
+    {
+      idx_t n = job->nalloc ? 2 * job->nalloc : 16;
+      char **rec = ireallocarray (job->rec, n, sizeof rec[0]);
+      if (rec)
+	job->rec = rec;
+      idx_t *len = rec ? ireallocarray (job->len, n, sizeof len[0])
+	                 : nullptr;
+      if (!len)
+	{
+	  paxbuf_layer_release (next, data);
+	  errno = ENOMEM;
+	  return pax_io_failure;
+	}
+      job->len = len;
+      job->nalloc = n;
+    }
+  job->rec[job->nrec] = data;
+  job->len[job->nrec] = size;
+  job->nrec++;
+  job->in_size += size;
+
+  if (job->in_size >= COMPRESS_BLOCK_SIZE)
+    {
+      int rc = job_submit (z, job);
+      if (rc)
+	{
+	  errno = rc;
+	  return pax_io_failure;
+	}
+      z->cur = nullptr;
+    }
+  return emit (z, next, false);
+}
+
+static pax_io_status_t
+compress_flush (void *closure, paxbuf_layer_t next)
+{
+  struct zfilter *z = closure;
+  pax_io_status_t status;
+
+  if (z->cur)
+    {
+      int rc = job_submit (z, z->cur);
+      if (rc)
+	{
+	  job_free (z, z->cur);
+	  z->cur = nullptr;
+	  errno = rc;
+	  return pax_io_failure;
+	}
+      z->cur = nullptr;
+    }
+  status = emit (z, next, true);
+  if (z->rec)
+    {
+      char *p = z->rec;
+      z->rec = nullptr;
+      if (status == pax_io_success)
+	status = paxbuf_layer_write (next, p, z->rec_level);
+      else
+	paxbuf_layer_release (next, p);
+    }
+  return status;
+}
+
+static struct paxbuf_filter compress_filter = {
+  .write = compress_write,
+  .flush = compress_flush,
+  .destroy = zfilter_destroy
+};
+
+/* Compress the data written to BUF with CODEC at the given LEVEL (-1
+   selects the default one), using THREADS worker threads (0 means one
+   per processor).  Return 0 on success and an error code otherwise;
+   ENOSYS means that CODEC is not supported.  */
+int
+paxbuf_push_compress (paxbuf_t buf, int codec, int level, int threads)
+{
+  struct zfilter *z;
+
+  if (!(paxbuf_get_mode (buf) & PAXBUF_WRITE))
+    return EINVAL;
+  switch (codec)
+    {
+#if HAVE_ZLIB_H
+    case PAXBUF_GZIP:
+      if (level < 0)
+	level = Z_DEFAULT_COMPRESSION;
+      break;
+#endif
+#if HAVE_ZSTD_H
+    case PAXBUF_ZSTD:
+      if (level < 0)
+	level = ZSTD_CLEVEL_DEFAULT;
+      break;
+#endif
+    default:
+      return ENOSYS;
+    }
+
+  z = zfilter_create (threads);
+  if (!z)
+    return ENOMEM;
+  z->codec = codec;
+  z->level = level;
+  return paxbuf_push_filter (buf, &compress_filter, z);
+}
+
+
+/* Decompression */
+
+/* Read from NEXT until at least NEED bytes of input are available or
+   the input is exhausted.  */
+static pax_io_status_t
+input_fill (struct zfilter *z, paxbuf_layer_t next, idx_t need)
+{
+  while (z->in_end - z->in_start < need && !z->in_eof)
+    {
+      char *p;
+      idx_t n, skip;
+      pax_io_status_t status = paxbuf_layer_read (next, &p, &n);
+
+      if (status == pax_io_failure)
+	{
+	  if (p)
+	    paxbuf_layer_release (next, p);
+	  return status;
+	}
+      if (status == pax_io_eof)
+	z->in_eof = true;
+
+      skip = z->in_skip < n ? z->in_skip : n;
+      z->in_skip -= skip;
+      n -= skip;
+      if (z->in_end + n > z->in_alloc)
+	{
+	  memmove (z->in, z->in + z->in_start, z->in_end - z->in_start);
+	  z->in_end -= z->in_start;
+	  z->in_start = 0;
+	  if (z->in_end + n > z->in_alloc)
+	    {
+	      idx_t size = 2 * z->in_alloc;
+	      if (size < z->in_end + n)
+		size = z->in_end + n;
+	      char *in = irealloc (z->in, size);
+	      if (!in)
+		{
+		  paxbuf_layer_release (next, p);
+		  errno = ENOMEM;
+		  return pax_io_failure;
+		}
+	      z->in = in;
+	      z->in_alloc = size;
+	    }
+	}
+      memcpy (z->in + z->in_end, p + skip, n);
+      z->in_end += n;
+      paxbuf_layer_release (next, p);
+    }
+  return pax_io_success;
+}
+
+static void
+input_consume (struct zfilter *z, idx_t size)
+{
+  z->in_start += size;
+  z->in_off += size;
+}
+
+/* Remember that decoding can start at IN to obtain the data at OUT.  */
+static void
+index_add (struct zfilter *z, off_t in, off_t out)
+{
+  if (z->nindex > 0 && z->index[z->nindex - 1].in >= in)
+    return;
+  if (z->nindex == z->index_alloc)
+    {
+      idx_t n = z->index_alloc ? 2 * z->index_alloc : 64;
+      struct seek_point *p = ireallocarray (z->index, n, sizeof p[0]);
+      if (!p)
+	return;
+      z->index = p;
+      z->index_alloc = n;
+    }
+  z->index[z->nindex].in = in;
+  z->index[z->nindex].out = out;
+  z->nindex++;
+}
+
+/* Note that the stream is in the CODEC format.  The format is taken
+   from the first frame, before any worker starts; it may not change
+   afterwards.  */
+static bool
+codec_set (struct zfilter *z, int codec)
+{
+  if (!z->codec)
+    z->codec = codec;
+  else if (z->codec != codec)
+    {
+      errno = EILSEQ;
+      return false;
+    }
+  return true;
+}
+
+/* Locate the next frame in the input.  Return 1 and store its
+   compressed size in *CSIZE and the size of its data, or -1 if not
+   known, in *USIZE if a frame is found.  Return 0 at end of input, 2
+   if the frame has to be decoded serially, and -1 on error.  */
+static int
+frame_next (struct zfilter *z, paxbuf_layer_t next,
+	    idx_t *csize, idx_t *usize)
+{
+  unsigned char *u;
+  idx_t avail;
+
+  for (;;)
+    {
+      if (input_fill (z, next, GZ_HEADER_SIZE) != pax_io_success)
+	return -1;
+      u = (unsigned char *) z->in + z->in_start;
+      avail = z->in_end - z->in_start;
+      if (avail == 0)
+	return 0;
+      if (u[0] != 0)
+	break;
+      /* Skip the zero padding of the last record.  */
+      idx_t i;
+      for (i = 1; i < avail && u[i] == 0; i++)
+	;
+      input_consume (z, i);
+    }
+
+  if (avail >= 2 && u[0] == 0x1f && u[1] == 0x8b)
+    {
+      if (!codec_set (z, PAXBUF_GZIP))
+	return -1;
+      if (avail >= GZ_HEADER_SIZE
+	  && (u[3] & 4) && u[10] + (u[11] << 8) >= 12
+	  && u[12] == 'P' && u[13] == 'X' && u[14] == 8 && u[15] == 0)
+	{
+	  *csize = get_le32 (u + 16);
+	  *usize = get_le32 (u + 20);
+	  if (*usize == 0)
+	    *usize = -1;
+	  if (*csize >= GZ_HEADER_SIZE + GZ_TRAILER_SIZE)
+	    {
+	      if (input_fill (z, next, *csize) != pax_io_success)
+		return -1;
+	      if (z->in_end - z->in_start < *csize)
+		{
+		  errno = EILSEQ;
+		  return -1;
+		}
+	      return 1;
+	    }
+	}
+      return 2;
+    }
+
+#if HAVE_ZSTD_H
+  if (avail >= 4
+      && (get_le32 (u) == ZSTD_MAGICNUMBER
+	  || (get_le32 (u) & ZSTD_MAGIC_SKIPPABLE_MASK)
+	     == ZSTD_MAGIC_SKIPPABLE_START))
+    {
+      size_t n;
+      unsigned long long size;
+
+      if (!codec_set (z, PAXBUF_ZSTD))
+	return -1;
+      for (;;)
+	{
+	  n = ZSTD_findFrameCompressedSize (u, avail);
+	  if (!ZSTD_isError (n))
+	    break;
+	  if (ZSTD_getErrorCode (n) != ZSTD_error_srcSize_wrong || z->in_eof)
+	    {
+	      errno = EILSEQ;
+	      return -1;
+	    }
+	  if (input_fill (z, next, avail + 1) != pax_io_success)
+	    return -1;
+	  u = (unsigned char *) z->in + z->in_start;
+	  avail = z->in_end - z->in_start;
+	}
+      *csize = n;
+      size = ZSTD_getFrameContentSize (u, avail);
+      *usize = size <= IDX_MAX ? size : -1;
+      return 1;
+    }
+#endif
+
+  errno = EILSEQ;
+  return -1;
+}
+
+/* Queue the frames that follow for decoding, keeping at most twice as
+   many jobs in progress as there are workers.  */
+static pax_io_status_t
+dispatch (struct zfilter *z, paxbuf_layer_t next)
+{
+  while (!z->end && !z->serial && z->inflight < 2 * z->nthreads)
+    {
+      idx_t csize, usize;
+      struct zjob *job;
+
+      switch (frame_next (z, next, &csize, &usize))
+	{
+	case -1:
+	  return pax_io_failure;
+
+	case 0:
+	  z->end = true;
+	  return pax_io_success;
+
+	case 2:
+	  z->serial = true;
+	  return pax_io_success;
+	}
+
+      if (z->out_off >= 0)
+	index_add (z, z->in_off, z->out_off);
+
+      /* Frames that end before the target need not be decoded.  */
+      if (z->out_off >= 0 && usize >= 0 && z->out_off + usize <= z->target
+	  && !z->order_head)
+	{
+	  input_consume (z, csize);
+	  z->out_off += usize;
+	  z->out_pos = z->out_off;
+	  continue;
+	}
+
+      job = calloc (1, sizeof *job);
+      if (job)
+	{
+	  job->in = malloc (csize);
+	  if (!job->in)
+	    {
+	      free (job);
+	      job = nullptr;
+	    }
+	}
+      if (!job)
+	{
+	  errno = ENOMEM;
+	  return pax_io_failure;
+	}
+      memcpy (job->in, z->in + z->in_start, csize);
+      job->in_size = csize;
+      job->in_off = z->in_off;
+      job->out_off = z->out_off;
+      job->expect = usize;
+      input_consume (z, csize);
+      z->out_off = z->out_off >= 0 && usize >= 0 ? z->out_off + usize : -1;
+
+      int rc = job_submit (z, job);
+      if (rc)
+	{
+	  job_free (z, job);
+	  errno = rc;
+	  return pax_io_failure;
+	}
+    }
+  return pax_io_success;
+}
+
+/* Inflate the input in the calling thread into REC, until it holds
+   SIZE bytes.  Store the resulting number of bytes in *LEVEL.  This
+   is used for gzip members without sizes.  */
+static pax_io_status_t
+serial_read (struct zfilter *z, paxbuf_layer_t next, char *rec, idx_t size,
+	     idx_t *level)
+{
+#if HAVE_ZLIB_H
+  z_stream *zs = &z->zs;
+
+  if (!z->zs_init)
+    {
+      if (inflateInit2 (zs, 16 + MAX_WBITS) != Z_OK)
+	{
+	  errno = ENOMEM;
+	  return pax_io_failure;
+	}
+      z->zs_init = true;
+    }
+
+  while (*level < size)
+    {
+      if (input_fill (z, next, 1) != pax_io_success)
+	return pax_io_failure;
+      if (z->in_end == z->in_start)
+	{
+	  if (z->member)
+	    {
+	      errno = EILSEQ;
+	      return pax_io_failure;
+	    }
+	  return pax_io_eof;
+	}
+      if (!z->member && z->in[z->in_start] == 0)
+	{
+	  /* Zero padding after the last member */
+	  input_consume (z, 1);
+	  continue;
+	}
+
+      zs->next_in = (Bytef *) z->in + z->in_start;
+      zs->avail_in = z->in_end - z->in_start;
+      zs->next_out = (Bytef *) rec + *level;
+      zs->avail_out = size - *level;
+      int rc = inflate (zs, Z_NO_FLUSH);
+      input_consume (z, z->in_end - z->in_start - zs->avail_in);
+      idx_t n = size - *level - zs->avail_out;
+      z->member = true;
+      if (rc == Z_STREAM_END)
+	{
+	  inflateReset (zs);
+	  z->member = false;
+	}
+      else if (rc != Z_OK && rc != Z_BUF_ERROR)
+	{
+	  errno = EILSEQ;
+	  return pax_io_failure;
+	}
+
+      if (z->out_pos < z->target)
+	{
+	  idx_t drop = z->target - z->out_pos < n ? z->target - z->out_pos : n;
+	  memmove (rec + *level, rec + *level + drop, n - drop);
+	  z->out_pos += drop;
+	  n -= drop;
+	}
+      z->out_pos += n;
+      *level += n;
+    }
+  return pax_io_success;
+#else
+  errno = ENOSYS;
+  return pax_io_failure;
+#endif
+}
+
+static pax_io_status_t
+decompress_read (void *closure, paxbuf_layer_t next, char **data,
+		 idx_t *size)
+{
+  struct zfilter *z = closure;
+  idx_t record_size = paxbuf_layer_record_size (next);
+  pax_io_status_t status = pax_io_success;
+  char *rec;
+  idx_t level = 0;
+
+  if (!z->next)
+    z->next = next;
+  *data = rec = paxbuf_layer_alloc (next);
+  *size = 0;
+  if (!rec)
+    {
+      errno = ENOMEM;
+      return pax_io_failure;
+    }
+
+  while (level < record_size)
+    {
+      if (z->emit)
+	{
+	  struct zjob *job = z->emit;
+	  idx_t n = job->out_len - z->emit_pos;
+
+	  if (n == 0)
+	    {
+	      job_free (z, job);
+	      z->emit = nullptr;
+	      continue;
+	    }
+	  if (z->out_pos < z->target)
+	    {
+	      if (n > z->target - z->out_pos)
+		n = z->target - z->out_pos;
+	    }
+	  else
+	    {
+	      if (n > record_size - level)
+		n = record_size - level;
+	      memcpy (rec + level, job->out + z->emit_pos, n);
+	      level += n;
+	    }
+	  z->emit_pos += n;
+	  z->out_pos += n;
+	  continue;
+	}
+
+      if (z->serial && !z->order_head)
+	{
+	  status = serial_read (z, next, rec, record_size, &level);
+	  break;
+	}
+      if (dispatch (z, next) != pax_io_success)
+	{
+	  status = pax_io_failure;
+	  break;
+	}
+      if (!z->order_head)
+	{
+	  if (z->serial)
+	    continue;
+	  status = pax_io_eof;
+	  break;
+	}
+
+      struct zjob *job = job_next (z, true);
+      if (job->failed)
+	{
+	  job_free (z, job);
+	  errno = EILSEQ;
+	  status = pax_io_failure;
+	  break;
+	}
+      if (job->out_off >= 0)
+	z->out_pos = job->out_off;
+      else
+	index_add (z, job->in_off, z->out_pos);
+      z->emit = job;
+      z->emit_pos = 0;
+    }
+
+  *size = level;
+  return status;
+}
+
+/* Position the stream at OFFSET of the decompressed data.  Decoding
+   resumes at the nearest known frame before it; if OFFSET is beyond
+   the indexed part, the frames in between are only parsed.  */
+static int
+decompress_seek (void *closure, paxbuf_layer_t next, off_t offset)
+{
+  struct zfilter *z = closure;
+  idx_t record_size = paxbuf_layer_record_size (next);
+  struct seek_point p = { 0, 0 };
+  idx_t lo = 0, hi = z->nindex;
+
+  jobs_cancel (z);
+  if (z->emit)
+    {
+      job_free (z, z->emit);
+      z->emit = nullptr;
+    }
+
+  /* Find the last point at or before OFFSET.  */
+  while (lo < hi)
+    {
+      idx_t mid = lo + (hi - lo) / 2;
+      if (z->index[mid].out <= offset)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if (lo > 0)
+    p = z->index[lo - 1];
+
+  if (paxbuf_layer_seek (next, p.in - p.in % record_size))
+    return -1;
+  z->in_start = z->in_end = 0;
+  z->in_skip = p.in % record_size;
+  z->in_off = p.in;
+  z->in_eof = false;
+  z->end = false;
+  z->out_off = z->out_pos = p.out;
+  z->target = offset;
+  z->serial = z->member = false;
+#if HAVE_ZLIB_H
+  if (z->zs_init)
+    inflateReset (&z->zs);
+#endif
+  return 0;
+}
+
+static struct paxbuf_filter decompress_filter = {
+  .read = decompress_read,
+  .seek = decompress_seek,
+  .destroy = zfilter_destroy
+};
+
+/* Decompress the data read from BUF, using THREADS worker threads (0
+   means one per processor).  The format, gzip or zstd, is detected
+   from the data.  Return 0 on success and an error code otherwise.  */
+int
+paxbuf_push_decompress (paxbuf_t buf, int threads)
+{
+  struct zfilter *z;
+
+  if (!(paxbuf_get_mode (buf) & PAXBUF_READ))
+    return EINVAL;
+#if !HAVE_ZLIB_H && !HAVE_ZSTD_H
+  return ENOSYS;
+#endif
+  z = zfilter_create (threads);
+  if (!z)
+    return ENOMEM;
+  z->decode = true;
+  return paxbuf_push_filter (buf, &decompress_filter, z);
+}
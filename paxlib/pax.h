@@ -61,7 +61,80 @@ int rmt_ioctl (int handle, unsigned long int operation, char *argument);
 
 
 /* Tar-specific functions */
+
+/* Additional mode flags for tar_archive_create */
+#define TAR_URING 0x100   /* Use io_uring for local archives, if possible */
+#define TAR_MMAP  0x200   /* Map local archives opened for reading */
+#define TAR_DIRECT 0x400  /* Open local archives with O_DIRECT */
+
+/* Traditional blocking factor.  A blocking factor of 0 given to
+   tar_archive_create selects the one best suited for the archive when
+   it is opened, starting from this value.  */
+#define TAR_DEFAULT_BFACTOR 20
+
 void tar_archive_create (paxbuf_t *pbuf, const char *filename,
 			 int remote, int mode, idx_t bfactor);
 void tar_set_rmt (paxbuf_t pbuf, const char *rmt);
 void tar_set_rsh (paxbuf_t pbuf, const char *rsh);
+off_t tar_archive_size (paxbuf_t pbuf);
+
+typedef char *(*tar_volume_fp) (void *closure, idx_t volno);
+int tar_set_volumes (paxbuf_t pbuf, tar_volume_fp fn, void *closure);
+
+/* Header iterator */
+#define TAR_ITER_SEEK 0x1  /* Skip member data by seeking */
+
+typedef struct tar_iterator *tar_iterator_t;
+
+int tar_iterator_create (tar_iterator_t *ret, paxbuf_t buf, int flags);
+void tar_iterator_destroy (tar_iterator_t *it);
+pax_io_status_t tar_iterator_next (tar_iterator_t it,
+				   struct tar_stat_info **ret);
+pax_io_status_t tar_iterator_read (tar_iterator_t it, char *data, idx_t size,
+				   idx_t *rsize);
+int tar_iterator_seek (tar_iterator_t it, off_t offset);
+off_t tar_iterator_sync (tar_iterator_t it, off_t offset, off_t limit);
+union block const *tar_iterator_header (tar_iterator_t it);
+off_t tar_iterator_offset (tar_iterator_t it);
+bool tar_iterator_has_global (tar_iterator_t it);
+
+/* Member index */
+#define PAXINDEX_NAME "././@PaxIndex"     /* Name of the global extended
+					     header holding an embedded
+					     index */
+
+typedef struct tar_index *tar_index_t;
+typedef struct tar_index_builder *tar_index_builder_t;
+
+struct tar_index_entry
+{
+  char const *name;         /* Member name */
+  off_t offset;             /* Offset of its first header block */
+  off_t size;               /* Size of its data in the archive */
+  char typeflag;            /* Its type */
+};
+
+void tar_index_builder_create (tar_index_builder_t *ret);
+void tar_index_builder_destroy (tar_index_builder_t *b);
+int tar_index_builder_add (tar_index_builder_t b, char const *name,
+			   off_t offset, off_t size, char typeflag);
+int tar_index_builder_write (tar_index_builder_t b, int fd);
+int tar_index_builder_mark (tar_index_builder_t b, paxbuf_t buf,
+			    char const *name, off_t size, char typeflag);
+int tar_index_builder_finish (tar_index_builder_t b, paxbuf_t buf);
+int tar_index_build (paxbuf_t buf, int flags, char const *file);
+
+int tar_index_open (tar_index_t *ret, char const *file);
+int tar_index_load (tar_index_t *ret, paxbuf_t buf, off_t size);
+void tar_index_close (tar_index_t *idx);
+idx_t tar_index_count (tar_index_t idx);
+bool tar_index_get (tar_index_t idx, idx_t i, struct tar_index_entry *ent);
+bool tar_index_lookup (tar_index_t idx, char const *name,
+		       struct tar_index_entry *ent);
+
+/* Parallel listing */
+typedef int (*tar_scan_fp) (void *closure, struct tar_stat_info *st,
+			    off_t offset, char typeflag);
+
+int tar_scan (char const *filename, int threads,
+	      tar_scan_fp fn, void *closure);
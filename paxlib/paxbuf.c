@@ -22,10 +22,30 @@
 #endif
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <gettext.h>
 #include <system.h>
 #include <ialloc.h>
+#include <gethrxtime.h>
 #include <paxbuf.h>
+#include <paxpool.h>
+#include <full-write.h>
+#include <safe-read.h>
+
+/* A layer of the filter stack.  The bottom one stands for the
+   transport and has no filter.  */
+struct paxbuf_layer
+{
+  struct paxbuf_filter const *filter; /* Filter operations */
+  void *closure;              /* Filter data */
+  paxbuf_t buf;               /* Buffer the layer belongs to */
+  struct paxbuf_layer *next;  /* Layer below this one */
+};
+
+/* Number of free records kept for reuse by the filters */
+enum { SPARE_MAX = 16 };
 
 /* PAX buffer structure */
 struct pax_buffer
@@ -33,7 +53,15 @@ struct pax_buffer
   idx_t record_size;	      /* Size of a record, bytes */
   idx_t record_level;	      /* Number of bytes stored in the record */
   idx_t pos;		      /* Current position in buffer */
+  off_t offset;               /* Archive offset of the start of record,
+				 or -1 if unknown after a failed seek */
+  int seek_errno;             /* Value of errno after that seek */
   char  *record;              /* Record buffer, record_size bytes long */
+  int record_kind;            /* How record buffers are allocated */
+  idx_t record_alloc_size;    /* Size they are allocated with */
+  idx_t record_map_size;      /* Size of mapped record buffers */
+  int record_map_flags;       /* Additional mmap flags for them */
+  bool probe;                 /* Take record size from the next read */
 
   int status;                 /* Return code from the latest I/O */
 
@@ -41,6 +69,14 @@ struct pax_buffer
   paxbuf_io_fp writer;        /* Writes data */
   paxbuf_io_fp reader;        /* Reads data */
   paxbuf_seek_fp seek;        /* Seeks the underlying transport layer */
+  paxbuf_iov_fp readv;        /* Reads into a vector, if supported */
+  paxbuf_iov_fp writev;       /* Writes from a vector, if supported */
+  paxbuf_copy_fp copy_read;   /* Copies from the archive to a file, if
+				 supported */
+  paxbuf_copy_fp copy_write;  /* Copies from a file to the archive, if
+				 supported */
+  paxbuf_take_fp take;        /* Writes records it takes over, if
+				 supported */
     /* Terminal functions */
   paxbuf_term_fp open;        /* Open a new volume */
   paxbuf_term_fp close;       /* Close the existing volume */
@@ -50,8 +86,257 @@ struct pax_buffer
 
   void *closure;              /* Implementation-specific data */
   int mode;                   /* Working mode */
+
+    /* Asynchronous I/O */
+  idx_t async_depth;          /* Number of records in flight; 0 means
+				 synchronous I/O */
+  struct paxbuf_async *async; /* State of the I/O thread, if running */
+
+    /* Filters */
+  struct paxbuf_layer transport; /* Bottom of the filter stack */
+  struct paxbuf_layer *top;   /* Topmost layer */
+  pthread_mutex_t spare_mutex; /* Protects the members below */
+  char *spare[SPARE_MAX];     /* Free records */
+  idx_t nspare;               /* Number of them */
+
+  struct paxbuf_stats stats;  /* I/O statistics */
+};
+
+/* A record in the queue of the I/O thread */
+struct paxbuf_slot
+{
+  char *data;                 /* Record buffer, record_size bytes long */
+  idx_t level;                /* Number of bytes stored in it */
+  pax_io_status_t status;     /* Read status (read mode only) */
+  int errnum;                 /* Value of errno after the read */
+};
+
+/* Asynchronous I/O state.  The slots form a ring: COUNT slots starting
+   at HEAD hold queued records, the rest are free.  In write mode the
+   caller queues full records and the I/O thread writes them; the slot
+   at HEAD stays in the ring until the thread is done with it, so the
+   caller never reuses a record that is being transferred.  In read
+   mode the roles are reversed: the thread reads records into free
+   slots and the caller takes them from HEAD.  */
+struct paxbuf_async
+{
+  pthread_t thread;           /* I/O thread */
+  pthread_mutex_t mutex;      /* Protects the members below */
+  pthread_cond_t filled;      /* Signalled when a slot is queued */
+  pthread_cond_t drained;     /* Signalled when a slot is released */
+  struct paxbuf_slot *slot;   /* Ring of async_depth slots */
+  idx_t head;                 /* Index of the first queued slot */
+  idx_t count;                /* Number of queued slots */
+  bool stop;                  /* Terminate the thread */
+  bool done;                  /* Read mode: the thread has reached end
+				 of file or failed */
+  pax_io_status_t status;     /* First unsuccessful transfer status */
+  int errnum;                 /* Value of errno after it */
+};
+
+static pax_io_status_t async_stop (paxbuf_t buf);
+
+/* Statistics of the transport calls may be updated by the I/O thread,
+   so they are protected by its mutex while it runs.  */
+static void
+stats_lock (paxbuf_t buf)
+{
+  if (buf->async)
+    pthread_mutex_lock (&buf->async->mutex);
+}
+
+static void
+stats_unlock (paxbuf_t buf)
+{
+  if (buf->async)
+    pthread_mutex_unlock (&buf->async->mutex);
+}
+
+/* Account for a transport call that took TIME nanoseconds.  */
+static void
+stats_count_call (paxbuf_t buf, intmax_t *calls, intmax_t *shorts,
+		  intmax_t *nsec, bool is_short, xtime_t time)
+{
+  stats_lock (buf);
+  ++*calls;
+  *shorts += is_short;
+  *nsec += time;
+  stats_unlock (buf);
+}
+
+static void
+stats_count (paxbuf_t buf, intmax_t *counter)
+{
+  stats_lock (buf);
+  ++*counter;
+  stats_unlock (buf);
+}
+
+
+/* Record buffer allocation */
+
+enum
+  {
+    RECORD_MALLOC,            /* Allocated from the pool */
+    RECORD_ALIGNED,           /* Page-aligned, allocated from the pool */
+    RECORD_MMAP               /* Anonymous mapping */
+  };
+
+/* Huge pages are assumed to be 2 MiB, which is the only size
+   available for transparent huge pages.  */
+enum { HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+
+static char *
+record_mmap (paxbuf_t buf, int flags)
+{
+#ifdef MAP_ANONYMOUS
+  void *p = mmap (nullptr, buf->record_map_size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if (p != MAP_FAILED)
+    {
+# ifdef MADV_HUGEPAGE
+      if (flags == 0)
+	madvise (p, buf->record_map_size, MADV_HUGEPAGE);
+# endif
+      return p;
+    }
+#endif
+  return nullptr;
+}
+
+/* Allocate a record buffer.  The first call selects the allocation
+   method according to the mode flags, falling back to simpler ones if
+   huge pages are not available.  */
+static char *
+record_alloc (paxbuf_t buf)
+{
+  char *p;
+
+  switch (buf->record_kind)
+    {
+    case RECORD_MALLOC:
+    case RECORD_ALIGNED:
+      return paxpool_alloc (buf->record_alloc_size,
+			    buf->record_kind == RECORD_ALIGNED);
+
+    case RECORD_MMAP:
+      return record_mmap (buf, buf->record_map_flags);
+    }
+
+  /* First allocation.  The record size may shrink afterwards (see
+     paxbuf_probe_record_size), so the allocated size is kept.  */
+  buf->record_alloc_size = buf->record_size;
+  buf->record_map_flags = 0;
+  buf->record_map_size = (buf->record_size + HUGE_PAGE_SIZE - 1)
+                         / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#if defined MAP_HUGETLB && defined MAP_HUGE_SHIFT
+  if (buf->mode & PAXBUF_HUGETLB)
+    {
+      p = record_mmap (buf, MAP_HUGETLB | (21 << MAP_HUGE_SHIFT));
+      if (p)
+	{
+	  buf->record_kind = RECORD_MMAP;
+	  buf->record_map_flags = MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+	  return p;
+	}
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+  if (buf->mode & (PAXBUF_HUGEPAGE | PAXBUF_HUGETLB))
+    {
+      p = record_mmap (buf, 0);
+      if (p)
+	{
+	  buf->record_kind = RECORD_MMAP;
+	  return p;
+	}
+    }
+#endif
+  buf->record_kind = (buf->mode & (PAXBUF_ALIGN | PAXBUF_HUGEPAGE
+				   | PAXBUF_HUGETLB))
+                     ? RECORD_ALIGNED : RECORD_MALLOC;
+  return record_alloc (buf);
+}
+
+static void
+record_free (paxbuf_t buf, char *p)
+{
+  if (buf->record_kind == RECORD_MMAP)
+    {
+      if (p)
+	munmap (p, buf->record_map_size);
+    }
+  else
+    paxpool_free (p, buf->record_alloc_size,
+		  buf->record_kind == RECORD_ALIGNED);
+}
+
+/* The members of struct pax_buffer that tell how record buffers are
+   allocated */
+struct record_settings
+{
+  int kind;
+  idx_t alloc_size;
+  idx_t map_size;
+  int map_flags;
 };
 
+/* Exchange the allocation settings of BUF with those in *S.  */
+static void
+record_settings_swap (paxbuf_t buf, struct record_settings *s)
+{
+  struct record_settings t = { buf->record_kind, buf->record_alloc_size,
+			       buf->record_map_size, buf->record_map_flags };
+  buf->record_kind = s->kind;
+  buf->record_alloc_size = s->alloc_size;
+  buf->record_map_size = s->map_size;
+  buf->record_map_flags = s->map_flags;
+  *s = t;
+}
+
+/* True if the caller's memory at P can be passed to the transport
+   directly.  */
+static bool
+direct_ok (paxbuf_t buf, void const *p)
+{
+  return !(buf->mode & PAXBUF_ALIGN)
+         || (uintptr_t) p % sysconf (_SC_PAGESIZE) == 0;
+}
+
+/* Records passed between filters are recycled through a short list of
+   spare ones.  Filters may run in several threads, hence the lock.  */
+static char *
+spare_get (paxbuf_t buf)
+{
+  char *p = nullptr;
+
+  pthread_mutex_lock (&buf->spare_mutex);
+  if (buf->nspare > 0)
+    p = buf->spare[--buf->nspare];
+  pthread_mutex_unlock (&buf->spare_mutex);
+  return p ? p : record_alloc (buf);
+}
+
+static void
+spare_put (paxbuf_t buf, char *p)
+{
+  pthread_mutex_lock (&buf->spare_mutex);
+  if (buf->nspare < SPARE_MAX)
+    {
+      buf->spare[buf->nspare++] = p;
+      p = nullptr;
+    }
+  pthread_mutex_unlock (&buf->spare_mutex);
+  if (p)
+    record_free (buf, p);
+}
+
+static void
+spare_clear (paxbuf_t buf)
+{
+  while (buf->nspare > 0)
+    record_free (buf, buf->spare[--buf->nspare]);
+}
 
 /* Default callbacks. Do nothing useful, except bailing out */
 
@@ -131,24 +416,42 @@ paxbuf_create (paxbuf_t *pbuf, int mode, void *closure, idx_t record_size)
 {
   paxbuf_t buf;
 
-  buf = malloc (sizeof *buf);
+  buf = paxpool_alloc (sizeof *buf, false);
   if (!buf)
     return ENOMEM;
-  buf->record = imalloc (record_size);
+  buf->record_size = record_size;
+  buf->mode = mode;
+  buf->record_kind = -1;
+  buf->probe = false;
+  buf->record = record_alloc (buf);
   if (!buf->record)
     {
-      free (buf);
+      paxpool_free (buf, sizeof *buf, false);
       return ENOMEM;
     }
 
-  buf->record_size = record_size;
   buf->record_level = 0;
+  buf->pos = 0;
+  buf->offset = 0;
+  buf->seek_errno = 0;
   buf->closure = closure;
-  buf->mode = mode;
+  buf->transport.filter = nullptr;
+  buf->transport.closure = nullptr;
+  buf->transport.buf = buf;
+  buf->transport.next = nullptr;
+  buf->top = &buf->transport;
+  pthread_mutex_init (&buf->spare_mutex, nullptr);
+  buf->nspare = 0;
+  buf->async_depth = 0;
+  buf->async = nullptr;
+  memset (&buf->stats, 0, sizeof buf->stats);
 
   paxbuf_set_io (buf, default_reader, default_writer, default_seek);
   paxbuf_set_term (buf, default_open, default_close, default_destroy);
   paxbuf_set_wrapper (buf, default_wrapper);
+  paxbuf_set_iov (buf, nullptr, nullptr);
+  paxbuf_set_copy (buf, nullptr, nullptr);
+  paxbuf_set_take (buf, nullptr);
 
   *pbuf = buf;
   return 0;
@@ -158,10 +461,22 @@ void
 paxbuf_destroy (paxbuf_t *pbuf)
 {
   paxbuf_t buf = *pbuf;
-  free (buf->record);
+  async_stop (buf);
+  while (buf->top->filter)
+    {
+      struct paxbuf_layer *layer = buf->top;
+      buf->top = layer->next;
+      if (layer->filter->destroy)
+	layer->filter->destroy (layer->closure);
+      free (layer);
+    }
+  /* Filters may give records back when destroyed.  */
+  spare_clear (buf);
+  pthread_mutex_destroy (&buf->spare_mutex);
+  record_free (buf, buf->record);
   if (buf->destroy)
     buf->destroy (buf->closure);
-  free (buf);
+  paxpool_free (buf, sizeof *buf, false);
   *pbuf = nullptr;
 }
 
@@ -174,6 +489,45 @@ paxbuf_set_io (paxbuf_t buf,
   buf->seek = seek;
 }
 
+/* Set the vectored I/O functions.  These are optional.  */
+void
+paxbuf_set_iov (paxbuf_t buf, paxbuf_iov_fp rdv, paxbuf_iov_fp wrv)
+{
+  buf->readv = rdv;
+  buf->writev = wrv;
+}
+
+/* Set the functions that copy data between the archive and another
+   file descriptor inside the kernel.  These are optional.  Each one
+   transfers up to SIZE bytes at the current position of the transport
+   and fails with ENOTSUP if it cannot handle the descriptor given.
+   WRC only transfers whole records, leaving the descriptor and the
+   transport at the end of the last one.  */
+void
+paxbuf_set_copy (paxbuf_t buf, paxbuf_copy_fp rdc, paxbuf_copy_fp wrc)
+{
+  buf->copy_read = rdc;
+  buf->copy_write = wrc;
+}
+
+/* Set the function that writes whole records by taking them over,
+   instead of the writer.  This is optional.  TAKE owns the record it
+   is given, even on failure, and gives it back with
+   paxbuf_release_record once done with it, which may be after it
+   returns.  It never reports the end of a volume.  */
+void
+paxbuf_set_take (paxbuf_t buf, paxbuf_take_fp take)
+{
+  buf->take = take;
+}
+
+/* Give back a record taken over by the transport.  */
+void
+paxbuf_release_record (paxbuf_t buf, char *data)
+{
+  spare_put (buf, data);
+}
+
 void
 paxbuf_set_term (paxbuf_t buf,
 		 paxbuf_term_fp open, paxbuf_term_fp close,
@@ -190,142 +544,1352 @@ paxbuf_set_wrapper (paxbuf_t buf, paxbuf_wrapper_fp wrap)
   buf->wrapper = wrap;
 }
 
+/* Request asynchronous I/O with up to DEPTH records in flight.  A DEPTH
+   of 0 selects synchronous I/O.  This must be called before paxbuf_open.
+
+   In write mode, full records are handed to a background thread which
+   passes them to the writer while the caller fills the next one.  A
+   failure is reported by the next paxbuf_write or by paxbuf_close.
+
+   In read mode, the background thread keeps up to DEPTH records read
+   ahead, and paxbuf_read consumes them as they arrive.  Read errors
+   are reported when the caller reaches the failed record.
+
+   Notice that the reader or writer and the wrapper are then called
+   from that thread.  */
+int
+paxbuf_set_async (paxbuf_t buf, idx_t depth)
+{
+  if (depth < 0)
+    return EINVAL;
+  buf->async_depth = depth;
+  return 0;
+}
+
+/* Change the record size to SIZE.  This is possible only while the
+   buffer holds no data, e.g. from the open callback, once the
+   transport knows what suits the archive best.  */
+int
+paxbuf_set_record_size (paxbuf_t buf, idx_t size)
+{
+  if (size <= 0)
+    return EINVAL;
+  if (buf->record_level != 0 || buf->pos != 0 || buf->async)
+    return EBUSY;
+  if (size != buf->record_size)
+    {
+      struct record_settings settings = { .kind = -1 };
+      char *old_record = buf->record;
+      idx_t old_size = buf->record_size;
+      char *record;
+
+      spare_clear (buf);
+      record_settings_swap (buf, &settings);
+      buf->record_size = size;
+      record = record_alloc (buf);
+      if (!record)
+	{
+	  buf->record_size = old_size;
+	  record_settings_swap (buf, &settings);
+	  return ENOMEM;
+	}
+
+      /* Free the old record the way it was allocated.  */
+      record_settings_swap (buf, &settings);
+      record_free (buf, old_record);
+      record_settings_swap (buf, &settings);
+      buf->record = record;
+    }
+  return 0;
+}
+
+/* Take the record size from the first successful read.  This is meant
+   for devices that preserve record boundaries, such as tapes in
+   variable block mode: the record size should then be set to the
+   largest one expected, and the first read returns the actual one.  */
+void
+paxbuf_probe_record_size (paxbuf_t buf)
+{
+  buf->probe = true;
+}
+
 
 /* 2. I/O operations and seek */
 
+/* Invoke the wrapper at end of volume.  Return true if I/O should
+   continue.  */
+static bool
+call_wrapper (paxbuf_t buf)
+{
+  if (!buf->wrapper)
+    return false;
+  stats_count (buf, &buf->stats.wrapper_calls);
+  return buf->wrapper (buf->closure) == 0;
+}
+
+/* Read one record from the transport into PTR, invoking the wrapper
+   at end of volume.  Store the number of bytes obtained in *LEVEL.  */
 static pax_io_status_t
-fill_buffer (paxbuf_t buf)
+read_record (paxbuf_t buf, char *ptr, idx_t *level)
 {
   pax_io_status_t status = pax_io_success;
+  idx_t n = 0;
 
-  buf->record_level = 0;
   do
     {
       idx_t s = 0;
+      xtime_t t = gethrxtime ();
 
-      status = buf->reader (buf->closure, buf->record + buf->record_level,
-			    buf->record_size - buf->record_level, &s);
-      buf->record_level += s;
+      status = buf->reader (buf->closure, ptr + n, buf->record_size - n, &s);
+      stats_count_call (buf, &buf->stats.reader_calls, &buf->stats.short_reads,
+			&buf->stats.read_nsec,
+			status == pax_io_success && s < buf->record_size - n,
+			gethrxtime () - t);
+      n += s;
+      if (buf->probe && n > 0)
+	{
+	  stats_lock (buf);
+	  buf->record_size = n;
+	  buf->probe = false;
+	  stats_unlock (buf);
+	}
     }
-  while ((status == pax_io_success && buf->record_level < buf->record_size)
-	 || (status == pax_io_eof
-	     && buf->wrapper
-	     && buf->wrapper (buf->closure) == 0));
+  while ((status == pax_io_success && n < buf->record_size)
+	 || (status == pax_io_eof && call_wrapper (buf)));
 
-  buf->pos = 0;
+  if (n > 0)
+    stats_count (buf, &buf->stats.records_filled);
+  *level = n;
   return status;
 }
 
+/* Write a record of SIZE bytes from PTR to the transport, invoking the
+   wrapper at end of volume.  Store the number of bytes written in
+   *LEVEL.  */
 static pax_io_status_t
-flush_buffer (paxbuf_t buf)
+write_record (paxbuf_t buf, char *ptr, idx_t size, idx_t *level)
 {
   pax_io_status_t status = pax_io_success;
+  idx_t n = 0;
 
-  buf->record_level = 0;
   do
     {
       idx_t s = 0;
-      status = buf->writer (buf->closure, buf->record + buf->record_level,
-			    buf->record_size - buf->record_level, &s);
-      buf->record_level += s;
-    }
-  while ((status == pax_io_success && buf->record_level < buf->record_size)
-	 || (status == pax_io_eof
-	     && buf->wrapper
-	     && buf->wrapper (buf->closure) == 0));
-  buf->pos = 0;
+      xtime_t t = gethrxtime ();
+
+      status = buf->writer (buf->closure, ptr + n, size - n, &s);
+      stats_count_call (buf, &buf->stats.writer_calls, &buf->stats.short_writes,
+			&buf->stats.write_nsec,
+			status == pax_io_success && s < size - n,
+			gethrxtime () - t);
+      n += s;
+    }
+  while ((status == pax_io_success && n < size)
+	 || (status == pax_io_eof && call_wrapper (buf)));
+
+  if (n > 0)
+    stats_count (buf, &buf->stats.records_flushed);
+  *level = n;
   return status;
 }
 
-pax_io_status_t
-paxbuf_read (paxbuf_t buf, char *data, idx_t size, idx_t *rsize)
+/* Hand the record at PTR, SIZE bytes long, over to the transport.  */
+static pax_io_status_t
+take_record (paxbuf_t buf, char *ptr, idx_t size)
 {
-  pax_io_status_t status = pax_io_success;
-  idx_t nread = 0;
+  xtime_t t = gethrxtime ();
+  pax_io_status_t status = buf->take (buf->closure, ptr, size);
 
-  while (size && status == pax_io_success)
+  stats_count_call (buf, &buf->stats.writer_calls, &buf->stats.short_writes,
+		    &buf->stats.write_nsec, false, gethrxtime () - t);
+  if (status == pax_io_success)
+    stats_count (buf, &buf->stats.records_flushed);
+  return status;
+}
+
+
+/* Filters */
+
+/* Add a filter on top of the stack.  It is given the records written
+   by the caller before any filter pushed earlier, and the records read
+   after them.  This must be called before paxbuf_open.  The destroy
+   callback of the filter is called on CLOSURE when the buffer is
+   destroyed, even if this function fails.  */
+int
+paxbuf_push_filter (paxbuf_t buf, struct paxbuf_filter const *filter,
+		    void *closure)
+{
+  struct paxbuf_layer *layer = malloc (sizeof *layer);
+  if (!layer)
     {
-      if (buf->pos == buf->record_level)
-	{
-	  status = fill_buffer (buf);
-	  if (status == pax_io_failure)
-	    break;
-	}
-      idx_t s = buf->record_level - buf->pos;
-      if (s > size)
-	s = size;
-      memcpy (data, buf->record + buf->pos, s);
-      data += s;
-      buf->pos += s;
-      size -= s;
-      nread += s;
+      if (filter->destroy)
+	filter->destroy (closure);
+      return ENOMEM;
     }
-  *rsize = nread;
-  return status;
+  layer->filter = filter;
+  layer->closure = closure;
+  layer->buf = buf;
+  layer->next = buf->top;
+  buf->top = layer;
+  return 0;
 }
 
-pax_io_status_t
-paxbuf_write (paxbuf_t buf, char *data, idx_t size, idx_t *wsize)
+/* Get a free record for passing to LAYER.  */
+char *
+paxbuf_layer_alloc (paxbuf_layer_t layer)
 {
-  pax_io_status_t status = pax_io_success;
-  idx_t nwritten = 0;
+  return spare_get (layer->buf);
+}
 
-  while (size && status == pax_io_success)
+/* Give back a record obtained from LAYER that is no longer needed.  */
+void
+paxbuf_layer_release (paxbuf_layer_t layer, char *data)
+{
+  spare_put (layer->buf, data);
+}
+
+idx_t
+paxbuf_layer_record_size (paxbuf_layer_t layer)
+{
+  return layer->buf->record_size;
+}
+
+/* Obtain the next record from LAYER.  On return, *DATA is a record
+   owned by the caller, or nullptr if none could be allocated, and
+   *SIZE is the number of bytes stored in it.  */
+pax_io_status_t
+paxbuf_layer_read (paxbuf_layer_t layer, char **data, idx_t *size)
+{
+  if (layer->filter)
+    return layer->filter->read (layer->closure, layer->next, data, size);
+  *data = spare_get (layer->buf);
+  if (!*data)
     {
-      if (buf->pos == buf->record_size)
-	{
-	  status = flush_buffer (buf);
-	  if (status == pax_io_failure)
-	    break;
-	}
-      idx_t s = buf->record_size - buf->pos;
-      if (s > size)
-	s = size;
-      memcpy (buf->record + buf->pos, data, s);
-      data += s;
-      buf->pos += s;
-      size -= s;
-      nwritten += s;
+      *size = 0;
+      errno = ENOMEM;
+      return pax_io_failure;
     }
-  *wsize = nwritten;
-  return status;
+  return read_record (layer->buf, *data, size);
 }
 
-int
-paxbuf_seek (paxbuf_t buf, off_t offset)
+/* Pass SIZE bytes of DATA to LAYER, which takes over the record.  */
+pax_io_status_t
+paxbuf_layer_write (paxbuf_layer_t layer, char *data, idx_t size)
 {
-  /* FIXME */
-  return buf->seek (buf->closure, offset);
+  pax_io_status_t status;
+  idx_t n;
+
+  if (layer->filter)
+    return layer->filter->write (layer->closure, layer->next, data, size);
+  if (layer->buf->take)
+    return take_record (layer->buf, data, size);
+  status = write_record (layer->buf, data, size, &n);
+  spare_put (layer->buf, data);
+  return status;
 }
 
-
-/* 3. Open/close */
+/* Position LAYER so that the next record read from or written to it
+   starts at OFFSET of its data.  */
 int
-paxbuf_open (paxbuf_t buf)
+paxbuf_layer_seek (paxbuf_layer_t layer, off_t offset)
 {
-  return buf->open (buf->closure, buf->mode);
+  paxbuf_t buf = layer->buf;
+
+  if (!layer->filter)
+    return buf->seek (buf->closure, offset);
+  if (!layer->filter->seek)
+    {
+      errno = ESPIPE;
+      return -1;
+    }
+  return layer->filter->seek (layer->closure, layer->next, offset);
 }
 
-int
-paxbuf_close (paxbuf_t buf)
+/* Read the next record into *PTR.  If filters are used, the record is
+   replaced by the one they return.  */
+static pax_io_status_t
+stack_read (paxbuf_t buf, char **ptr, idx_t *level)
 {
   pax_io_status_t status;
-  if ((buf->mode & PAXBUF_WRITE) && buf->pos != 0)
-    status = flush_buffer (buf);
-  return buf->close (buf->closure, buf->mode) || status != pax_io_success;
+  char *p;
+
+  if (!buf->top->filter)
+    return read_record (buf, *ptr, level);
+  status = paxbuf_layer_read (buf->top, &p, level);
+  if (p)
+    {
+      spare_put (buf, *ptr);
+      *ptr = p;
+    }
+  else
+    *level = 0;
+  return status;
 }
 
-
-/* Accessors */
+/* Write LEVEL bytes of the record at *PTR.  If filters are used, or
+   if the transport takes records over, the record is handed to them and
+   *PTR is replaced by a free one.  */
+static pax_io_status_t
+stack_write (paxbuf_t buf, char **ptr, idx_t level)
+{
+  char *p;
+  idx_t n;
 
-void *
-paxbuf_get_data (paxbuf_t buf)
+  if (!buf->top->filter && !buf->take)
+    return write_record (buf, *ptr, level, &n);
+  p = spare_get (buf);
+  if (!p)
+    {
+      errno = ENOMEM;
+      return pax_io_failure;
+    }
+  pax_io_status_t status = paxbuf_layer_write (buf->top, *ptr, level);
+  *ptr = p;
+  return status;
+}
+
+/* Let each filter pass down the data it still holds.  */
+static pax_io_status_t
+stack_flush (paxbuf_t buf)
 {
-  return buf->closure;
+  pax_io_status_t status = pax_io_success;
+
+  for (struct paxbuf_layer *layer = buf->top; layer->filter;
+       layer = layer->next)
+    if (layer->filter->flush)
+      {
+	pax_io_status_t rc = layer->filter->flush (layer->closure,
+						   layer->next);
+	if (status == pax_io_success)
+	  status = rc;
+      }
+  return status;
 }
 
-int
-paxbuf_get_mode (paxbuf_t buf)
+
+/* Asynchronous I/O */
+
+static void *
+async_writer (void *closure)
 {
-  return buf->mode;
+  paxbuf_t buf = closure;
+  struct paxbuf_async *as = buf->async;
+
+  pthread_mutex_lock (&as->mutex);
+  for (;;)
+    {
+      while (as->count == 0 && !as->stop)
+	pthread_cond_wait (&as->filled, &as->mutex);
+      if (as->count == 0)
+	break;
+      struct paxbuf_slot *slot = &as->slot[as->head];
+      pthread_mutex_unlock (&as->mutex);
+
+      /* After a failure, discard the remaining records so that the
+	 caller does not block before it sees the error.  */
+      pax_io_status_t status = as->status;
+      if (status == pax_io_success)
+	status = stack_write (buf, &slot->data, slot->level);
+      int errnum = errno;
+
+      pthread_mutex_lock (&as->mutex);
+      if (status != pax_io_success && as->status == pax_io_success)
+	{
+	  as->status = status;
+	  as->errnum = errnum;
+	}
+      as->head = (as->head + 1) % buf->async_depth;
+      as->count--;
+      pthread_cond_signal (&as->drained);
+    }
+  pthread_mutex_unlock (&as->mutex);
+  return nullptr;
+}
+
+static void *
+async_reader (void *closure)
+{
+  paxbuf_t buf = closure;
+  struct paxbuf_async *as = buf->async;
+
+  pthread_mutex_lock (&as->mutex);
+  while (!as->done)
+    {
+      while (as->count == buf->async_depth && !as->stop)
+	pthread_cond_wait (&as->drained, &as->mutex);
+      if (as->stop)
+	break;
+      struct paxbuf_slot *slot =
+	&as->slot[(as->head + as->count) % buf->async_depth];
+      pthread_mutex_unlock (&as->mutex);
+
+      slot->status = stack_read (buf, &slot->data, &slot->level);
+      slot->errnum = errno;
+
+      pthread_mutex_lock (&as->mutex);
+      if (slot->status != pax_io_success)
+	{
+	  as->done = true;
+	  as->status = slot->status;
+	  as->errnum = slot->errnum;
+	}
+      as->count++;
+      pthread_cond_signal (&as->filled);
+    }
+  pthread_mutex_unlock (&as->mutex);
+  return nullptr;
+}
+
+static void
+async_free (paxbuf_t buf)
+{
+  struct paxbuf_async *as = buf->async;
+  for (idx_t i = 0; i < buf->async_depth; i++)
+    record_free (buf, as->slot[i].data);
+  free (as->slot);
+  free (as);
+  buf->async = nullptr;
+}
+
+/* Start the I/O thread.  Return 0 on success and an error code
+   otherwise.  */
+static int
+async_start (paxbuf_t buf)
+{
+  struct paxbuf_async *as;
+  int rc;
+
+  as = calloc (1, sizeof *as);
+  if (!as)
+    return ENOMEM;
+  buf->async = as;
+  as->slot = calloc (buf->async_depth, sizeof as->slot[0]);
+  if (!as->slot)
+    {
+      async_free (buf);
+      return ENOMEM;
+    }
+  for (idx_t i = 0; i < buf->async_depth; i++)
+    {
+      as->slot[i].data = record_alloc (buf);
+      if (!as->slot[i].data)
+	{
+	  async_free (buf);
+	  return ENOMEM;
+	}
+    }
+  as->status = pax_io_success;
+
+  pthread_mutex_init (&as->mutex, nullptr);
+  pthread_cond_init (&as->filled, nullptr);
+  pthread_cond_init (&as->drained, nullptr);
+  rc = pthread_create (&as->thread, nullptr,
+		       (buf->mode & PAXBUF_WRITE) ? async_writer : async_reader,
+		       buf);
+  if (rc)
+    {
+      pthread_cond_destroy (&as->drained);
+      pthread_cond_destroy (&as->filled);
+      pthread_mutex_destroy (&as->mutex);
+      async_free (buf);
+    }
+  return rc;
+}
+
+/* Terminate the I/O thread.  In write mode, wait until all queued
+   records are written first.  Return the status of the first
+   unsuccessful transfer, if any.  */
+static pax_io_status_t
+async_stop (paxbuf_t buf)
+{
+  struct paxbuf_async *as = buf->async;
+  pax_io_status_t status;
+
+  if (!as)
+    return pax_io_success;
+  pthread_mutex_lock (&as->mutex);
+  as->stop = true;
+  pthread_cond_signal (&as->filled);
+  pthread_cond_signal (&as->drained);
+  pthread_mutex_unlock (&as->mutex);
+  pthread_join (as->thread, nullptr);
+
+  status = as->status;
+  if (status != pax_io_success)
+    errno = as->errnum;
+  pthread_cond_destroy (&as->drained);
+  pthread_cond_destroy (&as->filled);
+  pthread_mutex_destroy (&as->mutex);
+  async_free (buf);
+  return status;
+}
+
+/* Wait until the I/O thread has written all queued records.  */
+static pax_io_status_t
+async_drain (paxbuf_t buf)
+{
+  struct paxbuf_async *as = buf->async;
+  pax_io_status_t status;
+
+  pthread_mutex_lock (&as->mutex);
+  while (as->count > 0)
+    pthread_cond_wait (&as->drained, &as->mutex);
+  status = as->status;
+  if (status != pax_io_success)
+    errno = as->errnum;
+  pthread_mutex_unlock (&as->mutex);
+  return status;
+}
+
+/* Queue the current record for writing and take a free slot in its
+   place.  */
+static pax_io_status_t
+async_flush (paxbuf_t buf)
+{
+  struct paxbuf_async *as = buf->async;
+  pax_io_status_t status;
+
+  pthread_mutex_lock (&as->mutex);
+  while (as->count == buf->async_depth && as->status == pax_io_success)
+    pthread_cond_wait (&as->drained, &as->mutex);
+  status = as->status;
+  if (status == pax_io_success)
+    {
+      struct paxbuf_slot *slot =
+	&as->slot[(as->head + as->count) % buf->async_depth];
+      char *p = slot->data;
+      slot->data = buf->record;
+      slot->level = buf->record_size;
+      buf->record = p;
+      as->count++;
+      pthread_cond_signal (&as->filled);
+    }
+  else
+    errno = as->errnum;
+  pthread_mutex_unlock (&as->mutex);
+  return status;
+}
+
+/* Replace the current record with the next one read by the I/O
+   thread.  */
+static pax_io_status_t
+async_fill (paxbuf_t buf)
+{
+  struct paxbuf_async *as = buf->async;
+  pax_io_status_t status;
+
+  pthread_mutex_lock (&as->mutex);
+  while (as->count == 0 && !as->done)
+    pthread_cond_wait (&as->filled, &as->mutex);
+  if (as->count > 0)
+    {
+      struct paxbuf_slot *slot = &as->slot[as->head];
+      char *p = slot->data;
+      slot->data = buf->record;
+      buf->record = p;
+      buf->record_level = slot->level;
+      status = slot->status;
+      errno = slot->errnum;
+      as->head = (as->head + 1) % buf->async_depth;
+      as->count--;
+      pthread_cond_signal (&as->drained);
+    }
+  else
+    {
+      /* The thread has stopped and everything it read was consumed.  */
+      buf->record_level = 0;
+      status = as->status;
+      errno = as->errnum;
+    }
+  pthread_mutex_unlock (&as->mutex);
+  return status;
+}
+
+/* Return true, setting errno, if the position in the archive was lost
+   by a failed seek.  No I/O is possible until the next seek
+   succeeds.  */
+static bool
+position_lost (paxbuf_t buf)
+{
+  if (buf->offset >= 0)
+    return false;
+  errno = buf->seek_errno;
+  return true;
+}
+
+static pax_io_status_t
+fill_buffer (paxbuf_t buf)
+{
+  pax_io_status_t status;
+
+  buf->offset += buf->record_level;
+  if (buf->async)
+    status = async_fill (buf);
+  else
+    status = stack_read (buf, &buf->record, &buf->record_level);
+  buf->pos = 0;
+  return status;
+}
+
+static pax_io_status_t
+flush_buffer (paxbuf_t buf)
+{
+  pax_io_status_t status;
+
+  if (buf->async)
+    status = async_flush (buf);
+  else
+    status = stack_write (buf, &buf->record, buf->record_size);
+  buf->record_level = 0;
+  buf->offset += buf->record_size;
+  buf->pos = 0;
+  return status;
+}
+
+/* Read and write requests that cover whole records while the buffer
+   is at a record boundary are served directly from the caller's
+   memory, bypassing the record buffer.  Each transport call still
+   transfers exactly one record, so record boundaries are the same as
+   when the data is staged.  */
+
+pax_io_status_t
+paxbuf_read (paxbuf_t buf, char *data, idx_t size, idx_t *rsize)
+{
+  pax_io_status_t status = pax_io_success;
+  idx_t nread = 0;
+
+  if (position_lost (buf))
+    {
+      *rsize = 0;
+      return pax_io_failure;
+    }
+
+  while (size && status == pax_io_success)
+    {
+      char *ptr;
+      idx_t s;
+
+      if (buf->pos == buf->record_level && size >= buf->record_size
+	  && !buf->async && !buf->top->filter && direct_ok (buf, data))
+	{
+	  buf->offset += buf->record_level;
+	  status = read_record (buf, data, &s);
+	  buf->offset += s;
+	  buf->stats.bytes_read += s;
+	  buf->record_level = buf->pos = 0;
+	  data += s;
+	  size -= s;
+	  nread += s;
+	  continue;
+	}
+
+      status = paxbuf_peek (buf, &ptr, &s);
+      if (status == pax_io_failure)
+	break;
+      if (s > size)
+	s = size;
+      memcpy (data, ptr, s);
+      paxbuf_consume (buf, s);
+      data += s;
+      size -= s;
+      nread += s;
+    }
+  *rsize = nread;
+  return status;
+}
+
+/* Return in *DATA a pointer to the unread part of the current record
+   and in *SIZE its length, refilling the record from the transport if
+   it has been consumed completely.  The returned memory belongs to BUF
+   and stays valid until the next I/O operation on it.  Use
+   paxbuf_consume to mark the data as read.
+
+   On end of file, *SIZE may be less than the record size or zero.  */
+pax_io_status_t
+paxbuf_peek (paxbuf_t buf, char **data, idx_t *size)
+{
+  pax_io_status_t status = pax_io_success;
+
+  if (position_lost (buf))
+    {
+      *size = 0;
+      return pax_io_failure;
+    }
+
+  if (buf->pos == buf->record_level)
+    {
+      status = fill_buffer (buf);
+      if (status == pax_io_failure)
+	{
+	  *size = 0;
+	  return status;
+	}
+    }
+  *data = buf->record + buf->pos;
+  *size = buf->record_level - buf->pos;
+  return status;
+}
+
+/* Mark SIZE bytes returned by the previous paxbuf_peek as read.
+   SIZE must not exceed the size returned by it.  */
+void
+paxbuf_consume (paxbuf_t buf, idx_t size)
+{
+  if (size > buf->record_level - buf->pos)
+    size = buf->record_level - buf->pos;
+  buf->pos += size;
+  buf->stats.bytes_read += size;
+}
+
+pax_io_status_t
+paxbuf_write (paxbuf_t buf, char *data, idx_t size, idx_t *wsize)
+{
+  pax_io_status_t status = pax_io_success;
+  idx_t nwritten = 0;
+
+  if (position_lost (buf))
+    {
+      *wsize = 0;
+      return pax_io_failure;
+    }
+
+  while (size && status == pax_io_success)
+    {
+      if (buf->pos == buf->record_size)
+	{
+	  status = flush_buffer (buf);
+	  if (status == pax_io_failure)
+	    break;
+	}
+      idx_t s;
+      if (buf->record_level == 0 && size >= buf->record_size && !buf->async
+	  && !buf->top->filter && !buf->take && direct_ok (buf, data))
+	{
+	  status = write_record (buf, data, buf->record_size, &s);
+	  if (status != pax_io_success)
+	    break;
+	  buf->offset += s;
+	  buf->stats.bytes_written += s;
+	  data += s;
+	  size -= s;
+	  nwritten += s;
+	  continue;
+	}
+      s = buf->record_size - buf->pos;
+      if (s > size)
+	s = size;
+      memcpy (buf->record + buf->pos, data, s);
+      data += s;
+      buf->pos += s;
+      if (buf->pos > buf->record_level)
+	buf->record_level = buf->pos;
+      buf->stats.bytes_written += s;
+      size -= s;
+      nwritten += s;
+    }
+  *wsize = nwritten;
+  return status;
+}
+
+/* Vectored I/O.  When the transport supplies vectored functions, a
+   record whose data is scattered over the caller's vector (possibly
+   preceded by the part already staged in the record buffer) is passed
+   to the transport in a single call.  Each call still transfers
+   exactly one record.  Otherwise the vector is processed piece by
+   piece with paxbuf_read and paxbuf_write.  */
+
+/* Maximum number of vector entries passed to the transport at once */
+enum { PAXBUF_IOV_MAX = 64 };
+
+/* Position in an I/O vector */
+struct iov_cursor
+{
+  struct iovec const *iov;    /* Current entry */
+  int iovcnt;                 /* Number of entries left */
+  idx_t off;                  /* Offset within the current entry */
+};
+
+static idx_t
+iov_total (struct iovec const *iov, int iovcnt)
+{
+  idx_t size = 0;
+  for (int i = 0; i < iovcnt; i++)
+    size += iov[i].iov_len;
+  return size;
+}
+
+static void
+iov_advance (struct iov_cursor *c, idx_t size)
+{
+  while (c->iovcnt > 0)
+    {
+      idx_t len = c->iov->iov_len - c->off;
+      if (len > size)
+	{
+	  c->off += size;
+	  break;
+	}
+      size -= len;
+      c->iov++;
+      c->iovcnt--;
+      c->off = 0;
+    }
+}
+
+/* Return the contiguous piece of data at cursor C in *PTR and its
+   length as the function value.  */
+static idx_t
+iov_piece (struct iov_cursor *c, char **ptr)
+{
+  while (c->iovcnt > 0 && c->iov->iov_len == c->off)
+    iov_advance (c, 0);
+  if (c->iovcnt == 0)
+    {
+      *ptr = nullptr;
+      return 0;
+    }
+  *ptr = (char *) c->iov->iov_base + c->off;
+  return c->iov->iov_len - c->off;
+}
+
+/* Store in V the entries describing the next SIZE bytes at cursor C.
+   Return the number of entries, or 0 if more than VMAX would be
+   needed.  */
+static int
+iov_gather (struct iov_cursor const *c, idx_t size, struct iovec *v, int vmax)
+{
+  int n = 0;
+  idx_t off = c->off;
+
+  for (int i = 0; size > 0 && i < c->iovcnt; i++, off = 0)
+    {
+      idx_t len = c->iov[i].iov_len - off;
+      if (len == 0)
+	continue;
+      if (n == vmax)
+	return 0;
+      if (len > size)
+	len = size;
+      v[n].iov_base = (char *) c->iov[i].iov_base + off;
+      v[n].iov_len = len;
+      n++;
+      size -= len;
+    }
+  return n;
+}
+
+/* Transfer one record described by the N entries of V using the
+   vectored transport function FN.  V is modified.  */
+static pax_io_status_t
+vector_record (paxbuf_t buf, paxbuf_iov_fp fn, bool writing,
+	       struct iovec *v, int n, idx_t *level)
+{
+  pax_io_status_t status = pax_io_success;
+  idx_t total = 0;
+
+  do
+    {
+      idx_t s = 0;
+      xtime_t t = gethrxtime ();
+
+      status = fn (buf->closure, v, n, &s);
+      t = gethrxtime () - t;
+      if (writing)
+	stats_count_call (buf, &buf->stats.writer_calls,
+			  &buf->stats.short_writes, &buf->stats.write_nsec,
+			  status == pax_io_success
+			  && s < buf->record_size - total, t);
+      else
+	stats_count_call (buf, &buf->stats.reader_calls,
+			  &buf->stats.short_reads, &buf->stats.read_nsec,
+			  status == pax_io_success
+			  && s < buf->record_size - total, t);
+      total += s;
+      while (n > 0 && s >= v->iov_len)
+	{
+	  s -= v->iov_len;
+	  v++;
+	  n--;
+	}
+      if (n > 0)
+	{
+	  v->iov_base = (char *) v->iov_base + s;
+	  v->iov_len -= s;
+	}
+    }
+  while ((status == pax_io_success && total < buf->record_size)
+	 || (status == pax_io_eof && call_wrapper (buf)));
+
+  if (total > 0)
+    stats_count (buf, writing ? &buf->stats.records_flushed
+		              : &buf->stats.records_filled);
+  *level = total;
+  return status;
+}
+
+/* Read into the IOVCNT buffers described by IOV, filling each buffer
+   completely before proceeding to the next one.  Store the number of
+   bytes read in *RSIZE.  */
+pax_io_status_t
+paxbuf_readv (paxbuf_t buf, struct iovec const *iov, int iovcnt,
+	      idx_t *rsize)
+{
+  struct iov_cursor c = { iov, iovcnt, 0 };
+  idx_t size = iov_total (iov, iovcnt);
+  pax_io_status_t status = pax_io_success;
+  idx_t nread = 0;
+  struct iovec v[PAXBUF_IOV_MAX];
+
+  if (position_lost (buf))
+    {
+      *rsize = 0;
+      return pax_io_failure;
+    }
+
+  while (size && status == pax_io_success)
+    {
+      idx_t s;
+      int n;
+      char *ptr;
+
+      if (buf->readv && !buf->async && !buf->top->filter
+	  && !(buf->mode & PAXBUF_ALIGN)
+	  && buf->pos == buf->record_level && size >= buf->record_size
+	  && (n = iov_gather (&c, buf->record_size, v, PAXBUF_IOV_MAX)) > 0)
+	{
+	  buf->offset += buf->record_level;
+	  status = vector_record (buf, buf->readv, false, v, n, &s);
+	  buf->offset += s;
+	  buf->stats.bytes_read += s;
+	  buf->record_level = buf->pos = 0;
+	}
+      else
+	{
+	  idx_t len = iov_piece (&c, &ptr);
+	  status = paxbuf_read (buf, ptr, len, &s);
+	}
+      iov_advance (&c, s);
+      size -= s;
+      nread += s;
+    }
+  *rsize = nread;
+  return status;
+}
+
+/* Write the data from the IOVCNT buffers described by IOV.  Store the
+   number of bytes written in *WSIZE.  */
+pax_io_status_t
+paxbuf_writev (paxbuf_t buf, struct iovec const *iov, int iovcnt,
+	       idx_t *wsize)
+{
+  struct iov_cursor c = { iov, iovcnt, 0 };
+  idx_t size = iov_total (iov, iovcnt);
+  pax_io_status_t status = pax_io_success;
+  idx_t nwritten = 0;
+  struct iovec v[PAXBUF_IOV_MAX];
+
+  if (position_lost (buf))
+    {
+      *wsize = 0;
+      return pax_io_failure;
+    }
+
+  while (size && status == pax_io_success)
+    {
+      idx_t s;
+      int n, k;
+      char *ptr;
+
+      if (buf->pos == buf->record_size)
+	{
+	  status = flush_buffer (buf);
+	  if (status == pax_io_failure)
+	    break;
+	}
+
+      /* Send the staged part of the record together with the data
+	 that completes it.  */
+      n = buf->pos > 0;
+      if (buf->writev && !buf->async && !buf->top->filter
+	  && !(buf->mode & PAXBUF_ALIGN)
+	  && buf->pos == buf->record_level
+	  && size >= buf->record_size - buf->pos
+	  && (k = iov_gather (&c, buf->record_size - buf->pos, v + n,
+			      PAXBUF_IOV_MAX - n)) > 0)
+	{
+	  idx_t len = buf->record_size - buf->pos;
+
+	  if (n)
+	    {
+	      v[0].iov_base = buf->record;
+	      v[0].iov_len = buf->pos;
+	    }
+	  status = vector_record (buf, buf->writev, true, v, n + k, &s);
+	  if (status != pax_io_success)
+	    break;
+	  buf->offset += buf->record_size;
+	  buf->stats.bytes_written += len;
+	  buf->record_level = buf->pos = 0;
+	  s = len;
+	}
+      else
+	{
+	  /* Stage at most the rest of the record, so that the next
+	     iteration can use the vectored path again.  */
+	  idx_t len = iov_piece (&c, &ptr);
+	  if (len > buf->record_size - buf->pos)
+	    len = buf->record_size - buf->pos;
+	  status = paxbuf_write (buf, ptr, len, &s);
+	}
+      iov_advance (&c, s);
+      size -= s;
+      nwritten += s;
+    }
+  *wsize = nwritten;
+  return status;
+}
+
+
+/* Copying member data.  The whole records between the current position
+   and the end of the data are moved by the transport copy functions,
+   when available, so that they do not pass through user space.  The
+   transport is left on a record boundary; the rest of the data goes
+   through the record buffer.  This works in both directions.  */
+
+/* True if whole records can be passed to the transport copy function
+   FN at the current position.  */
+static bool
+copy_ok (paxbuf_t buf, paxbuf_copy_fp fn)
+{
+  return fn && !buf->async && !buf->top->filter && !buf->probe;
+}
+
+/* Copy SIZE bytes of data from the archive to the file descriptor FD.
+   Store the number of bytes copied in *RSIZE.  */
+pax_io_status_t
+paxbuf_copy_out (paxbuf_t buf, int fd, off_t size, off_t *rsize)
+{
+  pax_io_status_t status = pax_io_success;
+  bool direct = copy_ok (buf, buf->copy_read);
+  off_t ncopied = 0;
+
+  if (position_lost (buf))
+    {
+      *rsize = 0;
+      return pax_io_failure;
+    }
+
+  while (size && status == pax_io_success)
+    {
+      char *ptr;
+      idx_t s;
+
+      if (direct && buf->pos == buf->record_level
+	  && size >= buf->record_size)
+	{
+	  off_t n;
+
+	  buf->offset += buf->record_level;
+	  buf->record_level = buf->pos = 0;
+	  status = buf->copy_read (buf->closure, fd,
+				   size - size % buf->record_size, &n);
+	  if (status == pax_io_failure && n == 0 && errno == ENOTSUP)
+	    {
+	      /* Not for this descriptor; use the record buffer.  */
+	      direct = false;
+	      status = pax_io_success;
+	      continue;
+	    }
+	  if (status == pax_io_eof && n == 0 && call_wrapper (buf))
+	    status = pax_io_success;
+	  buf->offset += n;
+	  buf->stats.bytes_read += n;
+	  buf->stats.bytes_copied += n;
+	  size -= n;
+	  ncopied += n;
+	  continue;
+	}
+
+      status = paxbuf_peek (buf, &ptr, &s);
+      if (status == pax_io_failure)
+	break;
+      if (s > size)
+	s = size;
+      if (full_write (fd, ptr, s) < s)
+	{
+	  status = pax_io_failure;
+	  break;
+	}
+      paxbuf_consume (buf, s);
+      size -= s;
+      ncopied += s;
+    }
+  *rsize = ncopied;
+  return status;
+}
+
+/* Copy SIZE bytes of data from the file descriptor FD to the archive.
+   Store the number of bytes copied in *RSIZE.  If FD reaches end of
+   file first, return pax_io_eof.  */
+pax_io_status_t
+paxbuf_copy_in (paxbuf_t buf, int fd, off_t size, off_t *rsize)
+{
+  pax_io_status_t status = pax_io_success;
+  bool direct = copy_ok (buf, buf->copy_write);
+  off_t ncopied = 0;
+
+  if (position_lost (buf))
+    {
+      *rsize = 0;
+      return pax_io_failure;
+    }
+
+  while (size && status == pax_io_success)
+    {
+      idx_t s;
+      size_t n;
+
+      if (buf->pos == buf->record_size)
+	{
+	  status = flush_buffer (buf);
+	  if (status == pax_io_failure)
+	    break;
+	}
+
+      if (direct && buf->record_level == 0 && size >= buf->record_size)
+	{
+	  off_t len;
+
+	  status = buf->copy_write (buf->closure, fd,
+				    size - size % buf->record_size, &len);
+	  buf->offset += len;
+	  buf->stats.bytes_written += len;
+	  buf->stats.bytes_copied += len;
+	  size -= len;
+	  ncopied += len;
+	  if ((status == pax_io_failure && len == 0 && errno == ENOTSUP)
+	      || status == pax_io_eof)
+	    {
+	      /* Not for this descriptor, or FD ended within a record,
+		 which is read again: use the record buffer.  */
+	      direct = false;
+	      status = pax_io_success;
+	    }
+	  continue;
+	}
+
+      s = buf->record_size - buf->pos;
+      if (s > size)
+	s = size;
+      n = safe_read (fd, buf->record + buf->pos, s);
+      if (n == SAFE_READ_ERROR)
+	{
+	  status = pax_io_failure;
+	  break;
+	}
+      if (n == 0)
+	{
+	  status = pax_io_eof;
+	  break;
+	}
+      buf->pos += n;
+      if (buf->pos > buf->record_level)
+	buf->record_level = buf->pos;
+      buf->stats.bytes_written += n;
+      size -= n;
+      ncopied += n;
+    }
+  *rsize = ncopied;
+  return status;
+}
+
+/* Position the transport at OFFSET, which must be on a record
+   boundary, and discard the buffer contents.  If the transport cannot
+   be positioned, the position is lost.  */
+static int
+seek_transport (paxbuf_t buf, off_t offset)
+{
+  int rc;
+
+  if (buf->async)
+    {
+      if (buf->mode & PAXBUF_WRITE)
+	{
+	  if (async_drain (buf) != pax_io_success)
+	    return -1;
+	}
+      else
+	/* Discard the records read ahead.  */
+	async_stop (buf);
+    }
+
+  rc = paxbuf_layer_seek (buf->top, offset);
+  buf->record_level = buf->pos = 0;
+  if (rc == 0)
+    buf->offset = offset;
+  else
+    {
+      buf->offset = -1;
+      buf->seek_errno = errno;
+    }
+
+  if (rc == 0 && buf->async_depth > 0 && !(buf->mode & PAXBUF_WRITE))
+    {
+      /* Restart reading ahead at the new position.  */
+      int ec = async_start (buf);
+      if (ec)
+	{
+	  errno = ec;
+	  rc = -1;
+	}
+    }
+  return rc;
+}
+
+/* Set the logical position in the archive to OFFSET.  Return the
+   resulting position, or -1 on error.
+
+   In read mode, a position within the current record is reached by
+   moving the buffer pointer.  Otherwise, the transport is positioned
+   at the beginning of the record containing OFFSET, the record is
+   read, and the pointer is set within it.  If the archive ends before
+   OFFSET, the position returned is smaller than OFFSET.
+
+   In write mode, the position may be moved anywhere within the part of
+   the current record filled so far.  Any other OFFSET must lie on a
+   record boundary; the current record is padded with zeros and flushed
+   before the transport is repositioned.
+
+   If the transport fails to seek, the position is unknown: paxbuf_tell
+   returns -1 and I/O fails with the same error until a seek
+   succeeds.  */
+off_t
+paxbuf_seek (paxbuf_t buf, off_t offset)
+{
+  if (offset < 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  if (buf->mode & PAXBUF_WRITE)
+    {
+      if (buf->offset <= offset && offset <= buf->offset + buf->record_level)
+	{
+	  buf->pos = offset - buf->offset;
+	  return offset;
+	}
+      if (offset % buf->record_size != 0)
+	{
+	  errno = EINVAL;
+	  return -1;
+	}
+      if (buf->record_level != 0)
+	{
+	  memset (buf->record + buf->record_level, 0,
+		  buf->record_size - buf->record_level);
+	  if (flush_buffer (buf) != pax_io_success)
+	    return -1;
+	}
+      if (seek_transport (buf, offset))
+	return -1;
+      return offset;
+    }
+
+  if (buf->offset <= offset && offset <= buf->offset + buf->record_level)
+    {
+      buf->pos = offset - buf->offset;
+      return offset;
+    }
+  if (seek_transport (buf, offset - offset % buf->record_size))
+    return -1;
+  idx_t skip = offset - buf->offset;
+  if (skip > 0)
+    {
+      if (fill_buffer (buf) == pax_io_failure)
+	return -1;
+      buf->pos = skip < buf->record_level ? skip : buf->record_level;
+    }
+  return buf->offset + buf->pos;
+}
+
+/* Return the logical position in the archive.  */
+off_t
+paxbuf_tell (paxbuf_t buf)
+{
+  return buf->offset + buf->pos;
+}
+
+
+/* 3. Open/close */
+int
+paxbuf_open (paxbuf_t buf)
+{
+  int rc = buf->open (buf->closure, buf->mode);
+  if (rc == 0 && buf->async_depth > 0)
+    {
+      int ec = async_start (buf);
+      if (ec)
+	{
+	  buf->close (buf->closure, buf->mode);
+	  errno = ec;
+	  rc = -1;
+	}
+    }
+  return rc;
+}
+
+int
+paxbuf_close (paxbuf_t buf)
+{
+  pax_io_status_t status = pax_io_success;
+  if ((buf->mode & PAXBUF_WRITE) && buf->record_level != 0)
+    {
+      /* Pad the last record with zeros rather than stale data.  */
+      memset (buf->record + buf->record_level, 0,
+	      buf->record_size - buf->record_level);
+      status = flush_buffer (buf);
+    }
+  if (buf->async)
+    {
+      pax_io_status_t rc = async_stop (buf);
+      if ((buf->mode & PAXBUF_WRITE) && status == pax_io_success)
+	status = rc;
+    }
+  if (buf->mode & PAXBUF_WRITE)
+    {
+      pax_io_status_t rc = stack_flush (buf);
+      if (status == pax_io_success)
+	status = rc;
+    }
+  return buf->close (buf->closure, buf->mode) || status != pax_io_success;
+}
+
+
+/* Accessors */
+
+void *
+paxbuf_get_data (paxbuf_t buf)
+{
+  return buf->closure;
+}
+
+int
+paxbuf_get_mode (paxbuf_t buf)
+{
+  return buf->mode;
+}
+
+idx_t
+paxbuf_get_record_size (paxbuf_t buf)
+{
+  return buf->record_size;
+}
+
+void
+paxbuf_get_stats (paxbuf_t buf, struct paxbuf_stats *stats)
+{
+  stats_lock (buf);
+  *stats = buf->stats;
+  stats_unlock (buf);
 }
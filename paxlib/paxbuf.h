@@ -32,33 +32,150 @@ pax_io_status_t;
 #define PAXBUF_WRITE 0x2
 #define PAXBUF_CREAT 0x4
 
+/* Record buffer options for paxbuf_create */
+#define PAXBUF_ALIGN    0x10  /* Page-aligned record buffers; the transport
+				 is never given unaligned memory (as needed
+				 for O_DIRECT) */
+#define PAXBUF_HUGEPAGE 0x20  /* Back record buffers with transparent huge
+				 pages */
+#define PAXBUF_HUGETLB  0x40  /* Back record buffers with explicit huge
+				 pages, if available */
+
+/* I/O statistics.  Times are in nanoseconds.  */
+struct paxbuf_stats
+{
+  off_t bytes_read;           /* Bytes delivered by paxbuf_read et al. */
+  off_t bytes_written;        /* Bytes accepted by paxbuf_write */
+  intmax_t records_filled;    /* Records obtained from the transport */
+  intmax_t records_flushed;   /* Records passed to the transport */
+  off_t bytes_copied;         /* Bytes moved by the transport copy
+				 functions, without staging */
+  intmax_t reader_calls;      /* Calls to the reader */
+  intmax_t writer_calls;      /* Calls to the writer */
+  intmax_t short_reads;       /* Reader calls that returned less data
+				 than requested */
+  intmax_t short_writes;      /* Writer calls that consumed less data
+				 than offered */
+  intmax_t wrapper_calls;     /* Calls to the wrapper */
+  intmax_t read_nsec;         /* Time spent in the reader */
+  intmax_t write_nsec;        /* Time spent in the writer */
+};
+
 typedef pax_io_status_t (*paxbuf_io_fp) (void *closure,
 					 void *data, idx_t size,
 					 idx_t *ret_size);
+struct iovec;
+typedef pax_io_status_t (*paxbuf_iov_fp) (void *closure,
+					  struct iovec const *iov, int iovcnt,
+					  idx_t *ret_size);
+typedef pax_io_status_t (*paxbuf_copy_fp) (void *closure, int fd,
+					   off_t size, off_t *ret_size);
+typedef pax_io_status_t (*paxbuf_take_fp) (void *closure,
+					   char *data, idx_t size);
 typedef int (*paxbuf_seek_fp) (void *closure, off_t offset);
 typedef int (*paxbuf_term_fp) (void *closure, int mode);
 typedef int (*paxbuf_destroy_fp) (void *closure);
 typedef int (*paxbuf_wrapper_fp) (void *closure);
 typedef const char * (*paxbuf_error_fp) (void *closure);
 
+/* Filters transform the records passed between the record buffer and
+   the transport, which sits at the bottom of the filter stack.  A
+   record is handed from one layer to another together with its
+   ownership: a record passed to paxbuf_layer_write belongs to the layer
+   below, and a record obtained from paxbuf_layer_read belongs to the
+   caller, which must pass it on or give it back with
+   paxbuf_layer_release.  Records are paxbuf_layer_record_size bytes
+   long; new ones are obtained with paxbuf_layer_alloc.  */
+typedef struct paxbuf_layer *paxbuf_layer_t;
+
+struct paxbuf_filter
+{
+  /* Obtain the next record from NEXT and return the transformed data
+     in *DATA and its length in *SIZE.  */
+  pax_io_status_t (*read) (void *closure, paxbuf_layer_t next,
+			   char **data, idx_t *size);
+  /* Transform SIZE bytes of DATA and pass the result to NEXT.  */
+  pax_io_status_t (*write) (void *closure, paxbuf_layer_t next,
+			    char *data, idx_t size);
+  /* Pass the data still held to NEXT.  Called when closing in write
+     mode.  May be nullptr.  */
+  pax_io_status_t (*flush) (void *closure, paxbuf_layer_t next);
+  /* Position NEXT so that the next record starts at OFFSET of the
+     filtered data.  May be nullptr if seeking is not supported.  */
+  int (*seek) (void *closure, paxbuf_layer_t next, off_t offset);
+  /* Free CLOSURE.  May be nullptr.  */
+  void (*destroy) (void *closure);
+};
+
 int paxbuf_create (paxbuf_t *buf, int mode, void *closure, idx_t record_size);
 int paxbuf_open (paxbuf_t buf);
+/* In write mode, the last record is padded with zeros before it is
+   flushed.  Readers of embedded indexes rely on it to find the index
+   after the last non-zero block.  */
 int paxbuf_close (paxbuf_t buf);
 void paxbuf_set_io (paxbuf_t buf, paxbuf_io_fp rd, paxbuf_io_fp wr,
 		    paxbuf_seek_fp seek);
+void paxbuf_set_iov (paxbuf_t buf, paxbuf_iov_fp rdv, paxbuf_iov_fp wrv);
+void paxbuf_set_copy (paxbuf_t buf, paxbuf_copy_fp rdc, paxbuf_copy_fp wrc);
+void paxbuf_set_take (paxbuf_t buf, paxbuf_take_fp take);
+void paxbuf_release_record (paxbuf_t buf, char *data);
 void paxbuf_set_term (paxbuf_t buf,
 		      paxbuf_term_fp open, paxbuf_term_fp close,
 		      paxbuf_destroy_fp destroy);
 void paxbuf_set_wrapper (paxbuf_t buf, paxbuf_wrapper_fp wrap);
 void paxbuf_set_error (paxbuf_t buf, paxbuf_error_fp err);
+int paxbuf_set_async (paxbuf_t buf, idx_t depth);
+int paxbuf_set_record_size (paxbuf_t buf, idx_t size);
+void paxbuf_probe_record_size (paxbuf_t buf);
+int paxbuf_push_filter (paxbuf_t buf, struct paxbuf_filter const *filter,
+			void *closure);
+
+char *paxbuf_layer_alloc (paxbuf_layer_t layer);
+void paxbuf_layer_release (paxbuf_layer_t layer, char *data);
+idx_t paxbuf_layer_record_size (paxbuf_layer_t layer);
+pax_io_status_t paxbuf_layer_read (paxbuf_layer_t layer,
+				   char **data, idx_t *size);
+pax_io_status_t paxbuf_layer_write (paxbuf_layer_t layer,
+				    char *data, idx_t size);
+int paxbuf_layer_seek (paxbuf_layer_t layer, off_t offset);
+
+/* Compression filters */
+#define PAXBUF_GZIP 1
+#define PAXBUF_ZSTD 2
+
+int paxbuf_push_compress (paxbuf_t buf, int codec, int level, int threads);
+int paxbuf_push_decompress (paxbuf_t buf, int threads);
+
+/* Checksum filter */
+#define PAXBUF_CSUM_RECORD 0x1  /* Store the CRC of each record */
+
+int paxbuf_push_checksum (paxbuf_t buf, int flags);
+
+/* Memory pool shared by the record buffers of all paxbufs */
+void paxbuf_pool_set_limit (idx_t limit);
+idx_t paxbuf_pool_reserved (void);
+void paxbuf_pool_trim (void);
 
 pax_io_status_t paxbuf_read (paxbuf_t pbuf, char *buf, idx_t size,
 			     idx_t *rsize);
 pax_io_status_t paxbuf_write (paxbuf_t pbuf, char *buf, idx_t size,
 			      idx_t *rsize);
-int paxbuf_seek (paxbuf_t buf, off_t offset);
+pax_io_status_t paxbuf_readv (paxbuf_t pbuf, struct iovec const *iov,
+			      int iovcnt, idx_t *rsize);
+pax_io_status_t paxbuf_writev (paxbuf_t pbuf, struct iovec const *iov,
+			       int iovcnt, idx_t *wsize);
+pax_io_status_t paxbuf_copy_out (paxbuf_t pbuf, int fd, off_t size,
+				 off_t *rsize);
+pax_io_status_t paxbuf_copy_in (paxbuf_t pbuf, int fd, off_t size,
+				off_t *rsize);
+pax_io_status_t paxbuf_peek (paxbuf_t pbuf, char **data, idx_t *size);
+void paxbuf_consume (paxbuf_t pbuf, idx_t size);
+off_t paxbuf_seek (paxbuf_t buf, off_t offset);
+off_t paxbuf_tell (paxbuf_t buf);
 
 void paxbuf_destroy (paxbuf_t *buf);
 
 void *paxbuf_get_data (paxbuf_t buf);
 int paxbuf_get_mode (paxbuf_t buf);
+idx_t paxbuf_get_record_size (paxbuf_t buf);
+void paxbuf_get_stats (paxbuf_t buf, struct paxbuf_stats *stats);
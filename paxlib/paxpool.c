@@ -0,0 +1,521 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Pool allocator.  Blocks are grouped in classes by size and alignment.
+   Blocks of a class are carved from slabs of SLAB_SIZE bytes, aligned
+   on their size, so that the slab of a block is found by masking its
+   address.  Blocks too large for a slab are mapped individually and
+   kept for reuse when freed.  Each thread caches a few free blocks of
+   each class, so most allocations take no lock.
+
+   Slabs and large blocks are obtained directly from the system, apart
+   from the malloc heap, and a slab is given back once all its blocks
+   are free, except for one kept per class.  The total amount of memory
+   held can be capped with paxbuf_pool_set_limit.
+
+   Allocations of sizes that do not fit in one of the POOL_CLASSES
+   classes go to malloc.  */
+
+#include <system.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <paxbuf.h>
+#include <paxpool.h>
+
+enum
+  {
+    SLAB_SIZE = 2 * 1024 * 1024,
+    POOL_CLASSES = 32,        /* Maximum number of block classes */
+    CACHE_MAX = 8,            /* Blocks of a class cached per thread */
+    LARGE_KEEP = 8,           /* Free large blocks kept per class */
+    BLOCK_ALIGN = 16          /* Alignment of unaligned blocks */
+  };
+
+/* Slab header, at the start of the slab */
+struct slab
+{
+  struct slab *next;          /* Next slab with free blocks */
+  struct slab *prev;
+  void *free;                 /* Free blocks, linked through their first
+				 word */
+  idx_t nfree;                /* Number of them */
+};
+
+struct pool_class
+{
+  idx_t size;                 /* Block size */
+  bool aligned;               /* Blocks are page-aligned */
+  idx_t stride;               /* Distance between blocks in a slab, or
+				 mapped size of a large block */
+  idx_t first;                /* Offset of the first block in a slab */
+  idx_t nblocks;              /* Blocks per slab, or 0 for large blocks */
+  struct slab *partial;       /* Slabs with free blocks */
+  idx_t nempty;               /* Number of them with all blocks free */
+  void *large;                /* Free large blocks */
+  idx_t nlarge;               /* Number of them */
+};
+
+/* Free blocks cached by a thread */
+struct pool_cache
+{
+  void *block[POOL_CLASSES][CACHE_MAX];
+  int count[POOL_CLASSES];
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_class pool_class[POOL_CLASSES];
+static int pool_nclasses;     /* Read without the lock */
+static idx_t pool_reserved;   /* Bytes obtained from the system */
+static idx_t pool_limit;      /* Maximum for POOL_RESERVED; 0 if none */
+static idx_t page_size;
+
+static pthread_key_t cache_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void cache_flush (void *closure);
+
+static void
+pool_init (void)
+{
+  page_size = sysconf (_SC_PAGESIZE);
+  pthread_key_create (&cache_key, cache_flush);
+}
+
+static idx_t
+round_up (idx_t n, idx_t align)
+{
+  return (n + align - 1) / align * align;
+}
+
+
+/* System memory */
+
+/* Map SIZE bytes aligned on ALIGN, which is a multiple of the page
+   size.  */
+static void *
+pool_map (idx_t size, idx_t align)
+{
+#ifdef MAP_ANONYMOUS
+  idx_t extra = align > page_size ? align : 0;
+  char *p = mmap (nullptr, size + extra, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+  if (extra)
+    {
+      char *q = (char *) round_up ((uintptr_t) p, align);
+      if (q > p)
+	munmap (p, q - p);
+      if (p + extra > q)
+	munmap (q + size, p + extra - q);
+      p = q;
+    }
+  return p;
+#else
+  void *p;
+  return posix_memalign (&p, align, size) ? nullptr : p;
+#endif
+}
+
+static void
+pool_unmap (void *p, idx_t size)
+{
+#ifdef MAP_ANONYMOUS
+  munmap (p, size);
+#else
+  free (p);
+#endif
+}
+
+/* Account for SIZE more bytes obtained from the system.  Return false
+   if this would exceed the limit.  */
+static bool
+pool_reserve (idx_t size)
+{
+  if (pool_limit && pool_reserved + size > pool_limit)
+    return false;
+  pool_reserved += size;
+  return true;
+}
+
+
+/* Classes */
+
+/* Return the class of blocks of SIZE bytes, creating it if CREATE is
+   true.  Return nullptr if there is none.  */
+static struct pool_class *
+class_find (idx_t size, bool aligned, bool create)
+{
+  int n = __atomic_load_n (&pool_nclasses, __ATOMIC_ACQUIRE);
+  struct pool_class *cls = nullptr;
+
+  for (int i = 0; i < n; i++)
+    if (pool_class[i].size == size && pool_class[i].aligned == aligned)
+      return &pool_class[i];
+  if (!create)
+    return nullptr;
+
+  pthread_mutex_lock (&pool_mutex);
+  n = pool_nclasses;
+  for (int i = 0; i < n; i++)
+    if (pool_class[i].size == size && pool_class[i].aligned == aligned)
+      {
+	cls = &pool_class[i];
+	break;
+      }
+  if (!cls && n < POOL_CLASSES)
+    {
+      cls = &pool_class[n];
+      memset (cls, 0, sizeof *cls);
+      cls->size = size;
+      cls->aligned = aligned;
+      if (aligned)
+	{
+	  cls->stride = round_up (size, page_size);
+	  cls->first = round_up (sizeof (struct slab), page_size);
+	}
+      else
+	{
+	  cls->stride = round_up (size, BLOCK_ALIGN);
+	  cls->first = round_up (sizeof (struct slab), BLOCK_ALIGN);
+	}
+      /* Blocks that would waste much of a slab are mapped
+	 individually.  */
+      if (cls->stride <= SLAB_SIZE / 4)
+	cls->nblocks = (SLAB_SIZE - cls->first) / cls->stride;
+      else
+	cls->stride = round_up (size, page_size);
+      __atomic_store_n (&pool_nclasses, n + 1, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock (&pool_mutex);
+  return cls;
+}
+
+static int
+class_index (struct pool_class *cls)
+{
+  return cls - pool_class;
+}
+
+static struct slab *
+slab_of (void *p)
+{
+  return (struct slab *) ((uintptr_t) p & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+static void
+slab_link (struct pool_class *cls, struct slab *s)
+{
+  s->prev = nullptr;
+  s->next = cls->partial;
+  if (s->next)
+    s->next->prev = s;
+  cls->partial = s;
+}
+
+static void
+slab_unlink (struct pool_class *cls, struct slab *s)
+{
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    cls->partial = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+}
+
+static struct slab *
+slab_new (struct pool_class *cls)
+{
+  struct slab *s;
+  char *p;
+
+  if (!pool_reserve (SLAB_SIZE))
+    return nullptr;
+  s = pool_map (SLAB_SIZE, SLAB_SIZE);
+  if (!s)
+    {
+      pool_reserved -= SLAB_SIZE;
+      return nullptr;
+    }
+  s->free = nullptr;
+  p = (char *) s + cls->first + (cls->nblocks - 1) * cls->stride;
+  for (idx_t i = 0; i < cls->nblocks; i++, p -= cls->stride)
+    {
+      *(void **) p = s->free;
+      s->free = p;
+    }
+  s->nfree = cls->nblocks;
+  slab_link (cls, s);
+  cls->nempty++;
+  return s;
+}
+
+/* Take a free block of CLS.  Must be called with the lock held.  */
+static void *
+class_take (struct pool_class *cls)
+{
+  struct slab *s;
+  void *p;
+
+  if (!cls->nblocks)
+    {
+      p = cls->large;
+      if (p)
+	{
+	  cls->large = *(void **) p;
+	  cls->nlarge--;
+	  return p;
+	}
+      if (!pool_reserve (cls->stride))
+	return nullptr;
+      p = pool_map (cls->stride, page_size);
+      if (!p)
+	pool_reserved -= cls->stride;
+      return p;
+    }
+
+  s = cls->partial;
+  if (!s)
+    {
+      s = slab_new (cls);
+      if (!s)
+	return nullptr;
+    }
+  p = s->free;
+  s->free = *(void **) p;
+  if (s->nfree-- == cls->nblocks)
+    cls->nempty--;
+  if (s->nfree == 0)
+    slab_unlink (cls, s);
+  return p;
+}
+
+/* Give back block P of CLS.  Must be called with the lock held.  */
+static void
+class_put (struct pool_class *cls, void *p)
+{
+  struct slab *s;
+
+  if (!cls->nblocks)
+    {
+      if (cls->nlarge < LARGE_KEEP)
+	{
+	  *(void **) p = cls->large;
+	  cls->large = p;
+	  cls->nlarge++;
+	}
+      else
+	{
+	  pool_unmap (p, cls->stride);
+	  pool_reserved -= cls->stride;
+	}
+      return;
+    }
+
+  s = slab_of (p);
+  *(void **) p = s->free;
+  s->free = p;
+  if (s->nfree++ == 0)
+    slab_link (cls, s);
+  if (s->nfree == cls->nblocks)
+    {
+      if (cls->nempty == 0)
+	cls->nempty++;
+      else
+	{
+	  slab_unlink (cls, s);
+	  pool_unmap (s, SLAB_SIZE);
+	  pool_reserved -= SLAB_SIZE;
+	}
+    }
+}
+
+/* Release the memory held by CLS that is not in use.  Must be called
+   with the lock held.  */
+static void
+class_trim (struct pool_class *cls)
+{
+  while (cls->large)
+    {
+      void *p = cls->large;
+      cls->large = *(void **) p;
+      pool_unmap (p, cls->stride);
+      pool_reserved -= cls->stride;
+    }
+  cls->nlarge = 0;
+
+  for (struct slab *s = cls->partial, *next; s; s = next)
+    {
+      next = s->next;
+      if (s->nfree == cls->nblocks)
+	{
+	  slab_unlink (cls, s);
+	  pool_unmap (s, SLAB_SIZE);
+	  pool_reserved -= SLAB_SIZE;
+	}
+    }
+  cls->nempty = 0;
+}
+
+
+/* Thread caches */
+
+static struct pool_cache *
+cache_get (void)
+{
+  struct pool_cache *cache = pthread_getspecific (cache_key);
+  if (!cache)
+    {
+      cache = calloc (1, sizeof *cache);
+      if (cache && pthread_setspecific (cache_key, cache))
+	{
+	  free (cache);
+	  cache = nullptr;
+	}
+    }
+  return cache;
+}
+
+/* Return the blocks cached by a thread to their classes.  Called when
+   the thread exits.  */
+static void
+cache_flush (void *closure)
+{
+  struct pool_cache *cache = closure;
+  int n = __atomic_load_n (&pool_nclasses, __ATOMIC_ACQUIRE);
+
+  pthread_mutex_lock (&pool_mutex);
+  for (int i = 0; i < n; i++)
+    while (cache->count[i] > 0)
+      class_put (&pool_class[i], cache->block[i][--cache->count[i]]);
+  pthread_mutex_unlock (&pool_mutex);
+  free (cache);
+}
+
+
+/* Interface functions */
+
+/* Allocate a block of SIZE bytes.  Return nullptr if there is no
+   memory or the limit would be exceeded.  */
+void *
+paxpool_alloc (idx_t size, bool aligned)
+{
+  struct pool_class *cls;
+  struct pool_cache *cache;
+  void *p;
+
+  pthread_once (&pool_once, pool_init);
+  cls = class_find (size, aligned, true);
+  if (!cls)
+    {
+      if (!aligned)
+	return imalloc (size);
+      return posix_memalign (&p, page_size, size) ? nullptr : p;
+    }
+
+  cache = cache_get ();
+  if (cache)
+    {
+      int i = class_index (cls);
+      if (cache->count[i] > 0)
+	return cache->block[i][--cache->count[i]];
+    }
+
+  pthread_mutex_lock (&pool_mutex);
+  p = class_take (cls);
+  pthread_mutex_unlock (&pool_mutex);
+  return p;
+}
+
+/* Free block P, allocated by paxpool_alloc with the same SIZE and
+   ALIGNED arguments.  */
+void
+paxpool_free (void *p, idx_t size, bool aligned)
+{
+  struct pool_class *cls;
+  struct pool_cache *cache;
+  int i;
+
+  if (!p)
+    return;
+  cls = class_find (size, aligned, false);
+  if (!cls)
+    {
+      free (p);
+      return;
+    }
+
+  i = class_index (cls);
+  cache = cache_get ();
+  if (cache && cache->count[i] < CACHE_MAX)
+    {
+      cache->block[i][cache->count[i]++] = p;
+      return;
+    }
+
+  /* The cache is full: give back half of it along with P.  */
+  pthread_mutex_lock (&pool_mutex);
+  class_put (cls, p);
+  while (cache && cache->count[i] > CACHE_MAX / 2)
+    class_put (cls, cache->block[i][--cache->count[i]]);
+  pthread_mutex_unlock (&pool_mutex);
+}
+
+/* Limit the memory held by the pool to LIMIT bytes, or remove the
+   limit if it is 0.  Memory already held is not released, but no more
+   is obtained while the total is above the limit.  */
+void
+paxbuf_pool_set_limit (idx_t limit)
+{
+  pthread_mutex_lock (&pool_mutex);
+  pool_limit = limit;
+  pthread_mutex_unlock (&pool_mutex);
+}
+
+/* Return the number of bytes held by the pool, in use or not.  */
+idx_t
+paxbuf_pool_reserved (void)
+{
+  idx_t n;
+
+  pthread_mutex_lock (&pool_mutex);
+  n = pool_reserved;
+  pthread_mutex_unlock (&pool_mutex);
+  return n;
+}
+
+/* Release the free memory held by the pool, including the blocks
+   cached by the calling thread.  */
+void
+paxbuf_pool_trim (void)
+{
+  struct pool_cache *cache;
+  int n;
+
+  pthread_once (&pool_once, pool_init);
+  cache = pthread_getspecific (cache_key);
+  n = __atomic_load_n (&pool_nclasses, __ATOMIC_ACQUIRE);
+  pthread_mutex_lock (&pool_mutex);
+  for (int i = 0; i < n; i++)
+    {
+      while (cache && cache->count[i] > 0)
+	class_put (&pool_class[i], cache->block[i][--cache->count[i]]);
+      class_trim (&pool_class[i]);
+    }
+  pthread_mutex_unlock (&pool_mutex);
+}
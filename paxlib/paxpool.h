@@ -0,0 +1,25 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Allocator for record buffers and other fixed-size objects shared by
+   all paxbufs.  Blocks of SIZE bytes are allocated with paxpool_alloc
+   and returned with paxpool_free, which must be given the same SIZE
+   and ALIGNED arguments.  If ALIGNED is true, blocks are page-aligned.
+   The tuning interface is in paxbuf.h.  */
+
+void *paxpool_alloc (idx_t size, bool aligned);
+void paxpool_free (void *p, idx_t size, bool aligned);
@@ -18,22 +18,46 @@
    with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <system.h>
+#include <pthread.h>
 #include <safe-read.h>
 #include <safe-write.h>
 #include <paxbuf.h>
 #include <pax.h>
 #include <tar.h>
+#include <uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if HAVE_SYS_MTIO_H
+# include <sys/mtio.h>
+#endif
+#if HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
 
 typedef struct tar_archive
 {
   char *filename;           /* Name of the archive file */
   int fd;                   /* Archive file descriptor */
   idx_t bfactor;	    /* Number of blocks in a record */
+  bool auto_bfactor;        /* Select bfactor when opening the archive */
+  paxbuf_t buf;             /* Buffer this archive belongs to */
   const char *rsh;          /* Full pathname of rsh */
   const char *rmt;          /* Full pathname of the remote command */
+  struct tar_uring *uring;  /* io_uring state, if used */
+  char *map;                /* Mapped archive, if used */
+  off_t map_size;           /* Size of the mapping */
+  off_t map_pos;            /* Current position in it */
+  off_t map_dropped;        /* Pages below this offset are released */
+  bool remote;              /* Archive is accessed via rmt */
+  bool stdio;               /* Archive is on standard input or output */
+  int mode;                 /* Mode flags given to tar_archive_create */
+  struct tar_volumes *volumes; /* Multi-volume state, if enabled */
 }
 tar_archive_t;
 
+static void volume_preopen (tar_archive_t *tar, int pax_mode);
+static void volume_discard (tar_archive_t *tar);
+
 
 /* Operations on local files */
 
@@ -52,9 +76,188 @@ local_writer (void *closure, void *data, idx_t size, idx_t *ret_size)
   tar_archive_t *tar = closure;
   ssize_t s = write (tar->fd, data, size);
   *ret_size = s + (s < 0);
+  /* A full medium ends the volume.  */
+  if (s < 0 && errno == ENOSPC && tar->volumes)
+    return pax_io_eof;
+  return s < 0 ? pax_io_failure : pax_io_success;
+}
+
+static pax_io_status_t
+local_readv (void *closure, struct iovec const *iov, int iovcnt,
+	     idx_t *ret_size)
+{
+  tar_archive_t *tar = closure;
+  ssize_t s = readv (tar->fd, iov, iovcnt);
+  *ret_size = s + (s < 0);
+  return s < 0 ? pax_io_failure : s == 0 ? pax_io_eof : pax_io_success;
+}
+
+static pax_io_status_t
+local_writev (void *closure, struct iovec const *iov, int iovcnt,
+	      idx_t *ret_size)
+{
+  tar_archive_t *tar = closure;
+  ssize_t s = writev (tar->fd, iov, iovcnt);
+  *ret_size = s + (s < 0);
+  if (s < 0 && errno == ENOSPC && tar->volumes)
+    return pax_io_eof;
   return s < 0 ? pax_io_failure : pax_io_success;
 }
 
+/* True if ERR means that a copy function cannot be used for the
+   descriptors given to it.  */
+static bool
+copy_unsupported (int err)
+{
+  return err == EINVAL || err == EXDEV || err == ENOSYS
+         || err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Move SIZE bytes from IN to OUT within the kernel, using
+   copy_file_range between regular files and splice when either is a
+   pipe.  */
+static pax_io_status_t
+kernel_copy (int in, int out, off_t size, off_t *ret_size)
+{
+  off_t total = 0;
+  bool use_splice = false;
+
+  while (total < size)
+    {
+      size_t len = size - total < SSIZE_MAX ? size - total : SSIZE_MAX;
+      ssize_t n;
+
+      if (!use_splice)
+	{
+	  n = copy_file_range (in, nullptr, out, nullptr, len, 0);
+#if HAVE_SPLICE
+	  if (n < 0 && total == 0 && copy_unsupported (errno))
+	    {
+	      use_splice = true;
+	      continue;
+	    }
+#endif
+	}
+#if HAVE_SPLICE
+      else
+	n = splice (in, nullptr, out, nullptr, len, SPLICE_F_MOVE);
+#endif
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (total == 0 && copy_unsupported (errno))
+	    errno = ENOTSUP;
+	  *ret_size = total;
+	  return pax_io_failure;
+	}
+      if (n == 0)
+	{
+	  *ret_size = total;
+	  return pax_io_eof;
+	}
+      total += n;
+    }
+  *ret_size = total;
+  return pax_io_success;
+}
+
+static pax_io_status_t
+local_copy_read (void *closure, int fd, off_t size, off_t *ret_size)
+{
+  tar_archive_t *tar = closure;
+  return kernel_copy (tar->fd, fd, size, ret_size);
+}
+
+/* Make the archive share the blocks of the next SIZE bytes of FD, if
+   both files are on a file system that supports it and the data is
+   block-aligned in both.  Return true on success.  */
+static bool
+local_clone (tar_archive_t *tar, int fd, off_t size)
+{
+#ifdef FICLONERANGE
+  struct stat st;
+  struct file_clone_range range;
+  off_t src, dst;
+  idx_t blksize;
+
+  if (fstat (tar->fd, &st) || !S_ISREG (st.st_mode))
+    return false;
+  blksize = ST_BLKSIZE (st);
+  src = lseek (fd, 0, SEEK_CUR);
+  dst = lseek (tar->fd, 0, SEEK_CUR);
+  if (src < 0 || dst < 0
+      || src % blksize || dst % blksize || size % blksize)
+    return false;
+
+  range.src_fd = fd;
+  range.src_offset = src;
+  range.src_length = size;
+  range.dest_offset = dst;
+  if (ioctl (tar->fd, FICLONERANGE, &range))
+    return false;
+  lseek (fd, src + size, SEEK_SET);
+  lseek (tar->fd, dst + size, SEEK_SET);
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* Move SIZE bytes from FD to the archive, cloning them when possible
+   and copying them within the kernel otherwise.  Only whole records
+   are moved: if the copy stops within a record, FD and the archive are
+   moved back to its start, and the archive is truncated there if it
+   ended with the copy, so that the rest goes through the record
+   buffer.  Descriptors that cannot be moved back are not handled.  */
+static pax_io_status_t
+local_copy_write (void *closure, int fd, off_t size, off_t *ret_size)
+{
+  tar_archive_t *tar = closure;
+  idx_t record_size = paxbuf_get_record_size (tar->buf);
+  pax_io_status_t status;
+  off_t rest;
+
+  if (lseek (fd, 0, SEEK_CUR) < 0)
+    {
+      *ret_size = 0;
+      errno = ENOTSUP;
+      return pax_io_failure;
+    }
+  if (local_clone (tar, fd, size))
+    {
+      *ret_size = size;
+      return pax_io_success;
+    }
+  status = kernel_copy (fd, tar->fd, size, ret_size);
+
+  rest = *ret_size % record_size;
+  if (rest)
+    {
+      int err = errno;
+      struct stat st;
+      off_t end = lseek (tar->fd, 0, SEEK_CUR);
+
+      if (end < 0 || lseek (fd, -rest, SEEK_CUR) < 0
+	  || lseek (tar->fd, end - rest, SEEK_SET) < 0)
+	return pax_io_failure;
+      if (fstat (tar->fd, &st) == 0 && S_ISREG (st.st_mode)
+	  && st.st_size == end)
+	ftruncate (tar->fd, end - rest);
+      *ret_size -= rest;
+      errno = err;
+    }
+
+  if (status == pax_io_failure && errno == ENOSPC && tar->volumes)
+    {
+      /* Let the record buffer switch to the next volume.  */
+      if (*ret_size > 0)
+	return pax_io_success;
+      errno = ENOTSUP;
+    }
+  return status;
+}
+
 static int
 local_seek (void *closure, off_t offset)
 {
@@ -67,15 +270,124 @@ local_seek (void *closure, off_t offset)
   return pax_io_success;
 }
 
+/* Records used for regular files and block devices, unless their
+   preferred I/O size is larger.  */
+enum { AUTO_RECORD_SIZE = 128 * 1024 };
+
+/* Largest record expected on a tape in variable block mode.  */
+enum { PROBE_RECORD_SIZE = 1024 * 1024 };
+
+/* Select the record size for the archive just opened, according to
+   its file type.  Tapes keep the traditional record size, unless the
+   drive is set to a fixed block size, which records must then be a
+   multiple of.  When reading a tape in variable block mode, the record
+   size is taken from the first record read.  */
+static void
+auto_bfactor (tar_archive_t *tar, int pax_mode)
+{
+  struct stat st;
+  idx_t size = TAR_DEFAULT_BFACTOR * BLOCKSIZE;
+  bool probe = false;
+
+  if (fstat (tar->fd, &st))
+    return;
+  if (S_ISREG (st.st_mode) || S_ISBLK (st.st_mode))
+    {
+      idx_t blksize = ST_BLKSIZE (st);
+      size = AUTO_RECORD_SIZE < blksize ? blksize : AUTO_RECORD_SIZE;
+    }
+  else if (S_ISFIFO (st.st_mode) || S_ISSOCK (st.st_mode))
+    {
+#ifdef F_GETPIPE_SZ
+      int n = fcntl (tar->fd, F_GETPIPE_SZ);
+      if (n > size)
+	size = n;
+#endif
+    }
+#if HAVE_SYS_MTIO_H && defined MTIOCGET
+  else if (S_ISCHR (st.st_mode))
+    {
+      struct mtget mt;
+
+      if (ioctl (tar->fd, MTIOCGET, &mt) == 0)
+	{
+	  idx_t blksize = 0;
+# ifdef MT_ST_BLKSIZE_MASK
+	  blksize = (mt.mt_dsreg & MT_ST_BLKSIZE_MASK) >> MT_ST_BLKSIZE_SHIFT;
+# endif
+	  if (blksize > 0)
+	    {
+	      idx_t unit = blksize;
+	      while (unit % BLOCKSIZE)
+		unit += blksize;
+	      size = (size + unit - 1) / unit * unit;
+	    }
+	  else if (pax_mode & PAXBUF_READ)
+	    {
+	      size = PROBE_RECORD_SIZE;
+	      probe = true;
+	    }
+	}
+    }
+#endif
+  size -= size % BLOCKSIZE;
+
+  if (paxbuf_set_record_size (tar->buf, size) == 0)
+    {
+      tar->bfactor = size / BLOCKSIZE;
+      if (probe)
+	paxbuf_probe_record_size (tar->buf);
+    }
+}
+
+/* Open the archive file NAME in PAX_MODE.  If CREATED is not nullptr,
+   a file created by this call is created exclusively and *CREATED is
+   set to true.  Return the file descriptor, or -1 on error.  */
+static int
+open_archive (char const *name, int pax_mode, bool *created)
+{
+  int mode = (pax_mode & PAXBUF_READ) ? O_RDONLY : O_RDWR;
+  int fd = -1;
+
+  if (created)
+    *created = false;
+  if ((pax_mode & PAXBUF_CREAT) && !(pax_mode & PAXBUF_READ))
+    {
+      if (!created)
+	mode |= O_CREAT;
+      else if (access (name, F_OK) != 0 && errno == ENOENT)
+	{
+	  mode |= O_CREAT | O_EXCL;
+	  *created = true;
+	}
+    }
+
+  if (pax_mode & TAR_DIRECT)
+    {
+      /* Bypass the page cache.  Not all file systems support it.  */
+      fd = open (name, mode | O_DIRECT, MODE_RW);
+      if (fd == -1 && errno != EINVAL)
+	return -1;
+    }
+  if (fd == -1)
+    fd = open (name, mode, MODE_RW);
+  if (fd == -1 && created)
+    *created = false;
+  return fd;
+}
+
 static int
 local_open (void *closure, int pax_mode)
 {
   tar_archive_t *tar = closure;
-  int mode = (pax_mode & PAXBUF_READ) ? O_RDONLY :
-              O_RDWR | ((pax_mode & PAXBUF_CREAT) ? O_CREAT : 0);
-  tar->fd = open (tar->filename, mode, MODE_RW);
+
+  tar->fd = open_archive (tar->filename, pax_mode, nullptr);
   if (tar->fd == -1)
     return pax_io_failure;
+  if (tar->auto_bfactor)
+    auto_bfactor (tar, pax_mode);
+  if (tar->volumes)
+    volume_preopen (tar, pax_mode);
   return pax_io_success;
 }
 
@@ -83,11 +395,689 @@ static int
 local_close (void *closure, int mode)
 {
   tar_archive_t *tar = closure;
+  if (tar->volumes)
+    volume_discard (tar);
   close (tar->fd);
   tar->fd = -1;
   return 0;
 }
 
+
+/* Multi-volume archives.  While a volume is in use, the next one is
+   opened and positioned at its beginning by a background thread, so
+   that switching volumes at the end of the current one only takes
+   replacing the file descriptor.  For tapes, positioning means
+   rewinding, which may take long after a medium change.  A volume
+   with the same name as the current one, such as a tape drive whose
+   medium is changed, and a volume that could not be opened in advance
+   are opened when switching to them.  Only local archives accessed
+   with the plain read and write calls are supported.  */
+
+struct tar_volumes
+{
+  tar_volume_fp name_fn;      /* Returns the name of a volume */
+  void *closure;              /* Its data */
+  idx_t volno;                /* Number of the current volume */
+  int pax_mode;               /* Mode the archive is opened in */
+
+    /* Next volume */
+  pthread_t thread;           /* Thread opening it */
+  bool pending;               /* The thread has been started */
+  char *name;                 /* Its name, or nullptr if there is none */
+  int fd;                     /* Its descriptor, or -1 */
+  int errnum;                 /* Value of errno if opening it failed */
+  bool created;               /* The file was created by the thread */
+};
+
+/* Rewind FD if it is a tape.  */
+static int
+volume_rewind (int fd)
+{
+#if HAVE_SYS_MTIO_H && defined MTIOCTOP
+  struct stat st;
+
+  if (fstat (fd, &st) == 0 && S_ISCHR (st.st_mode))
+    {
+      struct mtop op = { .mt_op = MTREW, .mt_count = 1 };
+      if (ioctl (fd, MTIOCTOP, &op) && errno != ENOTTY && errno != EINVAL)
+	return -1;
+    }
+#endif
+  return 0;
+}
+
+static void *
+volume_opener (void *closure)
+{
+  struct tar_volumes *vol = closure;
+
+  vol->fd = open_archive (vol->name, vol->pax_mode, &vol->created);
+  if (vol->fd != -1 && volume_rewind (vol->fd))
+    {
+      int ec = errno;
+      close (vol->fd);
+      vol->fd = -1;
+      errno = ec;
+    }
+  if (vol->fd == -1)
+    vol->errnum = errno;
+  return nullptr;
+}
+
+/* Start opening the volume that follows the current one.  */
+static void
+volume_preopen (tar_archive_t *tar, int pax_mode)
+{
+  struct tar_volumes *vol = tar->volumes;
+
+  vol->pax_mode = pax_mode;
+  vol->fd = -1;
+  vol->errnum = 0;
+  vol->created = false;
+  vol->pending = false;
+  vol->name = vol->name_fn (vol->closure, vol->volno + 1);
+  /* Opening the current file again would disturb it: that waits for
+     the switch.  Otherwise, if the thread cannot be started, the volume
+     is opened when it is needed.  */
+  if (vol->name && strcmp (vol->name, tar->filename) != 0
+      && pthread_create (&vol->thread, nullptr, volume_opener, vol) == 0)
+    vol->pending = true;
+}
+
+/* Wait for the next volume to be opened in advance.  Return false if
+   it is not open.  */
+static bool
+volume_wait (tar_archive_t *tar)
+{
+  struct tar_volumes *vol = tar->volumes;
+
+  if (vol->pending)
+    {
+      pthread_join (vol->thread, nullptr);
+      vol->pending = false;
+    }
+  return vol->fd != -1;
+}
+
+/* Drop the next volume.  */
+static void
+volume_discard (tar_archive_t *tar)
+{
+  struct tar_volumes *vol = tar->volumes;
+
+  if (volume_wait (tar))
+    {
+      close (vol->fd);
+      if (vol->created)
+	unlink (vol->name);
+    }
+  free (vol->name);
+  vol->name = nullptr;
+  vol->fd = -1;
+}
+
+/* Switch to the next volume.  Return 0 on success.  */
+static int
+volume_switch (tar_archive_t *tar)
+{
+  struct tar_volumes *vol = tar->volumes;
+
+  if (!vol->name)
+    return 1;
+  if (!volume_wait (tar))
+    {
+      /* Open it now: the medium may have been changed since an
+	 attempt in advance failed.  The current volume is closed first
+	 if it is the same file.  */
+      if (strcmp (vol->name, tar->filename) == 0)
+	{
+	  close (tar->fd);
+	  tar->fd = -1;
+	}
+      vol->errnum = 0;
+      volume_opener (vol);
+      if (vol->fd == -1)
+	{
+	  errno = vol->errnum;
+	  return 1;
+	}
+    }
+  if (tar->fd != -1)
+    close (tar->fd);
+  tar->fd = vol->fd;
+  free (tar->filename);
+  tar->filename = vol->name;
+  vol->name = nullptr;
+  vol->fd = -1;
+  vol->volno++;
+  volume_preopen (tar, vol->pax_mode);
+  return 0;
+}
+
+/* Enable multi-volume operation.  When the end of a volume is reached,
+   the archive continues in the volume whose name is returned by FN,
+   called with CLOSURE and the number of the volume, counting from 0
+   for the one given to tar_archive_create.  FN returns a string
+   allocated with malloc, or nullptr if there are no more volumes.  It
+   is called while the previous volume is in use, and the next volume
+   is opened in advance.  Return 0 on success, or ENOTSUP if the
+   archive is not a local one accessed with plain I/O.  */
+int
+tar_set_volumes (paxbuf_t pbuf, tar_volume_fp fn, void *closure)
+{
+  tar_archive_t *tar = paxbuf_get_data (pbuf);
+
+  if (tar->remote || tar->stdio || (tar->mode & (TAR_URING | TAR_MMAP)))
+    return ENOTSUP;
+  if (!tar->volumes)
+    tar->volumes = xzalloc (sizeof *tar->volumes);
+  tar->volumes->name_fn = fn;
+  tar->volumes->closure = closure;
+  tar->volumes->fd = -1;
+  return 0;
+}
+
+
+/* Archives on standard input or output, named "-".  These are usually
+   pipes, which are enlarged to PIPE_SIZE bytes and at least two
+   records, so that the processes on either side do not have to switch
+   at every record.  */
+
+/* Largest pipe unprivileged users may have by default.  */
+enum { PIPE_SIZE = 1024 * 1024 };
+
+/* Enlarge the pipe, settling for less down to one record if the
+   system limit is lower.  */
+static void
+pipe_resize (tar_archive_t *tar)
+{
+#ifdef F_SETPIPE_SZ
+  idx_t record_size = paxbuf_get_record_size (tar->buf);
+  idx_t want = PIPE_SIZE < 2 * record_size ? 2 * record_size : PIPE_SIZE;
+  int size = fcntl (tar->fd, F_GETPIPE_SZ);
+
+  for (; size >= 0 && want >= record_size; want /= 2)
+    if (size >= want
+	|| (want <= INT_MAX && fcntl (tar->fd, F_SETPIPE_SZ, (int) want) >= 0))
+      break;
+#endif
+}
+
+static int
+pipe_open (void *closure, int pax_mode)
+{
+  tar_archive_t *tar = closure;
+  struct stat st;
+
+  tar->fd = (pax_mode & PAXBUF_READ) ? STDIN_FILENO : STDOUT_FILENO;
+  if (tar->auto_bfactor)
+    auto_bfactor (tar, pax_mode);
+  if (fstat (tar->fd, &st) == 0 && S_ISFIFO (st.st_mode))
+    pipe_resize (tar);
+  return pax_io_success;
+}
+
+static int
+pipe_close (void *closure, int mode)
+{
+  tar_archive_t *tar = closure;
+  /* Standard streams are left open for the caller.  */
+  tar->fd = -1;
+  return 0;
+}
+
+
+/* Operations on local files via io_uring.  Up to URING_DEPTH requests
+   are kept queued against the archive: in read mode a ring of
+   registered record buffers is filled ahead of the current position,
+   in write mode the record buffer takes records over and writes them
+   from where they are, giving each one back when its write completes.
+   Short transfers are resumed where they stopped.  Write errors are
+   reported by a subsequent call or on close.  When io_uring is not
+   available, these functions fall back to the plain local ones.  */
+
+#if PAX_URING
+enum { URING_DEPTH = 8 };
+
+struct uring_slot
+{
+  char *data;               /* Read mode: registered buffer, one record
+			       long; write mode: record being written */
+  int opcode;               /* Operation requested */
+  idx_t len;                /* Size of the request */
+  off_t offset;             /* File offset of the request */
+  idx_t filled;             /* Bytes transferred so far */
+  struct iovec iov;         /* Write mode: the rest of the record */
+  idx_t pos;                /* Read mode: bytes consumed */
+  int res;                  /* Result of the request */
+  bool done;                /* Request has completed */
+};
+
+struct tar_uring
+{
+  struct uring ring;
+  struct uring_slot slot[URING_DEPTH];
+  int mode;                 /* Paxbuf mode */
+  idx_t size;               /* Size of each buffer */
+  int head;                 /* Oldest slot in use */
+  int count;                /* Number of slots in use */
+  off_t offset;             /* File offset of the next request */
+  int error;                /* Deferred write error */
+};
+
+/* Queue the part of the request on slot I that is not transferred
+   yet.  */
+static int
+uring_slot_queue (tar_archive_t *tar, int i)
+{
+  struct tar_uring *u = tar->uring;
+  struct uring_slot *slot = &u->slot[i];
+  int ec;
+
+  if (slot->opcode == IORING_OP_WRITEV)
+    {
+      slot->iov.iov_base = slot->data + slot->filled;
+      slot->iov.iov_len = slot->len - slot->filled;
+      ec = uring_queue_rw (&u->ring, slot->opcode, tar->fd, &slot->iov, 1,
+			   slot->offset + slot->filled, 0, i);
+    }
+  else
+    ec = uring_queue_rw (&u->ring, slot->opcode, tar->fd,
+			 slot->data + slot->filled, slot->len - slot->filled,
+			 slot->offset + slot->filled, i, i);
+  if (ec == 0)
+    ec = uring_submit (&u->ring);
+  return ec;
+}
+
+/* Start the request OPCODE on slot I, at the current offset.  */
+static int
+uring_slot_submit (tar_archive_t *tar, int i, int opcode)
+{
+  struct tar_uring *u = tar->uring;
+  struct uring_slot *slot = &u->slot[i];
+  int ec;
+
+  slot->opcode = opcode;
+  slot->offset = u->offset;
+  slot->filled = 0;
+  slot->pos = 0;
+  slot->done = false;
+  ec = uring_slot_queue (tar, i);
+  if (ec)
+    {
+      slot->res = -ec;
+      slot->done = true;
+      return ec;
+    }
+  /* A short transfer is completed before the slot is used, so the next
+     request starts where this one ends.  */
+  u->offset += slot->len;
+  return 0;
+}
+
+/* Wait until the request on slot I completes.  Short transfers on any
+   slot are resumed meanwhile; a transfer of nothing, at the end of the
+   file or of the medium, completes the request.  */
+static int
+uring_slot_wait (tar_archive_t *tar, int i)
+{
+  struct tar_uring *u = tar->uring;
+
+  while (!u->slot[i].done)
+    {
+      unsigned long long n;
+      int res;
+      int ec = uring_wait (&u->ring, &n, &res);
+      if (ec)
+	return ec;
+
+      struct uring_slot *slot = &u->slot[n];
+      if (res > 0)
+	{
+	  slot->filled += res;
+	  if (slot->filled < slot->len)
+	    {
+	      ec = uring_slot_queue (tar, n);
+	      if (ec == 0)
+		continue;
+	      res = -ec;
+	    }
+	}
+      slot->res = res < 0 ? res : slot->filled;
+      slot->done = true;
+    }
+  return 0;
+}
+
+/* Wait for the oldest request and release its slot.  In write mode,
+   give its record back and remember the first error in U->error.  */
+static void
+uring_retire (tar_archive_t *tar)
+{
+  struct tar_uring *u = tar->uring;
+  struct uring_slot *slot = &u->slot[u->head];
+  int ec = uring_slot_wait (tar, u->head);
+
+  if (u->mode & PAXBUF_WRITE)
+    {
+      if (u->error == 0)
+	u->error = ec ? ec
+	           : slot->res < 0 ? -slot->res
+	           : slot->res < slot->len ? ENOSPC : 0;
+      paxbuf_release_record (tar->buf, slot->data);
+      slot->data = nullptr;
+    }
+  u->head = (u->head + 1) % URING_DEPTH;
+  u->count--;
+}
+
+/* Queue reads on all slots, starting at the current offset.  */
+static void
+uring_start_reading (tar_archive_t *tar)
+{
+  struct tar_uring *u = tar->uring;
+
+  u->head = 0;
+  for (u->count = 0; u->count < URING_DEPTH; u->count++)
+    {
+      u->slot[u->count].len = u->size;
+      uring_slot_submit (tar, u->count, IORING_OP_READ_FIXED);
+    }
+}
+
+static void
+uring_destroy (tar_archive_t *tar)
+{
+  struct tar_uring *u = tar->uring;
+  uring_free (&u->ring);
+  for (int i = 0; i < URING_DEPTH; i++)
+    free (u->slot[i].data);
+  free (u);
+  tar->uring = nullptr;
+}
+
+/* Set up io_uring for the archive open on TAR->fd.  On failure, leave
+   TAR->uring unset so that plain I/O is used.  */
+static void
+uring_setup (tar_archive_t *tar, int pax_mode)
+{
+  struct stat st;
+  struct tar_uring *u;
+  struct iovec iov[URING_DEPTH];
+
+  /* Requests carry explicit offsets, which only makes sense for
+     random-access files.  */
+  if (fstat (tar->fd, &st) || !(S_ISREG (st.st_mode) || S_ISBLK (st.st_mode)))
+    return;
+  u = calloc (1, sizeof *u);
+  if (!u)
+    return;
+  u->ring.fd = -1;
+  tar->uring = u;
+  u->mode = pax_mode;
+  u->size = tar->bfactor * BLOCKSIZE;
+  for (int i = 0; i < URING_DEPTH && (pax_mode & PAXBUF_READ); i++)
+    {
+      void *p;
+      if (posix_memalign (&p, sysconf (_SC_PAGESIZE), u->size))
+	p = nullptr;
+      u->slot[i].data = p;
+      if (!u->slot[i].data)
+	{
+	  uring_destroy (tar);
+	  return;
+	}
+      iov[i].iov_base = u->slot[i].data;
+      iov[i].iov_len = u->size;
+    }
+  if (uring_init (&u->ring, URING_DEPTH) != 0
+      || ((pax_mode & PAXBUF_READ)
+	  && uring_register_buffers (&u->ring, iov, URING_DEPTH) != 0))
+    {
+      uring_destroy (tar);
+      return;
+    }
+  u->offset = lseek (tar->fd, 0, SEEK_CUR);
+  if (u->offset < 0)
+    u->offset = 0;
+  if (pax_mode & PAXBUF_READ)
+    uring_start_reading (tar);
+}
+#endif
+
+static pax_io_status_t
+uring_reader (void *closure, void *data, idx_t size, idx_t *ret_size)
+{
+  tar_archive_t *tar = closure;
+#if PAX_URING
+  struct tar_uring *u = tar->uring;
+  if (u)
+    {
+      for (;;)
+	{
+	  struct uring_slot *slot = &u->slot[u->head];
+	  int ec = uring_slot_wait (tar, u->head);
+
+	  *ret_size = 0;
+	  if (ec || slot->res < 0)
+	    {
+	      errno = ec ? ec : -slot->res;
+	      return pax_io_failure;
+	    }
+	  if (slot->res == 0)
+	    return pax_io_eof;
+	  if (slot->pos < slot->res)
+	    {
+	      idx_t n = slot->res - slot->pos;
+	      if (n > size)
+		n = size;
+	      memcpy (data, slot->data + slot->pos, n);
+	      slot->pos += n;
+	      *ret_size = n;
+	      return pax_io_success;
+	    }
+	  /* The slot is consumed: queue it after the others.  */
+	  uring_slot_submit (tar, u->head, IORING_OP_READ_FIXED);
+	  u->head = (u->head + 1) % URING_DEPTH;
+	}
+    }
+#endif
+  return local_reader (tar, data, size, ret_size);
+}
+
+#if PAX_URING
+/* Write the record DATA, which is kept in its slot until the write
+   completes.  */
+static pax_io_status_t
+uring_take (void *closure, char *data, idx_t size)
+{
+  tar_archive_t *tar = closure;
+  struct tar_uring *u = tar->uring;
+  int i;
+
+  if (u->count == URING_DEPTH)
+    uring_retire (tar);
+  if (u->error)
+    {
+      paxbuf_release_record (tar->buf, data);
+      errno = u->error;
+      return pax_io_failure;
+    }
+
+  i = (u->head + u->count) % URING_DEPTH;
+  u->slot[i].data = data;
+  u->slot[i].len = size;
+  u->count++;
+  if (uring_slot_submit (tar, i, IORING_OP_WRITEV))
+    {
+      errno = -u->slot[i].res;
+      return pax_io_failure;
+    }
+  return pax_io_success;
+}
+#endif
+
+static int
+uring_seek (void *closure, off_t offset)
+{
+  tar_archive_t *tar = closure;
+#if PAX_URING
+  struct tar_uring *u = tar->uring;
+  if (u)
+    {
+      while (u->count > 0)
+	uring_retire (tar);
+      if (u->error)
+	{
+	  errno = u->error;
+	  return pax_io_failure;
+	}
+      u->offset = offset;
+      if (u->mode & PAXBUF_READ)
+	uring_start_reading (tar);
+      return pax_io_success;
+    }
+#endif
+  return local_seek (tar, offset);
+}
+
+static int
+uring_open (void *closure, int pax_mode)
+{
+  tar_archive_t *tar = closure;
+  int rc = local_open (tar, pax_mode);
+#if PAX_URING
+  if (rc == pax_io_success)
+    uring_setup (tar, pax_mode);
+  paxbuf_set_take (tar->buf, tar->uring && (pax_mode & PAXBUF_WRITE)
+			     ? uring_take : nullptr);
+#endif
+  return rc;
+}
+
+static int
+uring_close (void *closure, int pax_mode)
+{
+  tar_archive_t *tar = closure;
+  int rc = 0;
+#if PAX_URING
+  struct tar_uring *u = tar->uring;
+  if (u)
+    {
+      while (u->count > 0)
+	uring_retire (tar);
+      if (u->error)
+	{
+	  errno = u->error;
+	  rc = -1;
+	}
+      uring_destroy (tar);
+    }
+#endif
+  local_close (tar, pax_mode);
+  return rc;
+}
+
+
+/* Operations on local files via mmap.  A regular file opened for
+   reading is mapped as a whole and records are copied straight from
+   the mapping, so no read calls are issued.  Pages behind the current
+   position are released in MMAP_DROP_SIZE chunks to keep the resident
+   set small.  If the file cannot be mapped, plain I/O is used.  */
+
+enum { MMAP_DROP_SIZE = 8 * 1024 * 1024 };
+
+static void
+mmap_setup (tar_archive_t *tar)
+{
+  struct stat st;
+  void *p;
+
+  if (fstat (tar->fd, &st) || !S_ISREG (st.st_mode) || st.st_size == 0
+      || st.st_size != (size_t) st.st_size)
+    return;
+  p = mmap (nullptr, st.st_size, PROT_READ, MAP_SHARED, tar->fd, 0);
+  if (p == MAP_FAILED)
+    return;
+  madvise (p, st.st_size, MADV_SEQUENTIAL);
+  tar->map = p;
+  tar->map_size = st.st_size;
+  tar->map_pos = 0;
+  tar->map_dropped = 0;
+}
+
+/* Release the pages that lie completely behind the current position.  */
+static void
+mmap_drop (tar_archive_t *tar)
+{
+  off_t end = tar->map_pos - tar->map_pos % getpagesize ();
+  if (end - tar->map_dropped >= MMAP_DROP_SIZE)
+    {
+      madvise (tar->map + tar->map_dropped, end - tar->map_dropped,
+	       MADV_DONTNEED);
+      tar->map_dropped = end;
+    }
+}
+
+static pax_io_status_t
+mmap_reader (void *closure, void *data, idx_t size, idx_t *ret_size)
+{
+  tar_archive_t *tar = closure;
+
+  if (!tar->map)
+    return local_reader (tar, data, size, ret_size);
+  if (tar->map_pos >= tar->map_size)
+    {
+      *ret_size = 0;
+      return pax_io_eof;
+    }
+  if (size > tar->map_size - tar->map_pos)
+    size = tar->map_size - tar->map_pos;
+  memcpy (data, tar->map + tar->map_pos, size);
+  tar->map_pos += size;
+  mmap_drop (tar);
+  *ret_size = size;
+  return pax_io_success;
+}
+
+static int
+mmap_seek (void *closure, off_t offset)
+{
+  tar_archive_t *tar = closure;
+
+  if (!tar->map)
+    return local_seek (tar, offset);
+  if (offset < 0)
+    return pax_io_failure;
+  tar->map_pos = offset;
+  if (offset < tar->map_dropped)
+    tar->map_dropped = offset - offset % getpagesize ();
+  return pax_io_success;
+}
+
+static int
+mmap_open (void *closure, int pax_mode)
+{
+  tar_archive_t *tar = closure;
+  int rc = local_open (tar, pax_mode);
+  if (rc == pax_io_success && (pax_mode & PAXBUF_READ))
+    mmap_setup (tar);
+  return rc;
+}
+
+static int
+mmap_close (void *closure, int pax_mode)
+{
+  tar_archive_t *tar = closure;
+  if (tar->map)
+    {
+      munmap (tar->map, tar->map_size);
+      tar->map = nullptr;
+    }
+  return local_close (tar, pax_mode);
+}
+
 
 /* Operations on remote files */
 static pax_io_status_t
@@ -144,6 +1134,9 @@ static int
 tar_destroy (void *closure)
 {
   tar_archive_t *tar = closure;
+  if (tar->volumes)
+    volume_discard (tar);
+  free (tar->volumes);
   free (tar->filename);
   free (tar);
   return 0;
@@ -152,6 +1145,9 @@ tar_destroy (void *closure)
 static int
 tar_wrapper (void *closure)
 {
+  tar_archive_t *tar = closure;
+  if (tar->volumes)
+    return volume_switch (tar);
   return 1;
 }
 
@@ -164,18 +1160,47 @@ tar_archive_create (paxbuf_t *pbuf, const char *filename,
   tar = xmalloc (sizeof (*tar));
   tar->filename = xstrdup (filename);
   tar->fd = -1;
-  tar->bfactor = bfactor;
+  tar->auto_bfactor = bfactor == 0;
+  tar->bfactor = bfactor == 0 ? TAR_DEFAULT_BFACTOR : bfactor;
   tar->rsh = nullptr;
   tar->rmt = nullptr;
-  paxbuf_create (pbuf, mode, tar, bfactor * BLOCKSIZE);
+  tar->uring = nullptr;
+  tar->map = nullptr;
+  tar->remote = remote;
+  tar->stdio = !remote && strcmp (filename, "-") == 0;
+  tar->mode = mode;
+  tar->volumes = nullptr;
+  if (mode & TAR_DIRECT)
+    mode |= PAXBUF_ALIGN;
+  paxbuf_create (pbuf, mode, tar, tar->bfactor * BLOCKSIZE);
+  tar->buf = *pbuf;
   if (remote)
     {
       paxbuf_set_io (*pbuf, remote_reader, remote_writer, remote_seek);
       paxbuf_set_term (*pbuf, remote_open, remote_close, tar_destroy);
     }
+  else if (tar->stdio)
+    {
+      paxbuf_set_io (*pbuf, local_reader, local_writer, local_seek);
+      paxbuf_set_iov (*pbuf, local_readv, local_writev);
+      paxbuf_set_copy (*pbuf, local_copy_read, local_copy_write);
+      paxbuf_set_term (*pbuf, pipe_open, pipe_close, tar_destroy);
+    }
+  else if (mode & TAR_URING)
+    {
+      paxbuf_set_io (*pbuf, uring_reader, local_writer, uring_seek);
+      paxbuf_set_term (*pbuf, uring_open, uring_close, tar_destroy);
+    }
+  else if (mode & TAR_MMAP)
+    {
+      paxbuf_set_io (*pbuf, mmap_reader, local_writer, mmap_seek);
+      paxbuf_set_term (*pbuf, mmap_open, mmap_close, tar_destroy);
+    }
   else
     {
       paxbuf_set_io (*pbuf, local_reader, local_writer, local_seek);
+      paxbuf_set_iov (*pbuf, local_readv, local_writev);
+      paxbuf_set_copy (*pbuf, local_copy_read, local_copy_write);
       paxbuf_set_term (*pbuf, local_open, local_close, tar_destroy);
     }
 
@@ -195,3 +1220,31 @@ tar_set_rsh (paxbuf_t pbuf, const char *rsh)
   tar_archive_t *tar = paxbuf_get_data (pbuf);
   tar->rsh = rsh;
 }
+
+/* Return the size of the open archive PBUF, or -1 if it cannot be
+   determined, for instance because it is a pipe.  */
+off_t
+tar_archive_size (paxbuf_t pbuf)
+{
+  tar_archive_t *tar = paxbuf_get_data (pbuf);
+  off_t (*seek) (int, off_t, int) = tar->remote ? rmt_lseek : lseek;
+  off_t cur, end;
+  struct stat st;
+
+  if (tar->fd == -1)
+    {
+      errno = EBADF;
+      return -1;
+    }
+  if (!tar->remote && fstat (tar->fd, &st) == 0 && S_ISREG (st.st_mode))
+    return st.st_size;
+
+  /* Block devices and remote archives.  */
+  cur = seek (tar->fd, 0, SEEK_CUR);
+  if (cur < 0)
+    return -1;
+  end = seek (tar->fd, 0, SEEK_END);
+  if (seek (tar->fd, cur, SEEK_SET) < 0)
+    return -1;
+  return end;
+}
@@ -0,0 +1,989 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Header iterator.  Successive member headers are decoded from a
+   paxbuf into a struct tar_stat_info.  The strings and the sparse map
+   it points to are allocated from obstacks belonging to the iterator,
+   which are emptied, but keep their memory, when moving to the next
+   member.  Listing an archive thus does not allocate memory once the
+   arenas have grown to the size needed by its largest member.
+
+   Old GNU long names and links, POSIX extended headers, including the
+   GNU sparse formats 0.0, 0.1 and 1.0, old GNU sparse headers and star
+   headers are understood.  Embedded member indexes are skipped.  A
+   malformed archive makes the iterator fail with EILSEQ.  */
+
+#include <system.h>
+#include <paxbuf.h>
+#include <pax.h>
+#include <tar.h>
+#include <tarnum.h>
+#define obstack_chunk_alloc xmalloc
+#define obstack_chunk_free free
+#include <obstack.h>
+
+/* Size of the chunks the arenas allocate.  Ordinary members fit in
+   the first one.  */
+enum { ARENA_CHUNK_SIZE = 16 * 1024 };
+
+/* Largest long name or extended header accepted.  */
+enum { XHDR_MAX = 16 * 1024 * 1024 };
+
+struct tar_iterator
+{
+  paxbuf_t buf;               /* Archive being read */
+  int flags;                  /* TAR_ITER_* flags */
+  struct obstack arena;       /* Strings of the current member */
+  void *arena_base;           /* First object in it */
+  struct obstack sparse;      /* Sparse map of the current member */
+  void *sparse_base;          /* First object in it */
+  char *global;               /* Last global extended header */
+  idx_t global_size;          /* Its size */
+  union block header;         /* Header of the current member */
+  struct tar_stat_info st;    /* Its decoded form */
+  off_t header_offset;        /* Offset of the first header block of the
+				 member, including extended headers */
+  off_t data_left;            /* Member data not read yet */
+  off_t pad_left;             /* Padding after it */
+  bool done;                  /* End of archive reached */
+};
+
+/* Extended attributes collected for the next member.  */
+struct xattrs
+{
+  char *long_name;            /* From a GNUTYPE_LONGNAME header */
+  char *long_link;            /* From a GNUTYPE_LONGLINK header */
+  char *xhdr;                 /* Extended header */
+  idx_t xhdr_size;            /* Its size */
+};
+
+/* Pending entry of a sparse map in format 0.0.  */
+struct sparse_state
+{
+  off_t offset;               /* Offset of the entry being defined */
+  bool have_offset;           /* It was given */
+  int major;                  /* Version of the sparse format */
+  int minor;
+  idx_t count;                /* Number of entries in the map */
+};
+
+
+
+/* Reading from the archive */
+
+/* Read one block into BLOCK.  Return pax_io_eof if the archive ends
+   before it.  */
+static pax_io_status_t
+read_block (tar_iterator_t it, union block *block)
+{
+  idx_t n;
+  pax_io_status_t status = paxbuf_read (it->buf, block->buffer, BLOCKSIZE, &n);
+
+  if (n == BLOCKSIZE)
+    return pax_io_success;
+  if (status == pax_io_failure)
+    return status;
+  if (n == 0)
+    return pax_io_eof;
+  errno = EILSEQ;
+  return pax_io_failure;
+}
+
+/* Skip SIZE bytes of the archive, seeking over them if TAR_ITER_SEEK
+   was given and they extend past the current record.  */
+static pax_io_status_t
+skip_data (tar_iterator_t it, off_t size)
+{
+  while (size > 0)
+    {
+      char *p;
+      idx_t n;
+      pax_io_status_t status = paxbuf_peek (it->buf, &p, &n);
+
+      if (status == pax_io_failure)
+	return status;
+      if (n == 0)
+	{
+	  errno = EILSEQ;
+	  return pax_io_failure;
+	}
+      if (n >= size)
+	{
+	  paxbuf_consume (it->buf, size);
+	  break;
+	}
+      paxbuf_consume (it->buf, n);
+      size -= n;
+
+      if (it->flags & TAR_ITER_SEEK)
+	{
+	  off_t target = paxbuf_tell (it->buf) + size;
+	  off_t off = paxbuf_seek (it->buf, target);
+	  if (off < 0)
+	    return pax_io_failure;
+	  if (off < target)
+	    {
+	      errno = EILSEQ;
+	      return pax_io_failure;
+	    }
+	  break;
+	}
+    }
+  return pax_io_success;
+}
+
+/* Read the data of a member of SIZE bytes holding a long name or an
+   extended header into the arena.  Return the data, NUL-terminated, or
+   nullptr on error.  */
+static char *
+read_string (tar_iterator_t it, off_t size)
+{
+  char *p;
+  idx_t n;
+  pax_io_status_t status;
+
+  if (size < 0 || size > XHDR_MAX)
+    {
+      errno = EILSEQ;
+      return nullptr;
+    }
+  obstack_blank (&it->arena, size + 1);
+  p = obstack_finish (&it->arena);
+  status = paxbuf_read (it->buf, p, size, &n);
+  if (n < size)
+    {
+      if (status != pax_io_failure)
+	errno = EILSEQ;
+      return nullptr;
+    }
+  p[size] = 0;
+  if (skip_data (it, (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE))
+    return nullptr;
+  return p;
+}
+
+
+
+/* Decoding header fields */
+
+/* Decode the numeric FIELD of LEN bytes of BLOCK into *RET.  Return
+   false if it is malformed.  */
+static bool
+decode_field (union block const *block, char const *field, idx_t len,
+	      intmax_t *ret)
+{
+#if TARHDR_SSE2
+  if (len <= 16 && field - block->buffer + 16 <= BLOCKSIZE)
+    return tar_decode_number_sse2 (field, len, ret);
+#endif
+  return tar_decode_number (field, len, ret);
+}
+
+#define DECODE(block, field, ret) \
+  decode_field (block, field, sizeof (field), ret)
+
+/* Return true if the checksum of BLOCK is correct.  The checksum field
+   counts as spaces.  Some old archivers summed signed chars, which is
+   accepted as well.  */
+static bool
+checksum_ok (union block const *block)
+{
+  intmax_t recorded;
+  intmax_t usum, ssum;
+
+  if (!DECODE (block, block->header.chksum, &recorded))
+    return false;
+#if TARHDR_SSE2
+  tar_block_sums_sse2 (block, &usum, &ssum);
+#else
+  tar_block_sums (block, &usum, &ssum);
+#endif
+  for (int i = 0; i < sizeof block->header.chksum; i++)
+    {
+      usum += ' ' - (unsigned char) block->header.chksum[i];
+      ssum += ' ' - (signed char) block->header.chksum[i];
+    }
+  return recorded == usum || recorded == ssum;
+}
+
+/* Return true if BLOCK consists of zero bytes.  */
+static bool
+zero_block (union block const *block)
+{
+#if TARHDR_SSE2
+  return tar_zero_block_sse2 (block);
+#else
+  return tar_zero_block (block);
+#endif
+}
+
+/* Copy the field of LEN bytes at P, which need not be NUL-terminated,
+   into the arena.  If PREFIX is not nullptr, it is prepended to it,
+   followed by a slash, unless empty.  */
+static char *
+field_string (tar_iterator_t it, char const *prefix, idx_t prefix_len,
+	      char const *p, idx_t len)
+{
+  if (prefix)
+    {
+      idx_t n = strnlen (prefix, prefix_len);
+      if (n)
+	{
+	  obstack_grow (&it->arena, prefix, n);
+	  obstack_1grow (&it->arena, '/');
+	}
+    }
+  obstack_grow0 (&it->arena, p, strnlen (p, len));
+  return obstack_finish (&it->arena);
+}
+
+/* Return the file type bits for the member with TYPEFLAG.  */
+static mode_t
+type_mode (char typeflag)
+{
+  switch (typeflag)
+    {
+    case SYMTYPE:
+      return S_IFLNK;
+    case CHRTYPE:
+      return S_IFCHR;
+    case BLKTYPE:
+      return S_IFBLK;
+    case DIRTYPE:
+    case GNUTYPE_DUMPDIR:
+      return S_IFDIR;
+    case FIFOTYPE:
+      return S_IFIFO;
+    default:
+      return S_IFREG;
+    }
+}
+
+/* Return true if members of type TYPEFLAG have data following their
+   header.  */
+static bool
+has_data (char typeflag)
+{
+  switch (typeflag)
+    {
+    case LNKTYPE:
+    case SYMTYPE:
+    case CHRTYPE:
+    case BLKTYPE:
+    case DIRTYPE:
+    case FIFOTYPE:
+      return false;
+    default:
+      return true;
+    }
+}
+
+/* Add an entry to the sparse map being built.  */
+static void
+sparse_add (tar_iterator_t it, struct sparse_state *ss,
+	    off_t offset, off_t numbytes)
+{
+  struct sp_array sp = { .offset = offset, .numbytes = numbytes };
+  obstack_grow (&it->sparse, &sp, sizeof sp);
+  ss->count++;
+}
+
+/* Decode the old GNU sparse descriptors SP of BLOCK, of which there are
+   N.  */
+static bool
+sparse_decode (tar_iterator_t it, struct sparse_state *ss,
+	       union block const *block, struct sparse const *sp, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      intmax_t offset, numbytes;
+
+      if (!sp[i].numbytes[0])
+	break;
+      if (!DECODE (block, sp[i].offset, &offset)
+	  || !DECODE (block, sp[i].numbytes, &numbytes)
+	  || offset < 0 || numbytes < 0)
+	return false;
+      sparse_add (it, ss, offset, numbytes);
+    }
+  return true;
+}
+
+/* Decode the ustar, old GNU or star header in IT->header into IT->st.  */
+static bool
+decode_header (tar_iterator_t it, struct sparse_state *ss)
+{
+  union block const *h = &it->header;
+  struct tar_stat_info *st = &it->st;
+  intmax_t mode, uid, gid, size, mtime, major = 0, minor = 0;
+  bool ustar = memcmp (h->header.magic, TMAGIC, TMAGLEN) == 0;
+  bool oldgnu = memcmp (h->header.magic, OLDGNU_MAGIC,
+			sizeof OLDGNU_MAGIC - 1) == 0;
+  bool star = ustar && memcmp (h->star_in_header.xmagic, "tar", 4) == 0;
+
+  if (!DECODE (h, h->header.mode, &mode) || !DECODE (h, h->header.uid, &uid)
+      || !DECODE (h, h->header.gid, &gid)
+      || !DECODE (h, h->header.size, &size)
+      || !DECODE (h, h->header.mtime, &mtime) || size < 0)
+    return false;
+  if ((ustar || oldgnu)
+      && (h->header.typeflag == CHRTYPE || h->header.typeflag == BLKTYPE)
+      && (!DECODE (h, h->header.devmajor, &major)
+	  || !DECODE (h, h->header.devminor, &minor)))
+    return false;
+
+  if (star)
+    st->orig_file_name = field_string (it, h->star_header.prefix,
+				       sizeof h->star_header.prefix,
+				       h->header.name, sizeof h->header.name);
+  else if (ustar)
+    st->orig_file_name = field_string (it, h->header.prefix,
+				       sizeof h->header.prefix,
+				       h->header.name, sizeof h->header.name);
+  else
+    st->orig_file_name = field_string (it, nullptr, 0, h->header.name,
+				       sizeof h->header.name);
+  st->link_name = field_string (it, nullptr, 0, h->header.linkname,
+				sizeof h->header.linkname);
+  if (ustar || oldgnu)
+    {
+      st->uname = field_string (it, nullptr, 0, h->header.uname,
+				sizeof h->header.uname);
+      st->gname = field_string (it, nullptr, 0, h->header.gname,
+				sizeof h->header.gname);
+    }
+
+  st->stat.st_mode = (mode & ~S_IFMT) | type_mode (h->header.typeflag);
+  /* Old archives mark directories with a trailing slash.  */
+  if (h->header.typeflag == AREGTYPE)
+    {
+      idx_t len = strlen (st->orig_file_name);
+      if (len > 0 && st->orig_file_name[len - 1] == '/')
+	st->stat.st_mode = (st->stat.st_mode & ~S_IFMT) | S_IFDIR;
+    }
+  st->stat.st_uid = uid;
+  st->stat.st_gid = gid;
+  st->stat.st_size = size;
+  st->stat.st_mtime = mtime;
+  st->devmajor = major;
+  st->devminor = minor;
+  st->stat.st_rdev = makedev (major, minor);
+  st->archive_file_size = size;
+
+  if (oldgnu || star)
+    {
+      intmax_t atime, ctime;
+      char const *a = oldgnu ? h->oldgnu_header.atime : h->star_header.atime;
+      char const *c = oldgnu ? h->oldgnu_header.ctime : h->star_header.ctime;
+
+      if (*a && decode_field (h, a, sizeof h->oldgnu_header.atime, &atime))
+	st->stat.st_atime = atime;
+      if (*c && decode_field (h, c, sizeof h->oldgnu_header.ctime, &ctime))
+	st->stat.st_ctime = ctime;
+    }
+
+  if (h->header.typeflag == GNUTYPE_SPARSE)
+    {
+      intmax_t realsize;
+      union block ext;
+
+      if (!DECODE (h, h->oldgnu_header.realsize, &realsize) || realsize < 0
+	  || !sparse_decode (it, ss, h, h->oldgnu_header.sp,
+			     SPARSES_IN_OLDGNU_HEADER))
+	return false;
+      st->is_sparse = true;
+      st->stat.st_size = realsize;
+      for (bool more = h->oldgnu_header.isextended; more;
+	   more = ext.sparse_header.isextended)
+	if (read_block (it, &ext) != pax_io_success
+	    || !sparse_decode (it, ss, &ext, ext.sparse_header.sp,
+			       SPARSES_IN_SPARSE_HEADER))
+	  return false;
+    }
+  return true;
+}
+
+
+
+/* Extended headers */
+
+/* Decode the decimal number of LEN bytes at P into *RET.  */
+static bool
+decode_decimal (char const *p, idx_t len, intmax_t *ret)
+{
+  bool neg = len > 0 && *p == '-';
+  intmax_t v = 0;
+
+  if (neg)
+    p++, len--;
+  if (len == 0)
+    return false;
+  for (; len > 0; p++, len--)
+    if (!('0' <= *p && *p <= '9')
+	|| ckd_mul (&v, v, 10) || ckd_add (&v, v, neg ? '0' - *p : *p - '0'))
+      return false;
+  *ret = v;
+  return true;
+}
+
+/* Decode the time stamp of LEN bytes at P, with an optional fraction
+   of a second, into *SEC and *NSEC.  */
+static bool
+decode_time (char const *p, idx_t len, time_t *sec, unsigned long *nsec)
+{
+  char const *dot = memchr (p, '.', len);
+  idx_t ilen = dot ? dot - p : len;
+  intmax_t s;
+  long ns = 0;
+  int digits = 0;
+
+  if (!decode_decimal (p, ilen, &s))
+    {
+      /* "-.5" has no integer part.  */
+      if (!(ilen == 1 && *p == '-'))
+	return false;
+      s = 0;
+    }
+  if (dot)
+    for (char const *q = dot + 1; q < p + len; q++)
+      {
+	if (!('0' <= *q && *q <= '9'))
+	  return false;
+	if (digits < 9)
+	  {
+	    ns = ns * 10 + *q - '0';
+	    digits++;
+	  }
+      }
+  for (; digits < 9; digits++)
+    ns *= 10;
+  if (*p == '-' && ns)
+    {
+      /* Keep the fraction positive.  */
+      s--;
+      ns = 1000000000 - ns;
+    }
+  *sec = s;
+  *nsec = ns;
+  return s == *sec;
+}
+
+/* Decode the GNU sparse map in format 0.1: a comma-separated list of
+   offsets and sizes.  */
+static bool
+sparse_map_decode (tar_iterator_t it, struct sparse_state *ss,
+		   char const *p, idx_t len)
+{
+  char const *end = p + len;
+
+  while (p < end)
+    {
+      char const *comma = memchr (p, ',', end - p);
+      char const *q;
+      intmax_t offset, numbytes;
+
+      if (!comma || !decode_decimal (p, comma - p, &offset))
+	return false;
+      p = comma + 1;
+      q = memchr (p, ',', end - p);
+      if (!q)
+	q = end;
+      if (!decode_decimal (p, q - p, &numbytes) || offset < 0 || numbytes < 0)
+	return false;
+      sparse_add (it, ss, offset, numbytes);
+      p = q + (q < end);
+    }
+  return true;
+}
+
+/* Apply the keyword KW, of KWLEN bytes, with value V, of VLEN bytes,
+   to IT->st.  Unknown keywords are ignored.  */
+static bool
+apply_keyword (tar_iterator_t it, struct sparse_state *ss,
+	       char const *kw, idx_t kwlen, char const *v, idx_t vlen)
+{
+  struct tar_stat_info *st = &it->st;
+  intmax_t n;
+
+#define KEYWORD(s) (kwlen == sizeof (s) - 1 && memcmp (kw, s, kwlen) == 0)
+#define STRING() (obstack_grow0 (&it->arena, v, vlen), \
+		  (char *) obstack_finish (&it->arena))
+
+  if (KEYWORD ("path"))
+    st->orig_file_name = STRING ();
+  else if (KEYWORD ("linkpath"))
+    st->link_name = STRING ();
+  else if (KEYWORD ("uname"))
+    st->uname = STRING ();
+  else if (KEYWORD ("gname"))
+    st->gname = STRING ();
+  else if (KEYWORD ("uid"))
+    {
+      if (!decode_decimal (v, vlen, &n))
+	return false;
+      st->stat.st_uid = n;
+    }
+  else if (KEYWORD ("gid"))
+    {
+      if (!decode_decimal (v, vlen, &n))
+	return false;
+      st->stat.st_gid = n;
+    }
+  else if (KEYWORD ("size"))
+    {
+      if (!decode_decimal (v, vlen, &n) || n < 0)
+	return false;
+      st->archive_file_size = n;
+      if (!st->is_sparse)
+	st->stat.st_size = n;
+    }
+  else if (KEYWORD ("mtime"))
+    return decode_time (v, vlen, &st->stat.st_mtime, &st->mtime_nsec);
+  else if (KEYWORD ("atime"))
+    return decode_time (v, vlen, &st->stat.st_atime, &st->atime_nsec);
+  else if (KEYWORD ("ctime"))
+    return decode_time (v, vlen, &st->stat.st_ctime, &st->ctime_nsec);
+  else if (kwlen > 11 && memcmp (kw, "GNU.sparse.", 11) == 0)
+    {
+      kw += 11;
+      kwlen -= 11;
+      st->is_sparse = true;
+      if (KEYWORD ("name"))
+	st->orig_file_name = STRING ();
+      else if (KEYWORD ("map"))
+	return sparse_map_decode (it, ss, v, vlen);
+      else if (KEYWORD ("numblocks"))
+	;
+      else if (!decode_decimal (v, vlen, &n) || n < 0)
+	return false;
+      else if (KEYWORD ("size") || KEYWORD ("realsize"))
+	st->stat.st_size = n;
+      else if (KEYWORD ("major"))
+	ss->major = n;
+      else if (KEYWORD ("minor"))
+	ss->minor = n;
+      else if (KEYWORD ("offset"))
+	{
+	  ss->offset = n;
+	  ss->have_offset = true;
+	}
+      else if (KEYWORD ("numbytes"))
+	{
+	  if (!ss->have_offset)
+	    return false;
+	  sparse_add (it, ss, ss->offset, n);
+	  ss->have_offset = false;
+	}
+    }
+  return true;
+
+#undef KEYWORD
+#undef STRING
+}
+
+/* Apply the SIZE bytes of extended header records at P to IT->st.  */
+static bool
+apply_xhdr (tar_iterator_t it, struct sparse_state *ss,
+	    char const *p, idx_t size)
+{
+  char const *end = p + size;
+
+  while (p < end)
+    {
+      char const *sp = memchr (p, ' ', end - p);
+      char const *eq;
+      intmax_t len;
+
+      /* Each record is "LEN KEYWORD=VALUE\n", LEN counting the whole
+	 record.  */
+      if (!sp || !decode_decimal (p, sp - p, &len)
+	  || len <= sp - p + 1 || len > end - p || p[len - 1] != '\n')
+	return false;
+      eq = memchr (sp + 1, '=', p + len - 1 - (sp + 1));
+      if (!eq
+	  || !apply_keyword (it, ss, sp + 1, eq - (sp + 1),
+			     eq + 1, p + len - 1 - (eq + 1)))
+	return false;
+      p += len;
+    }
+  return true;
+}
+
+/* Read the sparse map stored at the beginning of the member data in
+   format 1.0: decimal numbers, one per line, giving the number of
+   entries and then their offsets and sizes, padded to a block.  */
+static bool
+sparse_read_map (tar_iterator_t it, struct sparse_state *ss)
+{
+  union block block;
+  idx_t pos = BLOCKSIZE;
+  off_t consumed = 0;
+  intmax_t count = -1, offset = 0;
+  idx_t nvalues = 0;
+
+  while (count < 0 || nvalues < 2 * count)
+    {
+      char digits[INT_BUFSIZE_BOUND (intmax_t)];
+      idx_t len = 0;
+      intmax_t v;
+
+      for (;;)
+	{
+	  if (pos == BLOCKSIZE)
+	    {
+	      if (read_block (it, &block) != pax_io_success)
+		return false;
+	      consumed += BLOCKSIZE;
+	      pos = 0;
+	    }
+	  char c = block.buffer[pos++];
+	  if (c == '\n')
+	    break;
+	  if (len == sizeof digits)
+	    return false;
+	  digits[len++] = c;
+	}
+      if (!decode_decimal (digits, len, &v) || v < 0)
+	return false;
+      if (count < 0)
+	count = v;
+      else if (nvalues++ % 2 == 0)
+	offset = v;
+      else
+	sparse_add (it, ss, offset, v);
+    }
+  if (consumed > it->st.archive_file_size)
+    return false;
+  it->st.archive_file_size -= consumed;
+  return true;
+}
+
+
+
+/* Iteration */
+
+/* Create an iterator over the member headers of the archive read from
+   BUF, and store it in *RET.  With TAR_ITER_SEEK in FLAGS, member data
+   is skipped by seeking, which BUF must then support.  Return 0 on
+   success and an error code otherwise.  */
+int
+tar_iterator_create (tar_iterator_t *ret, paxbuf_t buf, int flags)
+{
+  tar_iterator_t it;
+
+  if (flags & ~TAR_ITER_SEEK)
+    return EINVAL;
+  it = xzalloc (sizeof *it);
+  it->buf = buf;
+  it->flags = flags;
+  obstack_specify_allocation (&it->arena, ARENA_CHUNK_SIZE, 0,
+			      xmalloc, free);
+  it->arena_base = obstack_alloc (&it->arena, 0);
+  obstack_specify_allocation (&it->sparse, ARENA_CHUNK_SIZE, 0,
+			      xmalloc, free);
+  it->sparse_base = obstack_alloc (&it->sparse, 0);
+  *ret = it;
+  return 0;
+}
+
+void
+tar_iterator_destroy (tar_iterator_t *pit)
+{
+  tar_iterator_t it = *pit;
+
+  if (it)
+    {
+      obstack_free (&it->arena, nullptr);
+      obstack_free (&it->sparse, nullptr);
+      free (it->global);
+      free (it);
+      *pit = nullptr;
+    }
+}
+
+/* Fill IT->st for the member whose header is in IT->header, given the
+   extended attributes XA read before it.  */
+static bool
+decode_member (tar_iterator_t it, struct xattrs const *xa)
+{
+  struct tar_stat_info *st = &it->st;
+  struct sparse_state ss = { 0 };
+
+  memset (st, 0, sizeof *st);
+  if (!decode_header (it, &ss))
+    return false;
+  if (xa->long_name)
+    st->orig_file_name = xa->long_name;
+  if (xa->long_link)
+    st->link_name = xa->long_link;
+  if (it->global && !apply_xhdr (it, &ss, it->global, it->global_size))
+    return false;
+  if (xa->xhdr && !apply_xhdr (it, &ss, xa->xhdr, xa->xhdr_size))
+    return false;
+  if (st->is_sparse && ss.major == 1 && !sparse_read_map (it, &ss))
+    return false;
+
+  if (ss.count)
+    {
+      st->sparse_map_size = ss.count;
+      st->sparse_map_avail = ss.count;
+      st->sparse_map = obstack_finish (&it->sparse);
+    }
+
+  /* Normalize the name by removing trailing slashes.  */
+  st->file_name = st->orig_file_name;
+  idx_t len = strlen (st->file_name);
+  if (len > 1 && st->file_name[len - 1] == '/')
+    {
+      while (len > 1 && st->file_name[len - 1] == '/')
+	len--;
+      st->had_trailing_slash = 1;
+      obstack_grow0 (&it->arena, st->file_name, len);
+      st->file_name = obstack_finish (&it->arena);
+    }
+
+  it->data_left = has_data (it->header.header.typeflag)
+		  ? st->archive_file_size : 0;
+  it->pad_left = (BLOCKSIZE - it->data_left % BLOCKSIZE) % BLOCKSIZE;
+  return true;
+}
+
+/* Advance to the next member of the archive, skipping the data of the
+   current one not read yet, and store its description in *RET.  The
+   description and the strings it points to remain valid until the
+   next call.  Return pax_io_eof at the end of the archive.  */
+pax_io_status_t
+tar_iterator_next (tar_iterator_t it, struct tar_stat_info **ret)
+{
+  struct xattrs xa = { 0 };
+  pax_io_status_t status;
+
+  *ret = nullptr;
+  if (it->done)
+    return pax_io_eof;
+  status = skip_data (it, it->data_left + it->pad_left);
+  it->data_left = it->pad_left = 0;
+  if (status != pax_io_success)
+    return status;
+
+  obstack_free (&it->arena, it->arena_base);
+  it->arena_base = obstack_alloc (&it->arena, 0);
+  obstack_free (&it->sparse, it->sparse_base);
+  it->sparse_base = obstack_alloc (&it->sparse, 0);
+
+  it->header_offset = paxbuf_tell (it->buf);
+  for (;;)
+    {
+      intmax_t size;
+
+      status = read_block (it, &it->header);
+      if (status == pax_io_eof)
+	{
+	  it->done = true;
+	  return status;
+	}
+      if (status != pax_io_success)
+	return status;
+
+      if (zero_block (&it->header))
+	{
+	  /* The archive ends with two zero blocks.  A lone one is
+	     skipped.  */
+	  status = read_block (it, &it->header);
+	  if (status == pax_io_eof
+	      || (status == pax_io_success && zero_block (&it->header)))
+	    {
+	      it->done = true;
+	      return pax_io_eof;
+	    }
+	  if (status != pax_io_success)
+	    return status;
+	  /* Unless headers of the member precede it, the member starts
+	     after the zero block.  */
+	  if (it->header_offset == paxbuf_tell (it->buf) - 2 * BLOCKSIZE)
+	    it->header_offset = paxbuf_tell (it->buf) - BLOCKSIZE;
+	}
+
+      if (!checksum_ok (&it->header)
+	  || !DECODE (&it->header, it->header.header.size, &size))
+	{
+	  errno = EILSEQ;
+	  return pax_io_failure;
+	}
+
+      switch (it->header.header.typeflag)
+	{
+	case GNUTYPE_LONGNAME:
+	  if (!(xa.long_name = read_string (it, size)))
+	    return pax_io_failure;
+	  continue;
+
+	case GNUTYPE_LONGLINK:
+	  if (!(xa.long_link = read_string (it, size)))
+	    return pax_io_failure;
+	  continue;
+
+	case XHDTYPE:
+	  if (!(xa.xhdr = read_string (it, size)))
+	    return pax_io_failure;
+	  xa.xhdr_size = size;
+	  continue;
+
+	case XGLTYPE:
+	  if (strncmp (it->header.header.name, PAXINDEX_NAME,
+		       sizeof it->header.header.name) == 0)
+	    {
+	      /* An embedded index, which may be larger than XHDR_MAX,
+		 is not a member of its own.  */
+	      if (skip_data (it, (size
+				  + (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE)))
+		return pax_io_failure;
+	      xa = (struct xattrs) { 0 };
+	      it->header_offset = paxbuf_tell (it->buf);
+	      continue;
+	    }
+	  {
+	    /* Global headers apply to all the following members, so they
+	       are kept outside the arena.  */
+	    char *p = read_string (it, size);
+	    if (!p)
+	      return pax_io_failure;
+	    free (it->global);
+	    it->global = xmemdup (p, size + 1);
+	    it->global_size = size;
+	  }
+	  continue;
+
+	}
+      break;
+    }
+
+  if (!decode_member (it, &xa))
+    {
+      errno = EILSEQ;
+      return pax_io_failure;
+    }
+  *ret = &it->st;
+  return pax_io_success;
+}
+
+/* Read up to SIZE bytes of the data of the current member into DATA.
+   Store the number of bytes read in *RSIZE.  Return pax_io_eof at the
+   end of the member data.  */
+pax_io_status_t
+tar_iterator_read (tar_iterator_t it, char *data, idx_t size, idx_t *rsize)
+{
+  pax_io_status_t status;
+  idx_t n;
+
+  *rsize = 0;
+  if (it->data_left == 0)
+    return pax_io_eof;
+  if (size > it->data_left)
+    size = it->data_left;
+  status = paxbuf_read (it->buf, data, size, &n);
+  it->data_left -= n;
+  *rsize = n;
+  if (n < size && status != pax_io_failure)
+    {
+      errno = EILSEQ;
+      return pax_io_failure;
+    }
+  return status;
+}
+
+/* Position the iterator at OFFSET, which must be that of the first
+   header block of a member, for example as found in an index.  Return
+   0 on success and -1 on error.  */
+int
+tar_iterator_seek (tar_iterator_t it, off_t offset)
+{
+  off_t off = paxbuf_seek (it->buf, offset);
+
+  if (off < 0)
+    return -1;
+  it->data_left = it->pad_left = 0;
+  it->done = off < offset;
+  return 0;
+}
+
+/* Return true if BLOCK looks like a member header: its checksum is
+   correct and it has the magic of ustar or old GNU headers, which star
+   headers share.  */
+static bool
+header_plausible (union block const *block)
+{
+  return ((memcmp (block->header.magic, TMAGIC, TMAGLEN) == 0
+	   || memcmp (block->header.magic, OLDGNU_MAGIC,
+		      sizeof OLDGNU_MAGIC - 1) == 0)
+	  && checksum_ok (block));
+}
+
+/* Position the iterator at the first block from OFFSET, which must be
+   a multiple of BLOCKSIZE, up to LIMIT that looks like a member
+   header.  Return its offset, or -1 on error or if there is none, with
+   errno set to ENOENT.  Blocks of member data may look like headers as
+   well, so the caller must check that the members found follow from
+   those before OFFSET.  The global extended header read so far is
+   forgotten, as whether it applies at OFFSET is unknown.  */
+off_t
+tar_iterator_sync (tar_iterator_t it, off_t offset, off_t limit)
+{
+  union block block;
+
+  free (it->global);
+  it->global = nullptr;
+  it->global_size = 0;
+  if (tar_iterator_seek (it, offset))
+    return -1;
+  for (; offset < limit; offset += BLOCKSIZE)
+    {
+      pax_io_status_t status = read_block (it, &block);
+
+      if (status == pax_io_eof)
+	break;
+      if (status != pax_io_success)
+	return -1;
+      if (header_plausible (&block))
+	return tar_iterator_seek (it, offset) ? -1 : offset;
+    }
+  errno = ENOENT;
+  return -1;
+}
+
+/* Return the header block of the current member.  */
+union block const *
+tar_iterator_header (tar_iterator_t it)
+{
+  return &it->header;
+}
+
+/* Return the offset in the archive of the first header block of the
+   current member, extended headers included.  */
+off_t
+tar_iterator_offset (tar_iterator_t it)
+{
+  return it->header_offset;
+}
+
+/* Return true if a global extended header has been read, which applies
+   to the current member and all the following ones.  */
+bool
+tar_iterator_has_global (tar_iterator_t it)
+{
+  return it->global != nullptr;
+}
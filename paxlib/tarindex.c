@@ -0,0 +1,687 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Member index.  An index maps the names of the members of an archive
+   to the offsets of their headers, so that a member can be extracted
+   by seeking to it, which works with local archives as well as remote
+   ones, where rmt_lseek is used.  The index is kept in a file of its
+   own, which is mapped into memory and searched in place, or embedded
+   in the archive as its last member.
+
+   The file is laid out as follows; numbers are little-endian:
+
+     0  Magic, "PXTINDEX"
+     8  Number of entries (64 bits)
+    16  Size of the string table (64 bits)
+    24  Reserved, zero (64 bits)
+    32  Entries, sorted by name, members with the same name being in
+	archive order
+     .  String table, holding the names, each terminated by a NUL
+
+   Each entry takes ENTRY_SIZE bytes:
+
+     0  Offset of the first header block of the member (64 bits)
+     8  Size of the member data in the archive (64 bits)
+    16  Offset of the name in the string table (32 bits)
+    20  Type flag of the member
+    21  Reserved, zero
+
+   An embedded index is stored as a POSIX global extended header named
+   PAXINDEX_NAME, written just before the end of archive blocks.  It
+   holds two records: INDEX_KEYWORD, whose value is the index encoded
+   in base64, followed by OFFSET_KEYWORD, the offset of the header in
+   decimal.  Readers find the latter at the end of the last block of
+   the archive that is not zero, which needs no change to the tar
+   format.  POSIX requires other readers to ignore keywords they do not
+   know, so they neither list nor extract the index.  */
+
+#include <system.h>
+#include <paxbuf.h>
+#include <pax.h>
+#include <tar.h>
+#include <tarnum.h>
+#include <base64.h>
+#include <c-ctype.h>
+#include <sys/mman.h>
+
+#define INDEX_MAGIC "PXTINDEX"
+#define INDEX_KEYWORD "PAXUTILS.index"
+#define OFFSET_KEYWORD "PAXUTILS.index.offset"
+
+enum
+  {
+    HEADER_SIZE = 32,
+    ENTRY_SIZE = 24
+  };
+
+/* Largest string table, as name offsets take 32 bits.  */
+#define STRTAB_MAX 0xffffffff
+
+/* Number of zero bytes searched for the index at the end of an
+   archive, enough for the end of archive blocks padded to the largest
+   record size in use.  */
+enum { TAIL_SCAN_MAX = 4 * 1024 * 1024 };
+
+struct tar_index
+{
+  char const *data;           /* Index contents */
+  idx_t size;                 /* Their size */
+  bool mapped;                /* DATA is mapped from a file, rather than
+				 allocated */
+  idx_t count;                /* Number of entries */
+  unsigned char const *entries; /* First entry */
+  char const *strtab;         /* String table */
+  idx_t strtab_size;          /* Its size */
+};
+
+struct index_entry
+{
+  off_t offset;               /* Offset of the header */
+  off_t size;                 /* Size of the data */
+  idx_t name;                 /* Offset of the name in the string table */
+  idx_t seq;                  /* Number of the member in the archive */
+  char typeflag;              /* Type flag */
+  char const *key;            /* The name, while sorting */
+};
+
+struct tar_index_builder
+{
+  struct index_entry *ent;    /* Entries added so far */
+  idx_t count;                /* Their number */
+  idx_t alloc;                /* Number of entries allocated */
+  char *strtab;               /* String table */
+  idx_t strtab_size;          /* Its size */
+  idx_t strtab_alloc;         /* Bytes allocated for it */
+};
+
+static void
+put_le32 (unsigned char *p, uint_least32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint_least32_t
+get_le32 (unsigned char const *p)
+{
+  return p[0] | (p[1] << 8) | ((uint_least32_t) p[2] << 16)
+         | ((uint_least32_t) p[3] << 24);
+}
+
+static void
+put_le64 (unsigned char *p, uint_least64_t v)
+{
+  put_le32 (p, v);
+  put_le32 (p + 4, v >> 32);
+}
+
+static uint_least64_t
+get_le64 (unsigned char const *p)
+{
+  return get_le32 (p) | ((uint_least64_t) get_le32 (p + 4) << 32);
+}
+
+
+
+/* Building indexes */
+
+void
+tar_index_builder_create (tar_index_builder_t *ret)
+{
+  *ret = xzalloc (sizeof **ret);
+}
+
+void
+tar_index_builder_destroy (tar_index_builder_t *pb)
+{
+  tar_index_builder_t b = *pb;
+
+  if (b)
+    {
+      free (b->ent);
+      free (b->strtab);
+      free (b);
+      *pb = nullptr;
+    }
+}
+
+/* Add the member NAME, whose first header block is at OFFSET, with
+   SIZE bytes of data and type TYPEFLAG.  Members must be added in
+   archive order.  Return 0 on success and an error code otherwise.  */
+int
+tar_index_builder_add (tar_index_builder_t b, char const *name,
+		       off_t offset, off_t size, char typeflag)
+{
+  idx_t len = strlen (name) + 1;
+  struct index_entry *e;
+
+  if (b->strtab_size + len > STRTAB_MAX)
+    return EOVERFLOW;
+  if (b->strtab_alloc - b->strtab_size < len)
+    b->strtab = xpalloc (b->strtab, &b->strtab_alloc,
+			 len - (b->strtab_alloc - b->strtab_size), -1, 1);
+  if (b->count == b->alloc)
+    b->ent = xpalloc (b->ent, &b->alloc, 1, -1, sizeof b->ent[0]);
+
+  e = &b->ent[b->count];
+  e->offset = offset;
+  e->size = size;
+  e->name = b->strtab_size;
+  e->seq = b->count++;
+  e->typeflag = typeflag;
+  memcpy (b->strtab + b->strtab_size, name, len);
+  b->strtab_size += len;
+  return 0;
+}
+
+static int
+entry_cmp (void const *a, void const *b)
+{
+  struct index_entry const *x = a, *y = b;
+  int c = strcmp (x->key, y->key);
+  return c ? c : (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* Return the index built by B, allocated with malloc, and store its
+   size in *SIZE.  Return nullptr if it would be too large.  */
+static char *
+index_serialize (tar_index_builder_t b, idx_t *size)
+{
+  unsigned char *data, *ent;
+  idx_t n;
+
+  if (ckd_mul (&n, b->count, ENTRY_SIZE)
+      || ckd_add (&n, n, HEADER_SIZE + b->strtab_size))
+    return nullptr;
+
+  for (idx_t i = 0; i < b->count; i++)
+    b->ent[i].key = b->strtab + b->ent[i].name;
+  qsort (b->ent, b->count, sizeof b->ent[0], entry_cmp);
+
+  data = xicalloc (n, 1);
+  memcpy (data, INDEX_MAGIC, sizeof INDEX_MAGIC - 1);
+  put_le64 (data + 8, b->count);
+  put_le64 (data + 16, b->strtab_size);
+  ent = data + HEADER_SIZE;
+  for (idx_t i = 0; i < b->count; i++, ent += ENTRY_SIZE)
+    {
+      put_le64 (ent, b->ent[i].offset);
+      put_le64 (ent + 8, b->ent[i].size);
+      put_le32 (ent + 16, b->ent[i].name);
+      ent[20] = b->ent[i].typeflag;
+    }
+  memcpy (ent, b->strtab, b->strtab_size);
+  *size = n;
+  return (char *) data;
+}
+
+/* Write the index to the file descriptor FD.  Return 0 on success and
+   an error code otherwise.  */
+int
+tar_index_builder_write (tar_index_builder_t b, int fd)
+{
+  idx_t size;
+  char *data = index_serialize (b, &size);
+  int rc = 0;
+
+  if (!data)
+    return EOVERFLOW;
+  if (full_write (fd, data, size) < size)
+    rc = errno;
+  free (data);
+  return rc;
+}
+
+/* Add the member NAME, whose header is about to be written to BUF,
+   with SIZE bytes of data and type TYPEFLAG.  Called by archivers
+   before writing each member, extended headers included.  */
+int
+tar_index_builder_mark (tar_index_builder_t b, paxbuf_t buf,
+			char const *name, off_t size, char typeflag)
+{
+  return tar_index_builder_add (b, name, paxbuf_tell (buf), size, typeflag);
+}
+
+/* Store in BLOCK a ustar header for the member NAME of type TYPEFLAG
+   with SIZE bytes of data.  */
+static void
+make_header (union block *block, char const *name, off_t size,
+	     char typeflag)
+{
+  unsigned int sum = 0;
+
+  memset (block, 0, sizeof *block);
+  strcpy (block->header.name, name);
+  strcpy (block->header.mode, "0000644");
+  strcpy (block->header.uid, "0000000");
+  strcpy (block->header.gid, "0000000");
+  sprintf (block->header.size, "%011jo", (uintmax_t) size);
+  strcpy (block->header.mtime, "00000000000");
+  block->header.typeflag = typeflag;
+  memcpy (block->header.magic, TMAGIC, TMAGLEN);
+  memcpy (block->header.version, TVERSION, TVERSLEN);
+  memset (block->header.chksum, ' ', sizeof block->header.chksum);
+  for (int i = 0; i < BLOCKSIZE; i++)
+    sum += (unsigned char) block->buffer[i];
+  sprintf (block->header.chksum, "%06o", sum);
+}
+
+/* Return the length of an extended header record with a keyword of
+   KEYLEN bytes and a value of VALLEN bytes.  The length includes its
+   own decimal digits.  */
+static idx_t
+record_length (idx_t keylen, idx_t vallen)
+{
+  idx_t n = keylen + vallen + 3;    /* Space, equal sign and newline */
+  int digits = 1;
+
+  for (idx_t p = 10; n + digits >= p; p *= 10)
+    digits++;
+  return n + digits;
+}
+
+/* Write the index built by B to BUF as a global extended header.
+   Called by archivers after the last member, before the end of archive
+   blocks.  Return 0 on success and an error code otherwise.  */
+int
+tar_index_builder_finish (tar_index_builder_t b, paxbuf_t buf)
+{
+  union block block;
+  off_t offset = paxbuf_tell (buf);
+  char offstr[INT_BUFSIZE_BOUND (intmax_t)];
+  idx_t size, b64size, len1, len2, total, pad, n;
+  char *data, *b64, *p;
+  int rc = 0;
+
+  data = index_serialize (b, &size);
+  if (!data)
+    return EOVERFLOW;
+  b64size = base64_encode_alloc (data, size, &b64);
+  free (data);
+  if (!b64)
+    return b64size ? ENOMEM : EOVERFLOW;
+
+  len1 = record_length (sizeof INDEX_KEYWORD - 1, b64size);
+  len2 = record_length (sizeof OFFSET_KEYWORD - 1,
+			sprintf (offstr, "%jd", (intmax_t) offset));
+  /* Octal sizes in ustar headers take at most 11 digits.  */
+  if (ckd_add (&total, len1, len2) || total > 077777777777)
+    {
+      free (b64);
+      return EOVERFLOW;
+    }
+  pad = (BLOCKSIZE - total % BLOCKSIZE) % BLOCKSIZE;
+
+  data = xicalloc (total + pad, 1);
+  p = data + sprintf (data, "%jd " INDEX_KEYWORD "=", (intmax_t) len1);
+  memcpy (p, b64, b64size);
+  p += b64size;
+  *p++ = '\n';
+  sprintf (p, "%jd " OFFSET_KEYWORD "=%s\n", (intmax_t) len2, offstr);
+  free (b64);
+
+  make_header (&block, PAXINDEX_NAME, total, XGLTYPE);
+  if (paxbuf_write (buf, block.buffer, BLOCKSIZE, &n) != pax_io_success
+      || paxbuf_write (buf, data, total + pad, &n) != pax_io_success)
+    rc = errno;
+  free (data);
+  return rc;
+}
+
+/* Scan the archive read from BUF, which must be open, and write the
+   index of its members to FILE.  FLAGS are passed to
+   tar_iterator_create.  Return 0 on success and an error code
+   otherwise.  */
+int
+tar_index_build (paxbuf_t buf, int flags, char const *file)
+{
+  tar_iterator_t it;
+  tar_index_builder_t b;
+  struct tar_stat_info *st;
+  pax_io_status_t status;
+  int rc, fd;
+
+  rc = tar_iterator_create (&it, buf, flags);
+  if (rc)
+    return rc;
+  tar_index_builder_create (&b);
+  while ((status = tar_iterator_next (it, &st)) == pax_io_success)
+    {
+      rc = tar_index_builder_add (b, st->file_name, tar_iterator_offset (it),
+				  st->archive_file_size,
+				  tar_iterator_header (it)->header.typeflag);
+      if (rc)
+	break;
+    }
+  if (status == pax_io_failure)
+    rc = errno;
+  tar_iterator_destroy (&it);
+
+  if (rc == 0)
+    {
+      fd = open (file, O_WRONLY | O_CREAT | O_TRUNC, MODE_RW);
+      if (fd == -1)
+	rc = errno;
+      else
+	{
+	  rc = tar_index_builder_write (b, fd);
+	  if (close (fd) && rc == 0)
+	    rc = errno;
+	}
+    }
+  tar_index_builder_destroy (&b);
+  return rc;
+}
+
+
+
+/* Looking up members */
+
+/* Check the SIZE bytes of index at DATA and set up IDX to use them.  */
+static int
+index_init (tar_index_t idx, char const *data, idx_t size)
+{
+  unsigned char const *p = (unsigned char const *) data;
+  uint_least64_t count, strtab_size;
+
+  if (size < HEADER_SIZE || memcmp (p, INDEX_MAGIC, sizeof INDEX_MAGIC - 1))
+    return EILSEQ;
+  count = get_le64 (p + 8);
+  strtab_size = get_le64 (p + 16);
+  if (count > (size - HEADER_SIZE) / ENTRY_SIZE
+      || strtab_size != size - HEADER_SIZE - count * ENTRY_SIZE
+      || (strtab_size > 0 && data[size - 1] != 0))
+    return EILSEQ;
+
+  idx->data = data;
+  idx->size = size;
+  idx->count = count;
+  idx->entries = p + HEADER_SIZE;
+  idx->strtab = data + HEADER_SIZE + count * ENTRY_SIZE;
+  idx->strtab_size = strtab_size;
+  return 0;
+}
+
+/* Find the value of KEYWORD in the SIZE bytes of extended header
+   records at XHDR, and store its length in *VALLEN.  Return nullptr if
+   it is not there or the records are malformed.  */
+static char const *
+record_find (char const *xhdr, idx_t size, char const *keyword,
+	     idx_t *vallen)
+{
+  char const *end = xhdr + size;
+  idx_t keylen = strlen (keyword);
+
+  while (xhdr < end)
+    {
+      char const *p = xhdr;
+      idx_t len = 0;
+
+      for (; p < end && c_isdigit (*p); p++)
+	if (ckd_mul (&len, len, 10) || ckd_add (&len, len, *p - '0'))
+	  return nullptr;
+      if (p == xhdr || p == end || *p != ' '
+	  || len <= p - xhdr + 1 || len > end - xhdr
+	  || xhdr[len - 1] != '\n')
+	return nullptr;
+      p++;
+      if (xhdr + len - p > keylen && memcmp (p, keyword, keylen) == 0
+	  && p[keylen] == '=')
+	{
+	  p += keylen + 1;
+	  *vallen = xhdr + len - 1 - p;
+	  return p;
+	}
+      xhdr += len;
+    }
+  return nullptr;
+}
+
+/* Return the offset of the header of the embedded index, as recorded
+   at the end of the SIZE bytes at TAIL, not counting trailing zeros,
+   or -1 if there is none.  */
+static off_t
+index_offset (char const *tail, idx_t size)
+{
+  static char const key[] = " " OFFSET_KEYWORD "=";
+  char const *end = tail + size;
+  intmax_t offset = 0;
+
+  while (end > tail && !end[-1])
+    end--;
+  if (end == tail || end[-1] != '\n')
+    return -1;
+  for (char const *p = end - 1; p - tail >= sizeof key - 1; p--)
+    if (memcmp (p - (sizeof key - 1), key, sizeof key - 1) == 0)
+      {
+	if (p == end - 1)
+	  return -1;
+	for (; p < end - 1; p++)
+	  if (!c_isdigit (*p)
+	      || ckd_mul (&offset, offset, 10)
+	      || ckd_add (&offset, offset, *p - '0'))
+	    return -1;
+	return offset;
+      }
+  return -1;
+}
+
+/* Load the index embedded in the archive read from BUF, which is SIZE
+   bytes long, and store a handle to it in *RET.  The position of BUF
+   is changed.  Return 0 on success, ENOENT if the archive has no
+   index, and another error code otherwise.  */
+int
+tar_index_load (tar_index_t *ret, paxbuf_t buf, off_t size)
+{
+  union block block;
+  char tailbuf[2 * BLOCKSIZE];
+  off_t pos = size - size % BLOCKSIZE;
+  off_t hdr_offset, tail;
+  intmax_t xsize;
+  tar_index_t idx;
+  char *xhdr, *data;
+  char const *value;
+  idx_t n, vallen, isize;
+  int rc;
+
+  /* Search backwards for the last block that is not zero.  */
+  for (;;)
+    {
+      if (pos == 0 || size - pos > TAIL_SCAN_MAX)
+	return ENOENT;
+      pos -= BLOCKSIZE;
+      if (paxbuf_seek (buf, pos) != pos
+	  || paxbuf_read (buf, block.buffer, BLOCKSIZE, &n) == pax_io_failure)
+	return errno;
+      if (n < BLOCKSIZE)
+	return EILSEQ;
+      if (!tar_zero_block (&block))
+	break;
+    }
+
+  /* The offset record may begin in the block before.  */
+  tail = pos > 0 ? pos - BLOCKSIZE : pos;
+  if (paxbuf_seek (buf, tail) != tail
+      || paxbuf_read (buf, tailbuf, pos + BLOCKSIZE - tail, &n)
+	 == pax_io_failure)
+    return errno;
+  hdr_offset = index_offset (tailbuf, n);
+  if (hdr_offset < 0)
+    return ENOENT;
+  if (hdr_offset % BLOCKSIZE || hdr_offset >= pos)
+    return EILSEQ;
+
+  /* Check the header, whose data must end with the block found.  */
+  if (paxbuf_seek (buf, hdr_offset) != hdr_offset
+      || paxbuf_read (buf, block.buffer, BLOCKSIZE, &n) == pax_io_failure)
+    return errno;
+  if (n < BLOCKSIZE || block.header.typeflag != XGLTYPE
+      || strncmp (block.header.name, PAXINDEX_NAME, sizeof block.header.name)
+      || !tar_decode_number (block.header.size, sizeof block.header.size,
+			     &xsize)
+      || xsize <= pos - hdr_offset - BLOCKSIZE || xsize > pos - hdr_offset)
+    return EILSEQ;
+
+  xhdr = ximalloc (xsize);
+  if (paxbuf_read (buf, xhdr, xsize, &n) == pax_io_failure)
+    {
+      rc = errno;
+      free (xhdr);
+      return rc;
+    }
+  value = n < xsize ? nullptr : record_find (xhdr, xsize, INDEX_KEYWORD,
+					      &vallen);
+  if (!value || !base64_decode_alloc (value, vallen, &data, &isize))
+    {
+      free (xhdr);
+      return EILSEQ;
+    }
+  free (xhdr);
+  if (!data)
+    xalloc_die ();
+
+  idx = xzalloc (sizeof *idx);
+  rc = index_init (idx, data, isize);
+  if (rc)
+    {
+      free (data);
+      free (idx);
+      return rc;
+    }
+  *ret = idx;
+  return 0;
+}
+
+/* Open the index FILE and store a handle to it in *RET.  Return 0 on
+   success and an error code otherwise.  */
+int
+tar_index_open (tar_index_t *ret, char const *file)
+{
+  struct stat st;
+  tar_index_t idx;
+  void *map;
+  int fd, rc;
+
+  fd = open (file, O_RDONLY);
+  if (fd == -1)
+    return errno;
+  if (fstat (fd, &st))
+    {
+      rc = errno;
+      close (fd);
+      return rc;
+    }
+  if (!S_ISREG (st.st_mode) || st.st_size < HEADER_SIZE
+      || st.st_size > IDX_MAX)
+    {
+      close (fd);
+      return EILSEQ;
+    }
+  map = mmap (nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  rc = errno;
+  close (fd);
+  if (map == MAP_FAILED)
+    return rc;
+
+  idx = xzalloc (sizeof *idx);
+  idx->mapped = true;
+  rc = index_init (idx, map, st.st_size);
+  if (rc)
+    {
+      munmap (map, st.st_size);
+      free (idx);
+      return rc;
+    }
+  *ret = idx;
+  return 0;
+}
+
+void
+tar_index_close (tar_index_t *pidx)
+{
+  tar_index_t idx = *pidx;
+
+  if (idx)
+    {
+      if (idx->mapped)
+	munmap ((void *) idx->data, idx->size);
+      else
+	free ((void *) idx->data);
+      free (idx);
+      *pidx = nullptr;
+    }
+}
+
+/* Return the number of entries in IDX.  */
+idx_t
+tar_index_count (tar_index_t idx)
+{
+  return idx->count;
+}
+
+/* Return the name of entry I, or nullptr if the index is corrupted.  */
+static char const *
+entry_name (tar_index_t idx, idx_t i)
+{
+  uint_least32_t off = get_le32 (idx->entries + i * ENTRY_SIZE + 16);
+  return off < idx->strtab_size ? idx->strtab + off : nullptr;
+}
+
+/* Fill ENT with entry I of IDX, in name order.  Return false if I is
+   out of range or the entry is corrupted.  */
+bool
+tar_index_get (tar_index_t idx, idx_t i, struct tar_index_entry *ent)
+{
+  unsigned char const *p;
+
+  if (i < 0 || i >= idx->count || !(ent->name = entry_name (idx, i)))
+    return false;
+  p = idx->entries + i * ENTRY_SIZE;
+  ent->offset = get_le64 (p);
+  ent->size = get_le64 (p + 8);
+  ent->typeflag = p[20];
+  return ent->offset >= 0 && ent->size >= 0;
+}
+
+/* Look up the member NAME in IDX and fill ENT with its entry.  If the
+   archive holds several members by that name, the last one is
+   returned, as it supersedes the others.  Return false if there is
+   none.  */
+bool
+tar_index_lookup (tar_index_t idx, char const *name,
+		  struct tar_index_entry *ent)
+{
+  idx_t lo = 0, hi = idx->count;
+
+  /* Find the first entry whose name is greater than NAME.  */
+  while (lo < hi)
+    {
+      idx_t mid = lo + (hi - lo) / 2;
+      char const *s = entry_name (idx, mid);
+
+      if (!s)
+	return false;
+      if (strcmp (s, name) <= 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return (lo > 0 && tar_index_get (idx, lo - 1, ent)
+	  && strcmp (ent->name, name) == 0);
+}
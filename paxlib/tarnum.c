@@ -0,0 +1,200 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Numeric fields are octal, padded with leading spaces or zeros and
+   terminated by a space or NUL, or in the GNU base-256 extension.
+   Header decoding is the inner loop when scanning archives of small
+   files, so on x86-64 the octal fields, the checksum and the test for
+   the zero blocks ending the archive have SSE2 versions, which the
+   architecture guarantees.  */
+
+#include <system.h>
+#include <tar.h>
+#include <tarnum.h>
+#if TARHDR_SSE2
+# include <emmintrin.h>
+#endif
+
+/* Decode the octal field of LEN bytes at P into *RET.  */
+static bool
+decode_octal (char const *p, idx_t len, intmax_t *ret)
+{
+  unsigned char const *s = (unsigned char const *) p;
+  unsigned char const *end = s + len;
+  intmax_t v = 0;
+
+  while (s < end && *s == ' ')
+    s++;
+  for (; s < end && '0' <= *s && *s <= '7'; s++)
+    if (ckd_mul (&v, v, 8) || ckd_add (&v, v, *s - '0'))
+      return false;
+  if (s < end && *s != ' ' && *s != 0)
+    return false;
+  *ret = v;
+  return true;
+}
+
+/* Decode the base-256 field of LEN bytes at P into *RET.  The value is
+   in two's complement, the top bit of the first byte being a marker
+   and the next one the sign.  */
+static bool
+decode_base256 (char const *p, idx_t len, intmax_t *ret)
+{
+  unsigned char const *s = (unsigned char const *) p;
+  unsigned char const *end = s + len;
+  intmax_t v = (*s & 0x3f) - (*s & 0x40);
+
+  while (++s < end)
+    if (ckd_mul (&v, v, 256) || ckd_add (&v, v, *s))
+      return false;
+  *ret = v;
+  return true;
+}
+
+#if TARHDR_SSE2
+/* Decode the octal field of LEN bytes at P, at most 16, into *RET.
+   16 bytes are read from P.  The digits are found by comparing all
+   bytes at once and then combined pairwise, each step doubling the
+   number of digits held by a lane.  */
+static bool
+decode_octal_sse2 (char const *p, idx_t len, intmax_t *ret)
+{
+  __m128i v = _mm_loadu_si128 ((__m128i const *) p);
+  __m128i d = _mm_sub_epi8 (v, _mm_set1_epi8 ('0'));
+  __m128i idx = _mm_setr_epi8 (0, 1, 2, 3, 4, 5, 6, 7,
+			       8, 9, 10, 11, 12, 13, 14, 15);
+  unsigned int lanes = (1u << len) - 1;
+  unsigned int digit = _mm_movemask_epi8
+    (_mm_cmpeq_epi8 (_mm_min_epu8 (d, _mm_set1_epi8 (7)), d)) & lanes;
+  unsigned int space = _mm_movemask_epi8
+    (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' '))) & lanes;
+  unsigned int nul = _mm_movemask_epi8
+    (_mm_cmpeq_epi8 (v, _mm_setzero_si128 ())) & lanes;
+  int start = __builtin_ctz (~space);
+  int end = start + __builtin_ctz (~(digit >> start));
+  uint_least64_t hi, lo;
+
+  if (end < len && !(((space | nul) >> end) & 1))
+    return false;
+
+  /* Clear all but the digits, and combine them: the lanes of X hold
+     the values of 2, 4 and then 8 consecutive digits.  */
+  d = _mm_and_si128 (d, _mm_and_si128
+		     (_mm_cmplt_epi8 (idx, _mm_set1_epi8 (end)),
+		      _mm_cmpgt_epi8 (idx, _mm_set1_epi8 (start - 1))));
+  __m128i x = _mm_or_si128 (_mm_slli_epi16
+			    (_mm_and_si128 (d, _mm_set1_epi16 (0xff)), 3),
+			    _mm_srli_epi16 (d, 8));
+  x = _mm_or_si128 (_mm_slli_epi32
+		    (_mm_and_si128 (x, _mm_set1_epi32 (0xffff)), 6),
+		    _mm_srli_epi32 (x, 16));
+  x = _mm_or_si128 (_mm_slli_epi64
+		    (_mm_and_si128 (x, _mm_set1_epi64x (0xffffffff)), 12),
+		    _mm_srli_epi64 (x, 32));
+  hi = _mm_cvtsi128_si64 (x);
+  lo = _mm_cvtsi128_si64 (_mm_unpackhi_epi64 (x, x));
+
+  /* The 16 lanes form a 48-bit number ending with 16 - END zero
+     digits.  */
+  *ret = ((hi << 24) | lo) >> (3 * (16 - end));
+  return true;
+}
+#endif
+
+/* Decode the numeric field of LEN bytes at P into *RET.  Return false
+   if it is malformed.  */
+bool
+tar_decode_number (char const *p, idx_t len, intmax_t *ret)
+{
+  if (*p & 0x80)
+    return decode_base256 (p, len, ret);
+  return decode_octal (p, len, ret);
+}
+
+#if TARHDR_SSE2
+/* Likewise, for fields of at most 16 bytes followed by enough of the
+   header for 16 bytes to be read from P.  */
+bool
+tar_decode_number_sse2 (char const *p, idx_t len, intmax_t *ret)
+{
+  if (*p & 0x80)
+    return decode_base256 (p, len, ret);
+  return decode_octal_sse2 (p, len, ret);
+}
+#endif
+
+/* Store in *USUM the sum of the bytes of BLOCK, and in *SSUM their sum
+   as signed chars.  */
+void
+tar_block_sums (union block const *block, intmax_t *usum, intmax_t *ssum)
+{
+  intmax_t us = 0, ss = 0;
+
+  for (int i = 0; i < BLOCKSIZE; i++)
+    {
+      us += (unsigned char) block->buffer[i];
+      ss += (signed char) block->buffer[i];
+    }
+  *usum = us;
+  *ssum = ss;
+}
+
+#if TARHDR_SSE2
+void
+tar_block_sums_sse2 (union block const *block, intmax_t *usum, intmax_t *ssum)
+{
+  __m128i zero = _mm_setzero_si128 ();
+  __m128i bias = _mm_set1_epi8 (0x80);
+  __m128i u = zero, s = zero;
+
+  /* A signed char C equals (C ^ 0x80) - 128 taken as unsigned.  */
+  for (int i = 0; i < BLOCKSIZE; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((__m128i const *) (block->buffer + i));
+      u = _mm_add_epi64 (u, _mm_sad_epu8 (v, zero));
+      s = _mm_add_epi64 (s, _mm_sad_epu8 (_mm_xor_si128 (v, bias), zero));
+    }
+  u = _mm_add_epi64 (u, _mm_unpackhi_epi64 (u, u));
+  s = _mm_add_epi64 (s, _mm_unpackhi_epi64 (s, s));
+  *usum = _mm_cvtsi128_si64 (u);
+  *ssum = _mm_cvtsi128_si64 (s) - 128 * BLOCKSIZE;
+}
+#endif
+
+/* Return true if BLOCK consists of zero bytes.  */
+bool
+tar_zero_block (union block const *block)
+{
+  for (int i = 0; i < BLOCKSIZE; i++)
+    if (block->buffer[i])
+      return false;
+  return true;
+}
+
+#if TARHDR_SSE2
+bool
+tar_zero_block_sse2 (union block const *block)
+{
+  __m128i acc = _mm_setzero_si128 ();
+
+  for (int i = 0; i < BLOCKSIZE; i += 16)
+    acc = _mm_or_si128 (acc, _mm_loadu_si128 ((__m128i const *)
+					      (block->buffer + i)));
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (acc, _mm_setzero_si128 ()))
+	 == 0xffff;
+}
+#endif
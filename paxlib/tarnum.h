@@ -0,0 +1,38 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Numeric fields, checksums and zero blocks of tar headers.  Each
+   operation has a portable version and, where TARHDR_SSE2 is defined,
+   an SSE2 one giving the same results.  The header iterator selects
+   the versions to use; paxtest/hdrcheck tests them against each
+   other.  */
+
+#if defined __x86_64__ && defined __GNUC__
+# define TARHDR_SSE2 1
+#endif
+
+bool tar_decode_number (char const *p, idx_t len, intmax_t *ret);
+void tar_block_sums (union block const *block,
+		     intmax_t *usum, intmax_t *ssum);
+bool tar_zero_block (union block const *block);
+
+#if TARHDR_SSE2
+bool tar_decode_number_sse2 (char const *p, idx_t len, intmax_t *ret);
+void tar_block_sums_sse2 (union block const *block,
+			  intmax_t *usum, intmax_t *ssum);
+bool tar_zero_block_sse2 (union block const *block);
+#endif
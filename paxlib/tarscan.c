@@ -0,0 +1,387 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Parallel listing of local archives.  The archive is processed in
+   windows of SCAN_CHUNK bytes per thread.  Each worker reads one chunk
+   of the window through a paxbuf of its own: it synchronizes on the
+   first block of the chunk that looks like a header, then walks the
+   members from there, seeking over their data, and records those
+   whose headers start within the chunk.
+
+   Blocks of member data may look like headers, so the results are
+   validated as they are stitched together, in archive order.  The
+   members of a chunk are accepted from the one whose header follows
+   the last member accepted before them.  If there is none, the chunk
+   is walked again serially from that member, until the walk reaches
+   a member the worker found.  Archives without ustar magic, such as
+   v7 ones, are thus listed correctly, if not any faster.
+
+   A pax global extended header applies to all the members after it,
+   whereas workers only see those within their chunk.  Members a worker
+   read after one are therefore never accepted, and once the serial
+   walk has read one, the rest of the archive is walked serially.  */
+
+#include <system.h>
+#include <pthread.h>
+#include <paxbuf.h>
+#include <pax.h>
+#include <tar.h>
+#define obstack_chunk_alloc xmalloc
+#define obstack_chunk_free free
+#include <obstack.h>
+
+/* Bytes of the archive scanned by each worker at a time */
+enum { SCAN_CHUNK = 64 * 1024 * 1024 };
+
+/* A member found by a worker */
+struct scan_member
+{
+  off_t offset;               /* Offset of its first header block */
+  char typeflag;              /* Type flag */
+  struct tar_stat_info st;    /* Its description, strings included */
+};
+
+struct scan_worker
+{
+  pthread_t thread;
+  paxbuf_t buf;               /* Archive */
+  tar_iterator_t it;          /* Iterator reading it */
+  off_t start;                /* Chunk being scanned */
+  off_t end;
+  struct obstack strings;     /* Strings of the members found */
+  void *strings_base;
+  struct obstack members;     /* Array of members found */
+  void *members_base;
+  struct scan_member *mem;    /* Members found, in archive order */
+  idx_t count;                /* Their number */
+  idx_t global;               /* Index of the first member read after a
+				 global extended header, or COUNT */
+  off_t stop;                 /* Offset of the first header at or after END,
+				 or -1 if none was read */
+  bool eof;                   /* The end of archive was reached */
+};
+
+struct tar_scan
+{
+  tar_scan_fp fn;             /* Function called for each member */
+  void *closure;              /* Its first argument */
+  paxbuf_t buf;               /* Archive, for serial walks */
+  tar_iterator_t it;          /* Iterator reading it */
+  int nworkers;
+  struct scan_worker *workers;
+};
+
+static char *
+save_string (struct obstack *ob, char const *s)
+{
+  return s ? obstack_copy0 (ob, s, strlen (s)) : nullptr;
+}
+
+/* Record the member at OFFSET described by ST.  */
+static void
+save_member (struct scan_worker *w, struct tar_stat_info const *st,
+	     off_t offset, char typeflag)
+{
+  struct scan_member m;
+
+  m.offset = offset;
+  m.typeflag = typeflag;
+  m.st = *st;
+  m.st.orig_file_name = save_string (&w->strings, st->orig_file_name);
+  m.st.file_name = (st->file_name == st->orig_file_name
+		    ? m.st.orig_file_name
+		    : save_string (&w->strings, st->file_name));
+  m.st.link_name = save_string (&w->strings, st->link_name);
+  m.st.uname = save_string (&w->strings, st->uname);
+  m.st.gname = save_string (&w->strings, st->gname);
+  if (st->sparse_map)
+    m.st.sparse_map = obstack_copy (&w->strings, st->sparse_map,
+				    (st->sparse_map_avail
+				     * sizeof st->sparse_map[0]));
+  obstack_grow (&w->members, &m, sizeof m);
+}
+
+static void *
+scan_worker (void *closure)
+{
+  struct scan_worker *w = closure;
+  struct tar_stat_info *st;
+  pax_io_status_t status = pax_io_failure;
+
+  w->stop = -1;
+  w->eof = false;
+  w->global = -1;
+  if (tar_iterator_sync (w->it, w->start, w->end) >= 0)
+    while ((status = tar_iterator_next (w->it, &st)) == pax_io_success)
+      {
+	off_t offset = tar_iterator_offset (w->it);
+
+	if (offset >= w->end)
+	  {
+	    w->stop = offset;
+	    break;
+	  }
+	if (w->global < 0 && tar_iterator_has_global (w->it))
+	  w->global = obstack_object_size (&w->members) / sizeof w->mem[0];
+	save_member (w, st, offset,
+		     tar_iterator_header (w->it)->header.typeflag);
+      }
+  w->eof = status == pax_io_eof;
+
+  w->count = obstack_object_size (&w->members) / sizeof w->mem[0];
+  w->mem = obstack_finish (&w->members);
+  /* Whatever was found before an error is not trusted either: the
+     serial walk will report the error if it is genuine.  */
+  if (status == pax_io_failure && w->stop == -1)
+    w->count = 0;
+  if (w->global < 0 || w->global > w->count)
+    w->global = w->count;
+  return nullptr;
+}
+
+/* Return the index of the member of W whose header is at OFFSET, or
+   -1 if there is none or if it cannot be accepted because of a global
+   extended header.  */
+static idx_t
+find_member (struct tar_scan const *scan, struct scan_worker const *w,
+	     off_t offset)
+{
+  idx_t lo = 0, hi = w->count;
+
+  while (lo < hi)
+    {
+      idx_t mid = lo + (hi - lo) / 2;
+
+      if (w->mem[mid].offset < offset)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return (lo < w->global && w->mem[lo].offset == offset
+	  && !tar_iterator_has_global (scan->it)
+	  ? lo : -1);
+}
+
+/* Walk the archive serially from the header at *POS, reporting the
+   members found, until reaching one that W has recorded and that can
+   be accepted, whose index is stored in *K, or a header past the chunk of W, in which case -1
+   is stored.  Update *POS to the offset of that header, and set *DONE
+   at the end of archive.  Return 0 on success, the value returned by
+   the callback if it is not zero, and an error code otherwise.  */
+static int
+scan_serial (struct tar_scan *scan, struct scan_worker const *w,
+	     off_t *pos, idx_t *k, bool *done)
+{
+  struct tar_stat_info *st;
+  pax_io_status_t status;
+
+  *k = -1;
+  if (tar_iterator_seek (scan->it, *pos))
+    return errno;
+  while ((status = tar_iterator_next (scan->it, &st)) == pax_io_success)
+    {
+      off_t offset = tar_iterator_offset (scan->it);
+      int rc;
+
+      *pos = offset;
+      if (offset >= w->end || (*k = find_member (scan, w, offset)) >= 0)
+	return 0;
+      rc = scan->fn (scan->closure, st, offset,
+		     tar_iterator_header (scan->it)->header.typeflag);
+      if (rc)
+	return rc;
+    }
+  if (status == pax_io_failure)
+    return errno;
+  *done = true;
+  return 0;
+}
+
+/* Report the members found by the workers in the current window,
+   starting from the header at *POS.  */
+static int
+scan_stitch (struct tar_scan *scan, off_t *pos, bool *done)
+{
+  for (int i = 0; i < scan->nworkers && !*done; i++)
+    {
+      struct scan_worker *w = &scan->workers[i];
+      idx_t k;
+      int rc;
+
+      /* The chunk lies within the data of a member already reported.  */
+      if (*pos >= w->end)
+	continue;
+
+      k = find_member (scan, w, *pos);
+      if (k < 0)
+	{
+	  rc = scan_serial (scan, w, pos, &k, done);
+	  if (rc)
+	    return rc;
+	  if (k < 0)
+	    continue;
+	}
+
+      for (; k < w->global; k++)
+	{
+	  struct scan_member *m = &w->mem[k];
+
+	  rc = scan->fn (scan->closure, &m->st, m->offset, m->typeflag);
+	  if (rc)
+	    return rc;
+	}
+      if (k < w->count)
+	{
+	  /* Walk the rest of the chunk serially from the global
+	     header.  */
+	  *pos = w->mem[k].offset;
+	  rc = scan_serial (scan, w, pos, &k, done);
+	  if (rc)
+	    return rc;
+	  continue;
+	}
+      *pos = w->stop;
+      *done = w->eof;
+    }
+  return 0;
+}
+
+static void
+scan_free (struct tar_scan *scan)
+{
+  for (int i = 0; i < scan->nworkers; i++)
+    {
+      struct scan_worker *w = &scan->workers[i];
+
+      tar_iterator_destroy (&w->it);
+      if (w->buf)
+	{
+	  paxbuf_close (w->buf);
+	  paxbuf_destroy (&w->buf);
+	}
+      obstack_free (&w->strings, nullptr);
+      obstack_free (&w->members, nullptr);
+    }
+  free (scan->workers);
+  tar_iterator_destroy (&scan->it);
+  if (scan->buf)
+    {
+      paxbuf_close (scan->buf);
+      paxbuf_destroy (&scan->buf);
+    }
+}
+
+/* Open the archive FILENAME for reading and set up an iterator over
+   it.  */
+static int
+scan_open (char const *filename, paxbuf_t *pbuf, tar_iterator_t *pit)
+{
+  int rc;
+
+  tar_archive_create (pbuf, filename, 0, PAXBUF_READ, 0);
+  rc = paxbuf_open (*pbuf);
+  if (rc)
+    {
+      paxbuf_destroy (pbuf);
+      return rc;
+    }
+  return tar_iterator_create (pit, *pbuf, TAR_ITER_SEEK);
+}
+
+/* List the members of the local archive FILENAME with THREADS worker
+   threads, or one per processor if THREADS is not positive.  FN is
+   called for each member in archive order, with CLOSURE, the
+   description of the member, the offset of its first header block and
+   its type flag.  If FN returns a value other than zero, the scan is
+   stopped and that value is returned.  Otherwise return 0 on success
+   and an error code on failure, which is ENOTSUP if FILENAME is not a
+   regular file.  Compressed archives cannot be scanned this way.  */
+int
+tar_scan (char const *filename, int threads, tar_scan_fp fn, void *closure)
+{
+  struct tar_scan scan = { .fn = fn, .closure = closure };
+  struct stat st;
+  off_t base, pos = 0;
+  bool done = false;
+  int rc;
+
+  if (stat (filename, &st))
+    return errno;
+  if (!S_ISREG (st.st_mode))
+    return ENOTSUP;
+  if (threads <= 0)
+    {
+      long n = sysconf (_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? n : 1;
+    }
+  /* Do not start more workers than there are chunks.  */
+  if (st.st_size / SCAN_CHUNK < threads)
+    threads = st.st_size / SCAN_CHUNK + 1;
+
+  rc = scan_open (filename, &scan.buf, &scan.it);
+  scan.workers = xicalloc (threads, sizeof scan.workers[0]);
+  for (; rc == 0 && scan.nworkers < threads; scan.nworkers++)
+    {
+      struct scan_worker *w = &scan.workers[scan.nworkers];
+
+      obstack_init (&w->strings);
+      w->strings_base = obstack_alloc (&w->strings, 0);
+      obstack_init (&w->members);
+      w->members_base = obstack_alloc (&w->members, 0);
+      rc = scan_open (filename, &w->buf, &w->it);
+    }
+
+  for (base = 0; rc == 0 && !done; base += (off_t) threads * SCAN_CHUNK)
+    {
+      if (base >= st.st_size || tar_iterator_has_global (scan.it))
+	{
+	  /* The archive ended without end of archive blocks, or global
+	     extended headers apply to the rest of it: let the iterator
+	     report the members up to the end.  */
+	  struct scan_worker tail = { .end = TYPE_MAXIMUM (off_t) };
+	  idx_t k;
+
+	  rc = scan_serial (&scan, &tail, &pos, &k, &done);
+	  break;
+	}
+
+      for (int i = 0; i < threads; i++)
+	{
+	  struct scan_worker *w = &scan.workers[i];
+
+	  obstack_free (&w->strings, w->strings_base);
+	  obstack_free (&w->members, w->members_base);
+	  w->start = base + (off_t) i * SCAN_CHUNK;
+	  w->end = w->start + SCAN_CHUNK;
+	  w->count = 0;
+	  if (pthread_create (&w->thread, nullptr, scan_worker, w))
+	    {
+	      /* Do its work here instead.  */
+	      w->thread = pthread_self ();
+	      scan_worker (w);
+	    }
+	}
+      for (int i = 0; i < threads; i++)
+	if (!pthread_equal (scan.workers[i].thread, pthread_self ()))
+	  pthread_join (scan.workers[i].thread, nullptr);
+
+      rc = scan_stitch (&scan, &pos, &done);
+    }
+
+  scan_free (&scan);
+  return rc;
+}
@@ -0,0 +1,220 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <system.h>
+#include <uring.h>
+
+#if PAX_URING
+#include <sys/mman.h>
+
+/* The ring indices are shared with the kernel.  */
+#define load_acquire(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n (p, v, __ATOMIC_RELEASE)
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete,
+		    unsigned flags)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		  nullptr, 0);
+}
+
+static int
+sys_io_uring_register (int fd, unsigned opcode, void const *arg,
+		       unsigned nr_args)
+{
+  return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *
+ring_map (int fd, size_t size, off_t offset)
+{
+  void *p = mmap (nullptr, size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+/* Set up a ring with ENTRIES submission queue entries.  Return 0 on
+   success and an error code otherwise.  ENOSYS means the kernel does
+   not support io_uring.  */
+int
+uring_init (struct uring *ring, unsigned entries)
+{
+  struct io_uring_params p;
+  int ec;
+
+  memset (ring, 0, sizeof *ring);
+  memset (&p, 0, sizeof p);
+  ring->fd = sys_io_uring_setup (entries, &p);
+  if (ring->fd < 0)
+    return errno;
+  ring->entries = p.sq_entries;
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring->cq_ring_size = p.cq_off.cqes
+                       + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_ring_size > ring->sq_ring_size)
+	ring->sq_ring_size = ring->cq_ring_size;
+      ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+  ring->sq_ring = ring_map (ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+  if (!ring->sq_ring)
+    goto err;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = ring_map (ring->fd, ring->cq_ring_size,
+				IORING_OFF_CQ_RING);
+      if (!ring->cq_ring)
+	goto err;
+    }
+  ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = ring_map (ring->fd, ring->sqes_size, IORING_OFF_SQES);
+  if (!ring->sqes)
+    goto err;
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+
+ err:
+  ec = errno;
+  uring_free (ring);
+  return ec;
+}
+
+void
+uring_free (struct uring *ring)
+{
+  if (ring->sqes)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap (ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close (ring->fd);
+  memset (ring, 0, sizeof *ring);
+  ring->fd = -1;
+}
+
+/* Register COUNT buffers described by IOV for use with fixed-buffer
+   requests.  */
+int
+uring_register_buffers (struct uring *ring, struct iovec const *iov,
+			unsigned count)
+{
+  if (sys_io_uring_register (ring->fd, IORING_REGISTER_BUFFERS, iov, count))
+    return errno;
+  return 0;
+}
+
+/* Prepare a read or write request.  For IORING_OP_READ_FIXED and
+   IORING_OP_WRITE_FIXED, BUF_INDEX is the index of the registered
+   buffer DATA belongs to; for IORING_OP_READV and IORING_OP_WRITEV,
+   DATA is an array of LEN iovecs and BUF_INDEX is 0.  USER_DATA is returned by uring_wait upon
+   completion.  The request is not passed to the kernel until
+   uring_submit is called.  Return 0 on success and EAGAIN if the
+   submission queue is full.  */
+int
+uring_queue_rw (struct uring *ring, int opcode, int fd,
+		void *data, unsigned len, off_t offset,
+		unsigned buf_index, unsigned long long user_data)
+{
+  unsigned tail = *ring->sq_tail;
+  struct io_uring_sqe *sqe;
+
+  if (tail - load_acquire (ring->sq_head) >= ring->entries)
+    return EAGAIN;
+  unsigned idx = tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset (sqe, 0, sizeof *sqe);
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) data;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = buf_index;
+  sqe->user_data = user_data;
+  ring->sq_array[idx] = idx;
+  store_release (ring->sq_tail, tail + 1);
+  ring->sq_pending++;
+  return 0;
+}
+
+/* Pass the prepared requests to the kernel.  */
+int
+uring_submit (struct uring *ring)
+{
+  while (ring->sq_pending > 0)
+    {
+      int n = sys_io_uring_enter (ring->fd, ring->sq_pending, 0, 0);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return errno;
+	}
+      ring->sq_pending -= n;
+    }
+  return 0;
+}
+
+/* Wait for the next completion.  Store the user data of the completed
+   request in *USER_DATA and its result in *RES.  */
+int
+uring_wait (struct uring *ring, unsigned long long *user_data, int *res)
+{
+  int ec = uring_submit (ring);
+  if (ec)
+    return ec;
+  for (;;)
+    {
+      unsigned head = *ring->cq_head;
+      if (head != load_acquire (ring->cq_tail))
+	{
+	  struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+	  *user_data = cqe->user_data;
+	  *res = cqe->res;
+	  store_release (ring->cq_head, head + 1);
+	  return 0;
+	}
+      if (sys_io_uring_enter (ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+	  && errno != EINTR)
+	return errno;
+    }
+}
+#endif
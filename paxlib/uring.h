@@ -0,0 +1,69 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Minimal interface to the Linux io_uring facility, sufficient for
+   queueing reads and writes.  */
+
+#if HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+# ifdef __NR_io_uring_setup
+#  define PAX_URING 1
+# endif
+#endif
+
+#if PAX_URING
+# include <sys/uio.h>
+
+struct uring
+{
+  int fd;                        /* Ring file descriptor */
+  unsigned entries;              /* Number of submission queue entries */
+
+    /* Submission queue */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_pending;           /* Entries prepared but not submitted */
+
+    /* Completion queue */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+    /* Mappings */
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+int uring_init (struct uring *ring, unsigned entries);
+void uring_free (struct uring *ring);
+int uring_register_buffers (struct uring *ring, struct iovec const *iov,
+			    unsigned count);
+int uring_queue_rw (struct uring *ring, int opcode, int fd,
+		    void *data, unsigned len, off_t offset,
+		    unsigned buf_index, unsigned long long user_data);
+int uring_submit (struct uring *ring);
+int uring_wait (struct uring *ring, unsigned long long *user_data,
+		int *res);
+#endif
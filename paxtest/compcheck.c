@@ -0,0 +1,275 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Check the compression filters: data written through them with one
+   or several workers is read back through the decompression filter.
+   The data spans several compression blocks and is partly
+   compressible.  A gzip stream must also be readable by zlib as an
+   ordinary multi-member stream.  Codecs that were not built in are
+   skipped.  */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <paxtest.h>
+#if HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+
+void
+xalloc_die (void)
+{
+  fputs ("memory exhausted\n", stderr);
+  exit (EXIT_FAILURE);
+}
+
+/* Blocking factor of the streams */
+enum { BFACTOR = 20, RECORD_SIZE = BFACTOR * BLOCKSIZE };
+
+/* Size of the data, a little over five compression blocks */
+enum { DATA_SIZE = 5 * 1024 * 1024 + 777 };
+
+static int failures;
+
+static char *data;
+
+static uint_least32_t seed = 1;
+
+/* Return a pseudo-random number, the same on all systems.  */
+static unsigned int
+next_random (void)
+{
+  seed = (seed * 1103515245 + 12345) & 0xffffffff;
+  return seed >> 16;
+}
+
+/* Write SIZE bytes of the data to FILENAME, compressed with CODEC by
+   THREADS workers, in pieces of varying sizes.  Return 0 on success
+   and an error code otherwise.  */
+static int
+write_stream (char const *filename, int codec, int threads, idx_t size)
+{
+  paxbuf_t pbuf;
+  idx_t n;
+  int rc;
+
+  /* The archive is not truncated when opened.  */
+  if (truncate (filename, 0))
+    return errno;
+  tar_archive_create (&pbuf, filename, 0, PAXBUF_WRITE | PAXBUF_CREAT,
+		      BFACTOR);
+  rc = paxbuf_push_compress (pbuf, codec, -1, threads);
+  if (rc == 0 && paxbuf_open (pbuf))
+    rc = errno;
+  for (idx_t off = 0; rc == 0 && off < size; off += n)
+    {
+      idx_t len = next_random () % (3 * RECORD_SIZE) + 1;
+      if (len > size - off)
+	len = size - off;
+      if (paxbuf_write (pbuf, data + off, len, &n) != pax_io_success)
+	rc = errno;
+    }
+  if (rc == 0 && paxbuf_close (pbuf))
+    rc = errno;
+  paxbuf_destroy (&pbuf);
+  return rc;
+}
+
+/* Return true if the SIZE bytes at BUF are zero.  */
+static bool
+all_zero (char const *buf, idx_t size)
+{
+  for (idx_t i = 0; i < size; i++)
+    if (buf[i])
+      return false;
+  return true;
+}
+
+/* Read FILENAME through the decompression filter with THREADS workers
+   and compare it with the first SIZE bytes of the data, which are
+   followed by the zeros that pad the last record.  */
+static void
+read_stream (char const *filename, int threads, idx_t size,
+	     char const *what)
+{
+  static char buf[100000];
+  paxbuf_t pbuf;
+  pax_io_status_t status;
+  off_t offset = 0;
+  bool differ = false;
+  idx_t n;
+
+  tar_archive_create (&pbuf, filename, 0, PAXBUF_READ, BFACTOR);
+  if (paxbuf_push_decompress (pbuf, threads) || paxbuf_open (pbuf))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  do
+    {
+      status = paxbuf_read (pbuf, buf, sizeof buf, &n);
+      if (offset < size)
+	{
+	  idx_t len = n < size - offset ? n : size - offset;
+	  if (memcmp (buf, data + offset, len) != 0
+	      || !all_zero (buf + len, n - len))
+	    differ = true;
+	}
+      else if (!all_zero (buf, n))
+	differ = true;
+      offset += n;
+    }
+  while (status == pax_io_success && n > 0);
+
+  if (status == pax_io_failure)
+    {
+      printf ("%s: reading: %s\n", what, strerror (errno));
+      failures++;
+    }
+  else if (differ || offset < size || offset - size >= RECORD_SIZE)
+    {
+      printf ("%s: data differ\n", what);
+      failures++;
+    }
+  paxbuf_close (pbuf);
+  paxbuf_destroy (&pbuf);
+}
+
+#if HAVE_ZLIB_H
+/* Inflate FILENAME as a sequence of gzip members followed by the zeros
+   that pad the last record, and compare it with the first SIZE bytes
+   of the data.  */
+static void
+check_gzip (char const *filename, idx_t size, char const *what)
+{
+  struct stat st;
+  unsigned char *in;
+  char *out;
+  z_stream zs = { 0 };
+  idx_t in_size, members = 0;
+  int fd, ret = Z_OK;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  in_size = st.st_size;
+  in = ximalloc (in_size);
+  out = ximalloc (size + RECORD_SIZE);
+  if (read (fd, in, in_size) != in_size || close (fd))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+
+  if (inflateInit2 (&zs, 15 + 16) != Z_OK)
+    abort ();
+  zs.next_in = in;
+  zs.avail_in = in_size;
+  zs.next_out = (unsigned char *) out;
+  zs.avail_out = size + RECORD_SIZE;
+  while (zs.avail_in > 0 && !all_zero ((char *) zs.next_in, zs.avail_in))
+    {
+      ret = inflate (&zs, Z_NO_FLUSH);
+      if (ret != Z_STREAM_END)
+	break;
+      members++;
+      inflateReset (&zs);
+    }
+  inflateEnd (&zs);
+
+  if ((size > 0 && ret != Z_STREAM_END)
+      || (char *) zs.next_out - out < size
+      || memcmp (out, data, size) != 0
+      || !all_zero (out + size, (char *) zs.next_out - out - size))
+    {
+      printf ("%s: not a valid gzip stream\n", what);
+      failures++;
+    }
+  else if (members < 2 && size > 1024 * 1024)
+    {
+      printf ("%s: %td gzip members\n", what, members);
+      failures++;
+    }
+  free (in);
+  free (out);
+}
+#endif
+
+int
+main (void)
+{
+  static struct { int codec; char const *name; } const codecs[] = {
+    { PAXBUF_GZIP, "gzip" },
+    { PAXBUF_ZSTD, "zstd" }
+  };
+  static idx_t const sizes[] = { 0, 100, RECORD_SIZE, DATA_SIZE };
+  char filename[] = "compcheckXXXXXX";
+  int fd;
+
+  fd = mkstemp (filename);
+  if (fd < 0)
+    {
+      perror ("mkstemp");
+      return EXIT_FAILURE;
+    }
+  close (fd);
+
+  /* Text in the first half, random bytes in the second.  */
+  data = ximalloc (DATA_SIZE);
+  for (idx_t i = 0; i < DATA_SIZE / 2; i++)
+    data[i] = "paxutils compression check\n"[i % 27];
+  for (idx_t i = DATA_SIZE / 2; i < DATA_SIZE; i++)
+    data[i] = next_random ();
+
+  for (int c = 0; c < sizeof codecs / sizeof codecs[0]; c++)
+    for (int threads = 1; threads <= 4; threads += 3)
+      for (int s = 0; s < sizeof sizes / sizeof sizes[0]; s++)
+	{
+	  char what[64];
+	  int rc;
+
+	  sprintf (what, "%s, %d threads, %td bytes", codecs[c].name, threads,
+		   sizes[s]);
+	  rc = write_stream (filename, codecs[c].codec, threads, sizes[s]);
+	  if (rc == ENOSYS)
+	    break;
+	  if (rc)
+	    {
+	      printf ("%s: writing: %s\n", what, strerror (rc));
+	      failures++;
+	      continue;
+	    }
+	  read_stream (filename, threads, sizes[s], what);
+#if HAVE_ZLIB_H
+	  if (codecs[c].codec == PAXBUF_GZIP)
+	    check_gzip (filename, sizes[s], what);
+#endif
+	}
+  free (data);
+  unlink (filename);
+
+  if (failures)
+    {
+      printf ("%d failures\n", failures);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
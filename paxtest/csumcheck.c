@@ -0,0 +1,241 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Check the checksum filter: data written with it is read back and
+   verified, with and without seeks, while a corrupted record and a
+   missing final digest record make the read fail.  The data contains
+   a checksummed stream of its own, on a record boundary, which must
+   not be taken for digest records.  */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <paxtest.h>
+
+void
+xalloc_die (void)
+{
+  fputs ("memory exhausted\n", stderr);
+  exit (EXIT_FAILURE);
+}
+
+/* Blocking factor of the streams */
+enum { BFACTOR = 4, RECORD_SIZE = BFACTOR * BLOCKSIZE };
+
+/* Size of the data, and of the stream nested in it */
+enum { DATA_SIZE = 3 * 1000 * 1000 + 333, INNER_SIZE = 100 * 1000 + 7 };
+
+/* Offset of the nested stream in the data */
+enum { INNER_OFFSET = 300 * RECORD_SIZE };
+
+static int failures;
+
+static char *data;
+
+static uint_least32_t seed = 1;
+
+/* Return a pseudo-random number, the same on all systems.  */
+static unsigned int
+next_random (void)
+{
+  seed = (seed * 1103515245 + 12345) & 0xffffffff;
+  return seed >> 16;
+}
+
+/* Write the SIZE bytes at BUF to FILENAME through a checksum filter
+   with FLAGS.  */
+static void
+write_stream (char const *filename, int flags, char *buf, idx_t size)
+{
+  paxbuf_t pbuf;
+  idx_t n;
+
+  tar_archive_create (&pbuf, filename, 0, PAXBUF_WRITE | PAXBUF_CREAT,
+		      BFACTOR);
+  if (paxbuf_push_checksum (pbuf, flags)
+      || paxbuf_open (pbuf)
+      || paxbuf_write (pbuf, buf, size, &n) != pax_io_success
+      || paxbuf_close (pbuf))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  paxbuf_destroy (&pbuf);
+}
+
+/* Read FILENAME through a checksum filter with FLAGS, first at a few
+   offsets if SEEK, and compare it with the data.  Return 0 if it reads
+   back correctly, the error code of the read if it fails, and EIO if
+   the data differ.  Corrupted data are only detected at the next
+   digest record, so the read goes on after a difference.  */
+static int
+read_stream (char const *filename, int flags, bool seek)
+{
+  static off_t const offsets[] = { 2000000, 100, DATA_SIZE - 1000,
+				   INNER_OFFSET, 0, 2047, 1048576 };
+  static char buf[100000];
+  paxbuf_t pbuf;
+  pax_io_status_t status;
+  off_t offset = 0;
+  bool differ = false;
+  idx_t n;
+  int rc = 0;
+
+  tar_archive_create (&pbuf, filename, 0, PAXBUF_READ, BFACTOR);
+  if (paxbuf_push_checksum (pbuf, flags) || paxbuf_open (pbuf))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  if (seek)
+    for (int i = 0; rc == 0 && i < sizeof offsets / sizeof offsets[0]; i++)
+      {
+	if (paxbuf_seek (pbuf, offsets[i]) != offsets[i]
+	    || paxbuf_read (pbuf, buf, 500, &n) == pax_io_failure)
+	  rc = errno;
+	else if (n != 500 || memcmp (buf, data + offsets[i], n) != 0)
+	  rc = EIO;
+      }
+  if (rc == 0 && seek && paxbuf_seek (pbuf, 0) != 0)
+    rc = errno;
+
+  while (rc == 0)
+    {
+      status = paxbuf_read (pbuf, buf, sizeof buf, &n);
+      if (status == pax_io_failure)
+	rc = errno;
+      /* The last record is padded with zeros.  */
+      else if (memcmp (buf, data + offset,
+		       offset + n > DATA_SIZE ? DATA_SIZE - offset : n) != 0)
+	differ = true;
+      offset += n;
+      if (status == pax_io_eof || n == 0)
+	break;
+    }
+  if (rc == 0
+      && (differ || offset < DATA_SIZE || offset >= DATA_SIZE + RECORD_SIZE))
+    rc = EIO;
+
+  paxbuf_close (pbuf);
+  paxbuf_destroy (&pbuf);
+  return rc;
+}
+
+static void
+expect (char const *what, int rc, int expected)
+{
+  if (rc != expected)
+    {
+      printf ("%s: got %s, expected %s\n", what,
+	      rc ? strerror (rc) : "success",
+	      expected ? strerror (expected) : "success");
+      failures++;
+    }
+}
+
+/* Flip a bit of FILENAME at OFFSET.  */
+static void
+corrupt (char const *filename, off_t offset)
+{
+  int fd = open (filename, O_RDWR);
+  char c;
+
+  if (fd < 0 || pread (fd, &c, 1, offset) != 1)
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  c ^= 1;
+  if (pwrite (fd, &c, 1, offset) != 1 || close (fd))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Store in the data at OFFSET a stream written with FLAGS.  */
+static void
+nest_stream (char const *filename, int flags, off_t offset)
+{
+  char *inner = ximalloc (INNER_SIZE);
+  int fd;
+  ssize_t n;
+
+  for (idx_t i = 0; i < INNER_SIZE; i++)
+    inner[i] = next_random ();
+  write_stream (filename, flags, inner, INNER_SIZE);
+  free (inner);
+  fd = open (filename, O_RDONLY);
+  n = fd < 0 ? -1 : read (fd, data + offset, DATA_SIZE - offset);
+  if (n < 0 || close (fd))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+}
+
+int
+main (void)
+{
+  char filename[] = "csumcheckXXXXXX";
+  struct stat st;
+  int fd;
+
+  fd = mkstemp (filename);
+  if (fd < 0)
+    {
+      perror ("mkstemp");
+      return EXIT_FAILURE;
+    }
+  close (fd);
+
+  data = ximalloc (DATA_SIZE);
+  for (int flags = 0; flags <= PAXBUF_CSUM_RECORD; flags += PAXBUF_CSUM_RECORD)
+    {
+      for (idx_t i = 0; i < DATA_SIZE; i++)
+	data[i] = next_random ();
+      nest_stream (filename, flags, INNER_OFFSET);
+
+      write_stream (filename, flags, data, DATA_SIZE);
+      expect ("read", read_stream (filename, flags, false), 0);
+      if (flags & PAXBUF_CSUM_RECORD)
+	expect ("read with seeks", read_stream (filename, flags, true), 0);
+
+      corrupt (filename, DATA_SIZE / 2);
+      expect ("corrupted record", read_stream (filename, flags, false),
+	      EILSEQ);
+
+      write_stream (filename, flags, data, DATA_SIZE);
+      if (stat (filename, &st) || truncate (filename, st.st_size - RECORD_SIZE))
+	{
+	  perror (filename);
+	  return EXIT_FAILURE;
+	}
+      expect ("missing final digest", read_stream (filename, flags, false),
+	      EILSEQ);
+    }
+  free (data);
+  unlink (filename);
+
+  if (failures)
+    {
+      printf ("%d failures\n", failures);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
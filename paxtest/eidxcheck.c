@@ -0,0 +1,304 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Check indexes embedded at the end of archives: an archive written
+   with one is loaded and its members are looked up and read, and
+   crafted index headers with malformed records are rejected.  */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <paxtest.h>
+
+void
+xalloc_die (void)
+{
+  fputs ("memory exhausted\n", stderr);
+  exit (EXIT_FAILURE);
+}
+
+enum { MEMBERS = 2000, MAX_DATA = 5000 };
+
+/* Seconds allowed for loading a crafted index */
+enum { LOAD_TIMEOUT = 10 };
+
+static int failures;
+
+/* Store in BLOCK a ustar header for the member NAME of type TYPEFLAG
+   with SIZE bytes of data.  */
+static void
+make_header (union block *block, char const *name, off_t size,
+	     char typeflag)
+{
+  unsigned int sum = 0;
+
+  memset (block, 0, sizeof *block);
+  strcpy (block->header.name, name);
+  strcpy (block->header.mode, "0000644");
+  strcpy (block->header.uid, "0000000");
+  strcpy (block->header.gid, "0000000");
+  snprintf (block->header.size, sizeof block->header.size, "%011jo",
+	    (uintmax_t) size);
+  strcpy (block->header.mtime, "00000000000");
+  block->header.typeflag = typeflag;
+  memcpy (block->header.magic, TMAGIC, TMAGLEN);
+  memcpy (block->header.version, TVERSION, TVERSLEN);
+  memset (block->header.chksum, ' ', sizeof block->header.chksum);
+  for (int i = 0; i < BLOCKSIZE; i++)
+    sum += (unsigned char) block->buffer[i];
+  sprintf (block->header.chksum, "%06o", sum);
+}
+
+static void
+member_name (char *name, int i)
+{
+  sprintf (name, "dir%d/file%05d", i % 7, i);
+}
+
+static off_t
+member_size (int i)
+{
+  return (i * 37) % MAX_DATA;
+}
+
+static void
+check (bool ok, char const *what)
+{
+  if (!ok)
+    {
+      printf ("%s failed\n", what);
+      failures++;
+    }
+}
+
+/* Write an archive of MEMBERS members with an embedded index to
+   FILENAME.  */
+static int
+write_archive (char const *filename)
+{
+  static char data[MAX_DATA + BLOCKSIZE];
+  static char zero[2 * BLOCKSIZE];
+  tar_index_builder_t b;
+  paxbuf_t pbuf;
+  idx_t n;
+  int rc;
+
+  tar_archive_create (&pbuf, filename, 0, PAXBUF_WRITE | PAXBUF_CREAT, 0);
+  rc = paxbuf_open (pbuf);
+  if (rc)
+    {
+      paxbuf_destroy (&pbuf);
+      return rc;
+    }
+  tar_index_builder_create (&b);
+  for (int i = 0; rc == 0 && i < MEMBERS; i++)
+    {
+      char name[32];
+      union block block;
+      off_t size = member_size (i);
+
+      member_name (name, i);
+      make_header (&block, name, size, REGTYPE);
+      memset (data, 'a' + i % 26, size);
+      memset (data + size, 0, BLOCKSIZE);
+      rc = tar_index_builder_mark (b, pbuf, name, size, REGTYPE);
+      if (rc == 0
+	  && (paxbuf_write (pbuf, block.buffer, BLOCKSIZE, &n)
+	      != pax_io_success
+	      || paxbuf_write (pbuf, data,
+			       (size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE,
+			       &n) != pax_io_success))
+	rc = errno;
+    }
+  if (rc == 0)
+    rc = tar_index_builder_finish (b, pbuf);
+  if (rc == 0
+      && paxbuf_write (pbuf, zero, sizeof zero, &n) != pax_io_success)
+    rc = errno;
+  tar_index_builder_destroy (&b);
+  if (paxbuf_close (pbuf) && rc == 0)
+    rc = errno;
+  paxbuf_destroy (&pbuf);
+  return rc;
+}
+
+/* Load the index of FILENAME and store it in *IDX, with the archive in
+   *PBUF, or nullptr if it cannot be opened.  Return 0 on success and an
+   error code otherwise.  */
+static int
+load_index (char const *filename, paxbuf_t *pbuf, tar_index_t *idx)
+{
+  int rc;
+
+  tar_archive_create (pbuf, filename, 0, PAXBUF_READ, 0);
+  rc = paxbuf_open (*pbuf);
+  if (rc)
+    {
+      paxbuf_destroy (pbuf);
+      return rc;
+    }
+  alarm (LOAD_TIMEOUT);
+  rc = tar_index_load (idx, *pbuf, tar_archive_size (*pbuf));
+  alarm (0);
+  return rc;
+}
+
+static void
+check_archive (char const *filename)
+{
+  static char data[MAX_DATA];
+  paxbuf_t pbuf;
+  tar_index_t idx;
+  tar_iterator_t it;
+  struct tar_stat_info *st;
+  pax_io_status_t status;
+  idx_t n;
+  int rc, count;
+
+  rc = write_archive (filename);
+  if (rc)
+    {
+      printf ("writing the archive: %s\n", strerror (rc));
+      failures++;
+      return;
+    }
+  rc = load_index (filename, &pbuf, &idx);
+  if (rc)
+    {
+      printf ("tar_index_load: %s\n", strerror (rc));
+      failures++;
+      if (pbuf)
+	{
+	  paxbuf_close (pbuf);
+	  paxbuf_destroy (&pbuf);
+	}
+      return;
+    }
+  check (tar_index_count (idx) == MEMBERS, "tar_index_count");
+
+  if (tar_iterator_create (&it, pbuf, TAR_ITER_SEEK))
+    abort ();
+  for (int i = MEMBERS - 1; i >= 0; i -= 3)
+    {
+      char name[32];
+      struct tar_index_entry ent;
+
+      member_name (name, i);
+      if (!tar_index_lookup (idx, name, &ent))
+	{
+	  printf ("%s not found\n", name);
+	  failures++;
+	  continue;
+	}
+      if (tar_iterator_seek (it, ent.offset)
+	  || tar_iterator_next (it, &st) != pax_io_success
+	  || strcmp (st->file_name, name) != 0
+	  || tar_iterator_read (it, data, sizeof data, &n) == pax_io_failure
+	  || n != member_size (i)
+	  || (n > 0 && (data[0] != 'a' + i % 26
+			|| memcmp (data, data + 1, n - 1) != 0)))
+	{
+	  printf ("%s: wrong member at offset %jd\n", name,
+		  (intmax_t) ent.offset);
+	  failures++;
+	}
+    }
+  check (!tar_index_lookup (idx, "dir0/nonexistent", &(struct tar_index_entry)
+			    { 0 }), "lookup of a missing member");
+
+  /* The iterator does not report the index.  */
+  count = 0;
+  if (tar_iterator_seek (it, 0))
+    abort ();
+  while ((status = tar_iterator_next (it, &st)) == pax_io_success)
+    count++;
+  check (status == pax_io_eof && count == MEMBERS, "listing");
+
+  tar_iterator_destroy (&it);
+  tar_index_close (&idx);
+  paxbuf_close (pbuf);
+  paxbuf_destroy (&pbuf);
+}
+
+/* Write to FILENAME an archive made of an index header whose records
+   are RECORDS, and check that loading it fails with EILSEQ.  */
+static void
+check_crafted (char const *filename, char const *records)
+{
+  static char const offset_record[] = "27 PAXUTILS.index.offset=0\n";
+  char data[3 * BLOCKSIZE] = { 0 };
+  idx_t size = strlen (records) + sizeof offset_record - 1;
+  paxbuf_t pbuf;
+  tar_index_t idx;
+  int fd, rc;
+
+  make_header ((union block *) data, PAXINDEX_NAME, size, XGLTYPE);
+  strcpy (data + BLOCKSIZE, records);
+  strcat (data + BLOCKSIZE, offset_record);
+  fd = open (filename, O_WRONLY | O_TRUNC);
+  if (fd < 0 || write (fd, data, sizeof data) != sizeof data || close (fd))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+
+  rc = load_index (filename, &pbuf, &idx);
+  if (rc == 0)
+    tar_index_close (&idx);
+  if (rc != EILSEQ)
+    {
+      printf ("records \"%s\": got %s, expected EILSEQ\n", records,
+	      rc ? strerror (rc) : "success");
+      failures++;
+    }
+  if (pbuf)
+    {
+      paxbuf_close (pbuf);
+      paxbuf_destroy (&pbuf);
+    }
+}
+
+int
+main (void)
+{
+  char filename[] = "eidxcheckXXXXXX";
+  int fd;
+
+  fd = mkstemp (filename);
+  if (fd < 0)
+    {
+      perror ("mkstemp");
+      return EXIT_FAILURE;
+    }
+  close (fd);
+
+  check_archive (filename);
+  /* Records whose length does not cover their own length field */
+  check_crafted (filename, "0 zzzz\n");
+  check_crafted (filename, "7 a=bc\n0 zzzz\n");
+  check_crafted (filename, "7 a=bc\n2 zzzz\n");
+  check_crafted (filename, "x a=bc\n");
+  unlink (filename);
+
+  if (failures)
+    {
+      printf ("%d failures\n", failures);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Check the decoding of numeric header fields, header checksums and
+   the detection of zero blocks.  The portable versions are checked
+   against known values and, where SSE2 versions exist, both are
+   compared on the same fields and blocks, known and random.  */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <paxtest.h>
+#include <tarnum.h>
+
+/* Number of random fields and blocks tried.  */
+enum { RANDOM_FIELDS = 200000, RANDOM_BLOCKS = 20000 };
+
+static int failures;
+
+static uint_least32_t seed = 1;
+
+/* Return a pseudo-random number, the same on all systems.  */
+static unsigned int
+next_random (void)
+{
+  seed = (seed * 1103515245 + 12345) & 0xffffffff;
+  return seed >> 16;
+}
+
+/* Decode FIELD of LEN bytes with all versions.  If KNOWN, it must give
+   OK and VALUE.  */
+static void
+check_field (char const *field, idx_t len, bool known, bool ok,
+	     intmax_t value)
+{
+  /* The SSE2 version reads 16 bytes.  */
+  char buf[32] = { 0 };
+  intmax_t v = 0;
+  bool r;
+
+  memcpy (buf, field, len);
+  r = tar_decode_number (buf, len, &v);
+  if (known && (r != ok || (ok && v != value)))
+    {
+      printf ("field %d bytes: got %d %jd, expected %d %jd\n",
+	      (int) len, r, v, ok, value);
+      failures++;
+    }
+#if TARHDR_SSE2
+  intmax_t w = 0;
+  bool s = tar_decode_number_sse2 (buf, len, &w);
+  if (s != r || (r && w != v))
+    {
+      printf ("field %d bytes:", (int) len);
+      for (idx_t i = 0; i < len; i++)
+	printf (" %02x", (unsigned char) buf[i]);
+      printf (": scalar %d %jd, SSE2 %d %jd\n", r, v, s, w);
+      failures++;
+    }
+#endif
+}
+
+#define KNOWN(field, ok, value) \
+  check_field (field, sizeof (field) - 1, true, ok, value)
+
+static void
+check_known_fields (void)
+{
+  KNOWN ("            ", true, 0);
+  KNOWN ("\0\0\0\0\0\0\0\0", true, 0);
+  KNOWN ("0000644\0", true, 0644);
+  KNOWN ("0000644 ", true, 0644);
+  KNOWN ("    644 \0", true, 0644);
+  KNOWN ("00000001750 ", true, 1000);
+  KNOWN ("77777777777\0", true, 077777777777);
+  KNOWN ("777777777777", true, 0777777777777);
+  KNOWN ("123456701234", true, 0123456701234);
+  KNOWN ("7777777777777777", true, 07777777777777777);
+  KNOWN ("12 34", true, 012);
+  KNOWN ("12\0" "34", true, 012);
+  KNOWN ("0000648 ", false, 0);
+  KNOWN ("   x   ", false, 0);
+  KNOWN ("-1      ", false, 0);
+
+  /* Base-256, two's complement after the marker bit.  */
+  KNOWN ("\x80\0\0\0\0\0\0\0\0\0\0\x01", true, 1);
+  KNOWN ("\x80\0\0\0\0\0\0\x02\0\0\0\0", true, (intmax_t) 2 << 32);
+  KNOWN ("\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff", true, -1);
+  KNOWN ("\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xfe", true, -2);
+  KNOWN ("\xff\xff\xff\xff\xff\xff\xff\x9c", true, -100);
+  KNOWN ("\xff\xff\xff\xff\x80\0\0\0\0\0\0\0", true,
+	 INTMAX_MIN);
+  KNOWN ("\xc0\0\0\0\0\0\0\0\0\0\0\0", false, 0);
+  KNOWN ("\x80\x01\0\0\0\0\0\0\0\0\0\0", false, 0);
+}
+
+static void
+check_random_fields (void)
+{
+  static char const digits[] = "0123456701234567   \0\0";
+
+  for (int n = 0; n < RANDOM_FIELDS; n++)
+    {
+      char field[16];
+      idx_t len = 1 + next_random () % sizeof field;
+
+      for (idx_t i = 0; i < len; i++)
+	{
+	  unsigned int r = next_random ();
+	  field[i] = (r % 64 == 0 ? r >> 8
+		      : digits[r % (sizeof digits - 1)]);
+	}
+      check_field (field, len, false, false, 0);
+    }
+}
+
+/* Check the sums and the zero test of BLOCK, whose unsigned byte sum,
+   if known, is USUM.  */
+static void
+check_block (union block const *block, intmax_t usum)
+{
+  intmax_t u, s, us = 0, ss = 0;
+  bool zero = true;
+
+  for (int i = 0; i < BLOCKSIZE; i++)
+    {
+      us += (unsigned char) block->buffer[i];
+      ss += (signed char) block->buffer[i];
+      zero &= !block->buffer[i];
+    }
+  if (usum >= 0 && us != usum)
+    abort ();
+
+  tar_block_sums (block, &u, &s);
+  if (u != us || s != ss || tar_zero_block (block) != zero)
+    {
+      printf ("block: scalar sums %jd %jd, expected %jd %jd\n",
+	      u, s, us, ss);
+      failures++;
+    }
+#if TARHDR_SSE2
+  tar_block_sums_sse2 (block, &u, &s);
+  if (u != us || s != ss || tar_zero_block_sse2 (block) != zero)
+    {
+      printf ("block: SSE2 sums %jd %jd, expected %jd %jd\n",
+	      u, s, us, ss);
+      failures++;
+    }
+#endif
+}
+
+static void
+check_blocks (void)
+{
+  union block block;
+
+  memset (&block, 0, sizeof block);
+  check_block (&block, 0);
+  for (int i = 0; i < BLOCKSIZE; i++)
+    {
+      block.buffer[i] = i & 1 ? 1 : 0x80;
+      check_block (&block, i & 1 ? 1 : 0x80);
+      block.buffer[i] = 0;
+    }
+  memset (&block, 0xff, sizeof block);
+  check_block (&block, 255 * BLOCKSIZE);
+
+  for (int n = 0; n < RANDOM_BLOCKS; n++)
+    {
+      for (int i = 0; i < BLOCKSIZE; i++)
+	block.buffer[i] = next_random ();
+      check_block (&block, -1);
+    }
+}
+
+int
+main (void)
+{
+  check_known_fields ();
+  check_random_fields ();
+  check_blocks ();
+  if (failures)
+    {
+      printf ("%d failures\n", failures);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
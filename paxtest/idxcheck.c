@@ -0,0 +1,403 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Check member indexes kept in files of their own: an index is built
+   from an archive, opened, and its members are looked up and read.
+   Some members share a name, in which case the last one must be
+   found, and one has a name too long for the ustar header, stored in
+   an extended header.  Damaged index files must be rejected.  */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <paxtest.h>
+
+void
+xalloc_die (void)
+{
+  fputs ("memory exhausted\n", stderr);
+  exit (EXIT_FAILURE);
+}
+
+enum { MEMBERS = 3000, MAX_DATA = 5000 };
+
+/* Every DUP_EVERY-th member has the name of the member DUP_EVERY / 2
+   before it.  */
+enum { DUP_EVERY = 100 };
+
+/* Member with a long name */
+enum { LONG_MEMBER = 1234 };
+
+/* Size of the index file header */
+enum { HEADER_SIZE = 32 };
+
+static int failures;
+
+/* Store in BLOCK a ustar header for the member NAME of type TYPEFLAG
+   with SIZE bytes of data.  */
+static void
+make_header (union block *block, char const *name, off_t size,
+	     char typeflag)
+{
+  unsigned int sum = 0;
+
+  memset (block, 0, sizeof *block);
+  snprintf (block->header.name, sizeof block->header.name, "%s", name);
+  strcpy (block->header.mode, "0000644");
+  strcpy (block->header.uid, "0000000");
+  strcpy (block->header.gid, "0000000");
+  snprintf (block->header.size, sizeof block->header.size, "%011o",
+	    (unsigned int) size);
+  strcpy (block->header.mtime, "00000000000");
+  block->header.typeflag = typeflag;
+  memcpy (block->header.magic, TMAGIC, TMAGLEN);
+  memcpy (block->header.version, TVERSION, TVERSLEN);
+  memset (block->header.chksum, ' ', sizeof block->header.chksum);
+  for (int i = 0; i < BLOCKSIZE; i++)
+    sum += (unsigned char) block->buffer[i];
+  sprintf (block->header.chksum, "%06o", sum);
+}
+
+/* Store in NAME the name of member I.  */
+static void
+member_name (char *name, int i)
+{
+  if (i % DUP_EVERY == 0 && i > 0)
+    i -= DUP_EVERY / 2;
+  if (i == LONG_MEMBER)
+    sprintf (name, "%0150d/file%05d", 0, i);
+  else
+    sprintf (name, "dir%d/file%05d", i % 7, i);
+}
+
+static off_t
+member_size (int i)
+{
+  return (i * 37) % MAX_DATA;
+}
+
+/* Return the byte member I is filled with.  */
+static char
+member_fill (int i)
+{
+  return 'a' + i % 26;
+}
+
+/* Return the number of the last member named like member I.  */
+static int
+last_member (int i)
+{
+  if (i % DUP_EVERY == DUP_EVERY / 2 && i + DUP_EVERY / 2 < MEMBERS)
+    return i + DUP_EVERY / 2;
+  return i;
+}
+
+static void
+check (bool ok, char const *what)
+{
+  if (!ok)
+    {
+      printf ("%s failed\n", what);
+      failures++;
+    }
+}
+
+static void
+write_data (FILE *fp, char const *data, idx_t size)
+{
+  if (fwrite (data, 1, size, fp) != size)
+    {
+      perror ("fwrite");
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Write the test archive to FILENAME.  */
+static void
+write_archive (char const *filename)
+{
+  static char data[MAX_DATA + BLOCKSIZE];
+  FILE *fp = fopen (filename, "w");
+
+  if (!fp)
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  for (int i = 0; i < MEMBERS; i++)
+    {
+      char name[256];
+      union block block;
+      off_t size = member_size (i);
+
+      member_name (name, i);
+      if (strlen (name) >= sizeof block.header.name)
+	{
+	  /* The length of a record includes its own digits.  */
+	  int len = strlen (name) + sizeof "path=\n" - 1 + 4;
+	  char rec[300];
+	  idx_t n = sprintf (rec, "%d path=%s\n", len, name);
+
+	  make_header (&block, "././@PaxHeader", n, XHDTYPE);
+	  write_data (fp, block.buffer, BLOCKSIZE);
+	  memset (data, 0, BLOCKSIZE);
+	  memcpy (data, rec, n);
+	  write_data (fp, data, BLOCKSIZE);
+	}
+      make_header (&block, name, size, REGTYPE);
+      memset (data, member_fill (i), size);
+      memset (data + size, 0, BLOCKSIZE);
+      write_data (fp, block.buffer, BLOCKSIZE);
+      write_data (fp, data, (size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE);
+    }
+  memset (data, 0, 2 * BLOCKSIZE);
+  write_data (fp, data, 2 * BLOCKSIZE);
+  if (fclose (fp))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Build the index of ARCHIVE into INDEX.  */
+static int
+build_index (char const *archive, char const *index)
+{
+  paxbuf_t pbuf;
+  int rc;
+
+  tar_archive_create (&pbuf, archive, 0, PAXBUF_READ, 0);
+  rc = paxbuf_open (pbuf);
+  if (rc == 0)
+    {
+      rc = tar_index_build (pbuf, TAR_ITER_SEEK, index);
+      paxbuf_close (pbuf);
+    }
+  paxbuf_destroy (&pbuf);
+  return rc;
+}
+
+/* Look up members of ARCHIVE in IDX and read them.  */
+static void
+check_members (char const *archive, tar_index_t idx)
+{
+  static char data[MAX_DATA];
+  struct tar_index_entry ent;
+  char const *prev = "";
+  paxbuf_t pbuf;
+  tar_iterator_t it;
+  struct tar_stat_info *st;
+  idx_t n;
+
+  check (tar_index_count (idx) == MEMBERS, "tar_index_count");
+  for (idx_t i = 0; i < tar_index_count (idx); i++)
+    {
+      if (!tar_index_get (idx, i, &ent) || strcmp (prev, ent.name) > 0)
+	{
+	  printf ("entry %td is out of order\n", i);
+	  failures++;
+	  break;
+	}
+      prev = ent.name;
+    }
+
+  tar_archive_create (&pbuf, archive, 0, PAXBUF_READ, 0);
+  if (paxbuf_open (pbuf) || tar_iterator_create (&it, pbuf, TAR_ITER_SEEK))
+    {
+      perror (archive);
+      exit (EXIT_FAILURE);
+    }
+  for (int i = MEMBERS - 1; i >= 0; i--)
+    {
+      char name[256];
+      int j = last_member (i);
+
+      member_name (name, i);
+      if (!tar_index_lookup (idx, name, &ent))
+	{
+	  printf ("%s not found\n", name);
+	  failures++;
+	  continue;
+	}
+      if (ent.size != member_size (j) || ent.typeflag != REGTYPE
+	  || tar_iterator_seek (it, ent.offset)
+	  || tar_iterator_next (it, &st) != pax_io_success
+	  || strcmp (st->file_name, name) != 0
+	  || tar_iterator_read (it, data, sizeof data, &n) == pax_io_failure
+	  || n != member_size (j)
+	  || (n > 0 && (data[0] != member_fill (j)
+			|| memcmp (data, data + 1, n - 1) != 0)))
+	{
+	  printf ("%s: wrong member at offset %jd\n", name,
+		  (intmax_t) ent.offset);
+	  failures++;
+	}
+    }
+  check (!tar_index_lookup (idx, "dir0/nonexistent", &ent),
+	 "lookup of a missing member");
+  check (!tar_index_lookup (idx, "", &ent), "lookup of an empty name");
+  tar_iterator_destroy (&it);
+  paxbuf_close (pbuf);
+  paxbuf_destroy (&pbuf);
+}
+
+/* Write SIZE bytes of DATA to FILENAME, and check that opening it as
+   an index fails with EILSEQ.  */
+static void
+check_damaged (char const *filename, char const *data, idx_t size,
+	       char const *what)
+{
+  tar_index_t idx;
+  FILE *fp = fopen (filename, "w");
+  int rc;
+
+  if (!fp)
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  write_data (fp, data, size);
+  if (fclose (fp))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  rc = tar_index_open (&idx, filename);
+  if (rc == 0)
+    tar_index_close (&idx);
+  if (rc != EILSEQ)
+    {
+      printf ("%s: got %s, expected EILSEQ\n", what,
+	      rc ? strerror (rc) : "success");
+      failures++;
+    }
+}
+
+/* Read the index in FILENAME into memory, and store its size in
+   *SIZE.  */
+static char *
+read_index (char const *filename, idx_t *size)
+{
+  struct stat st;
+  char *data;
+  int fd = open (filename, O_RDONLY);
+
+  if (fd < 0 || fstat (fd, &st))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  data = ximalloc (st.st_size);
+  if (read (fd, data, st.st_size) != st.st_size || close (fd))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  *size = st.st_size;
+  return data;
+}
+
+int
+main (void)
+{
+  char archive[] = "idxcheckXXXXXX";
+  char index[] = "idxcheckXXXXXX";
+  tar_index_builder_t b;
+  tar_index_t idx;
+  struct tar_index_entry ent;
+  char *data;
+  idx_t size;
+  int fd, rc;
+
+  fd = mkstemp (archive);
+  if (fd < 0)
+    {
+      perror ("mkstemp");
+      return EXIT_FAILURE;
+    }
+  close (fd);
+  fd = mkstemp (index);
+  if (fd < 0)
+    {
+      perror ("mkstemp");
+      return EXIT_FAILURE;
+    }
+
+  /* An empty index */
+  tar_index_builder_create (&b);
+  rc = tar_index_builder_write (b, fd);
+  tar_index_builder_destroy (&b);
+  if (close (fd) || rc)
+    {
+      perror (index);
+      return EXIT_FAILURE;
+    }
+  rc = tar_index_open (&idx, index);
+  if (rc)
+    {
+      printf ("empty index: %s\n", strerror (rc));
+      failures++;
+    }
+  else
+    {
+      check (tar_index_count (idx) == 0
+	     && !tar_index_lookup (idx, "dir0/file00000", &ent),
+	     "empty index");
+      tar_index_close (&idx);
+    }
+
+  write_archive (archive);
+  rc = build_index (archive, index);
+  if (rc == 0)
+    rc = tar_index_open (&idx, index);
+  if (rc)
+    {
+      printf ("index: %s\n", strerror (rc));
+      failures++;
+    }
+  else
+    {
+      check_members (archive, idx);
+      tar_index_close (&idx);
+    }
+
+  /* Damaged copies of the index */
+  data = read_index (index, &size);
+  check_damaged (index, data, 0, "empty file");
+  check_damaged (index, data, HEADER_SIZE - 1, "truncated header");
+  check_damaged (index, data, size - 1, "truncated index");
+  data[size - 1] = 'x';
+  check_damaged (index, data, size, "unterminated string table");
+  data[size - 1] = 0;
+  data[8] ^= 1;
+  check_damaged (index, data, size, "wrong entry count");
+  data[8] ^= 1;
+  data[0] = 'X';
+  check_damaged (index, data, size, "wrong magic");
+  free (data);
+
+  unlink (archive);
+  unlink (index);
+
+  if (failures)
+    {
+      printf ("%d failures\n", failures);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -24,7 +24,7 @@
 #include <paxtest.h>
 
 #ifndef DEFAULT_BLOCKING_FACTOR
-# define DEFAULT_BLOCKING_FACTOR 20
+# define DEFAULT_BLOCKING_FACTOR 0
 #endif
 
 void
@@ -60,17 +60,18 @@ dump (char *buf, idx_t size)
 void
 read_and_dump (paxbuf_t pbuf)
 {
-  union block block;
+  char *data;
   idx_t size;
   pax_io_status_t rc;
 
-  while ((rc = paxbuf_read (pbuf, block.buffer, sizeof block, &size))
-	 == pax_io_success)
+  while ((rc = paxbuf_peek (pbuf, &data, &size)) == pax_io_success)
     {
-      dump (block.buffer, size);
+      dump (data, size);
+      paxbuf_consume (pbuf, size);
     }
   if (rc == pax_io_failure)
     error (EXIT_FAILURE, 0, "Read error");
+  dump (data, size);
 }
 
 int
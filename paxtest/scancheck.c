@@ -0,0 +1,306 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Check that the parallel listing of tar_scan matches the members
+   reported by the header iterator.  The archive spans more than one
+   window of the scan and has pax global extended headers in the middle
+   of it, which apply to members found by other workers.  Member data
+   is left as holes, so the archive takes little disk space.  */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <paxtest.h>
+
+void
+xalloc_die (void)
+{
+  fputs ("memory exhausted\n", stderr);
+  exit (EXIT_FAILURE);
+}
+
+/* Size of the archive, a little over two windows of two threads */
+enum { ARCHIVE_SIZE = 300 * 1024 * 1024, THREADS = 2 };
+
+/* Offsets after which global extended headers are written */
+static off_t const global_at[] = { 96 * 1024 * 1024, 200 * 1024 * 1024 };
+
+enum { MAX_MEMBERS = 1024 };
+
+struct member
+{
+  off_t offset;
+  char typeflag;
+  char name[256];
+  char uname[64];
+  off_t size;
+  time_t mtime;
+};
+
+struct listing
+{
+  struct member mem[MAX_MEMBERS];
+  idx_t count;
+};
+
+static uint_least32_t seed = 1;
+
+/* Return a pseudo-random number, the same on all systems.  */
+static unsigned int
+next_random (void)
+{
+  seed = (seed * 1103515245 + 12345) & 0xffffffff;
+  return seed >> 16;
+}
+
+/* Store V in octal in the LEN bytes of FIELD, NUL terminated.  */
+static void
+set_octal (char *field, idx_t len, uintmax_t v)
+{
+  char buf[32];
+
+  sprintf (buf, "%0*jo", (int) len - 1, v);
+  memcpy (field, buf, len);
+}
+
+/* Write a header block at OFFSET of FD for the member NAME of type
+   TYPEFLAG with SIZE bytes of data.  */
+static void
+write_header (int fd, off_t offset, char const *name, off_t size,
+	      char typeflag)
+{
+  union block block;
+  unsigned int sum = 0;
+
+  memset (&block, 0, sizeof block);
+  strcpy (block.header.name, name);
+  set_octal (block.header.mode, sizeof block.header.mode, 0644);
+  set_octal (block.header.uid, sizeof block.header.uid, 0);
+  set_octal (block.header.gid, sizeof block.header.gid, 0);
+  set_octal (block.header.size, sizeof block.header.size, size);
+  set_octal (block.header.mtime, sizeof block.header.mtime, 1);
+  block.header.typeflag = typeflag;
+  memcpy (block.header.magic, TMAGIC, TMAGLEN);
+  memcpy (block.header.version, TVERSION, TVERSLEN);
+  strcpy (block.header.uname, "user");
+  strcpy (block.header.gname, "group");
+  memset (block.header.chksum, ' ', sizeof block.header.chksum);
+  for (int i = 0; i < BLOCKSIZE; i++)
+    sum += (unsigned char) block.buffer[i];
+  set_octal (block.header.chksum, sizeof block.header.chksum - 1, sum);
+
+  if (pwrite (fd, &block, sizeof block, offset) != sizeof block)
+    {
+      perror ("pwrite");
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Write a global extended header at OFFSET of FD setting the user name
+   to UNAME and the modification time to MTIME.  Return the offset of
+   the next block.  */
+static off_t
+write_global (int fd, off_t offset, char const *uname, int mtime)
+{
+  char data[BLOCKSIZE] = { 0 };
+  char rec[64];
+  int len = 0;
+
+  for (int i = 0; i < 2; i++)
+    {
+      int n;
+
+      if (i == 0)
+	n = sprintf (rec, "uname=%s\n", uname);
+      else
+	n = sprintf (rec, "mtime=%d\n", mtime);
+      /* The length of a record includes its own digits and the space.  */
+      n += 2;
+      if (n >= 10)
+	n++;
+      len += sprintf (data + len, "%d %s", n, rec);
+    }
+
+  write_header (fd, offset, "././@PaxHeader", len, XGLTYPE);
+  if (pwrite (fd, data, sizeof data, offset + BLOCKSIZE) != sizeof data)
+    {
+      perror ("pwrite");
+      exit (EXIT_FAILURE);
+    }
+  return offset + 2 * BLOCKSIZE;
+}
+
+/* Write the test archive to FD.  */
+static void
+write_archive (int fd)
+{
+  off_t offset = 0;
+  int global = 0;
+
+  for (int n = 0; offset < ARCHIVE_SIZE; n++)
+    {
+      char name[32];
+      off_t size = 512 * 1024 + next_random () % (1024 * 1024);
+
+      if (global < (int) (sizeof global_at / sizeof global_at[0])
+	  && offset >= global_at[global])
+	{
+	  char uname[16];
+
+	  sprintf (uname, "global%d", global);
+	  offset = write_global (fd, offset, uname, 1000 + global);
+	  global++;
+	}
+      sprintf (name, "dir%d/file%05d", n % 7, n);
+      write_header (fd, offset, name, size, REGTYPE);
+      offset += BLOCKSIZE + (size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+    }
+
+  /* End of archive blocks, as holes.  */
+  if (ftruncate (fd, offset + 2 * BLOCKSIZE))
+    {
+      perror ("ftruncate");
+      exit (EXIT_FAILURE);
+    }
+}
+
+static int
+add_member (void *closure, struct tar_stat_info *st, off_t offset,
+	    char typeflag)
+{
+  struct listing *l = closure;
+  struct member *m;
+
+  if (l->count == MAX_MEMBERS)
+    return ENOSPC;
+  m = &l->mem[l->count++];
+  m->offset = offset;
+  m->typeflag = typeflag;
+  snprintf (m->name, sizeof m->name, "%s", st->file_name);
+  snprintf (m->uname, sizeof m->uname, "%s", st->uname ? st->uname : "");
+  m->size = st->stat.st_size;
+  m->mtime = st->stat.st_mtime;
+  return 0;
+}
+
+/* List the archive FILENAME with the header iterator into L.  */
+static int
+list_serial (char const *filename, struct listing *l)
+{
+  paxbuf_t pbuf;
+  tar_iterator_t it;
+  struct tar_stat_info *st;
+  pax_io_status_t status;
+  int rc;
+
+  tar_archive_create (&pbuf, filename, 0, PAXBUF_READ, 0);
+  rc = paxbuf_open (pbuf);
+  if (rc)
+    {
+      paxbuf_destroy (&pbuf);
+      return rc;
+    }
+  rc = tar_iterator_create (&it, pbuf, TAR_ITER_SEEK);
+  if (rc == 0)
+    {
+      while ((status = tar_iterator_next (it, &st)) == pax_io_success)
+	{
+	  rc = add_member (l, st, tar_iterator_offset (it),
+			   tar_iterator_header (it)->header.typeflag);
+	  if (rc)
+	    break;
+	}
+      if (rc == 0 && status == pax_io_failure)
+	rc = errno;
+      tar_iterator_destroy (&it);
+    }
+  paxbuf_close (pbuf);
+  paxbuf_destroy (&pbuf);
+  return rc;
+}
+
+int
+main (void)
+{
+  static struct listing serial, parallel;
+  char filename[] = "scancheckXXXXXX";
+  int failures = 0;
+  int fd, rc;
+
+  fd = mkstemp (filename);
+  if (fd < 0)
+    {
+      perror ("mkstemp");
+      return EXIT_FAILURE;
+    }
+  write_archive (fd);
+  close (fd);
+
+  rc = list_serial (filename, &serial);
+  if (rc)
+    {
+      printf ("iterator: %s\n", strerror (rc));
+      failures++;
+    }
+  rc = tar_scan (filename, THREADS, add_member, &parallel);
+  if (rc)
+    {
+      printf ("tar_scan: %s\n", strerror (rc));
+      failures++;
+    }
+  unlink (filename);
+
+  if (serial.count != parallel.count)
+    {
+      printf ("%td members listed by the iterator, %td by tar_scan\n",
+	      serial.count, parallel.count);
+      failures++;
+    }
+  for (idx_t i = 0; i < serial.count && i < parallel.count; i++)
+    {
+      struct member const *s = &serial.mem[i], *p = &parallel.mem[i];
+
+      if (s->offset != p->offset || s->typeflag != p->typeflag
+	  || strcmp (s->name, p->name) || strcmp (s->uname, p->uname)
+	  || s->size != p->size || s->mtime != p->mtime)
+	{
+	  printf ("member %td: iterator %jd %s %s %jd %jd,"
+		  " tar_scan %jd %s %s %jd %jd\n", i,
+		  (intmax_t) s->offset, s->name, s->uname,
+		  (intmax_t) s->size, (intmax_t) s->mtime,
+		  (intmax_t) p->offset, p->name, p->uname,
+		  (intmax_t) p->size, (intmax_t) p->mtime);
+	  failures++;
+	}
+    }
+
+  /* The global headers must have been applied.  */
+  if (serial.count == 0
+      || strcmp (serial.mem[serial.count - 1].uname, "global1") != 0)
+    {
+      printf ("global extended headers were not applied\n");
+      failures++;
+    }
+
+  if (failures)
+    {
+      printf ("%d failures\n", failures);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,260 @@
+/* This file is part of GNU paxutils
+
+   Copyright (C) 2024 Free Software Foundation, Inc.
+
+   GNU paxutils is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 3, or (at your option) any later
+   version.
+
+   GNU paxutils is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General
+   Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with GNU paxutils.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Check seeking in compressed streams: the decompression filter is
+   positioned forwards, backwards, within the part of the stream it
+   has indexed and beyond it, and past the end.  Streams written by the
+   compression filter are checked, as well as gzip streams written by
+   zlib, whose members lack the sizes the filter stores and are
+   inflated sequentially.  */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <paxtest.h>
+#if HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+
+void
+xalloc_die (void)
+{
+  fputs ("memory exhausted\n", stderr);
+  exit (EXIT_FAILURE);
+}
+
+/* Blocking factor of the streams */
+enum { BFACTOR = 20, RECORD_SIZE = BFACTOR * BLOCKSIZE };
+
+/* Size of the data, spanning several compression blocks */
+enum { DATA_SIZE = 6 * 1024 * 1024 + 4321 };
+
+/* Size of the data padded to whole records, as the compression
+   filter stores it */
+enum
+  {
+    PADDED_SIZE = (DATA_SIZE + RECORD_SIZE - 1) / RECORD_SIZE * RECORD_SIZE
+  };
+
+/* Bytes read after each seek */
+enum { READ_SIZE = 3000 };
+
+static int failures;
+
+static char *data;
+
+static uint_least32_t seed = 1;
+
+/* Return a pseudo-random number, the same on all systems.  */
+static unsigned int
+next_random (void)
+{
+  seed = (seed * 1103515245 + 12345) & 0xffffffff;
+  return seed >> 16;
+}
+
+/* Write the data to FILENAME, compressed with CODEC.  Return 0 on
+   success and an error code otherwise.  */
+static int
+write_stream (char const *filename, int codec)
+{
+  paxbuf_t pbuf;
+  idx_t n;
+  int rc;
+
+  /* The archive is not truncated when opened.  */
+  if (truncate (filename, 0))
+    return errno;
+  tar_archive_create (&pbuf, filename, 0, PAXBUF_WRITE | PAXBUF_CREAT,
+		      BFACTOR);
+  rc = paxbuf_push_compress (pbuf, codec, -1, 0);
+  if (rc == 0
+      && (paxbuf_open (pbuf)
+	  || paxbuf_write (pbuf, data, DATA_SIZE, &n) != pax_io_success
+	  || paxbuf_close (pbuf)))
+    rc = errno;
+  paxbuf_destroy (&pbuf);
+  return rc;
+}
+
+#if HAVE_ZLIB_H
+/* Write the data to FILENAME as gzip members of the given SIZES made
+   by zlib, the last one taking the rest.  */
+static void
+write_gzip (char const *filename, idx_t const *sizes, int nsizes)
+{
+  idx_t out_size = DATA_SIZE + DATA_SIZE / 100 + 1024;
+  unsigned char *out = ximalloc (out_size);
+  FILE *fp = fopen (filename, "w");
+  idx_t off = 0;
+
+  if (!fp)
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  for (int i = 0; i <= nsizes; i++)
+    {
+      idx_t len = i < nsizes ? sizes[i] : DATA_SIZE - off;
+      z_stream zs = { 0 };
+
+      if (deflateInit2 (&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+	abort ();
+      zs.next_in = (unsigned char *) data + off;
+      zs.avail_in = len;
+      zs.next_out = out;
+      zs.avail_out = out_size;
+      if (deflate (&zs, Z_FINISH) != Z_STREAM_END)
+	abort ();
+      fwrite (out, 1, zs.total_out, fp);
+      deflateEnd (&zs);
+      off += len;
+    }
+  if (fclose (fp))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  free (out);
+}
+#endif
+
+/* Read FILENAME through the decompression filter with THREADS
+   workers, seeking to a series of offsets.  The decompressed stream is
+   the data followed by zeros up to END.  */
+static void
+check_seeks (char const *filename, int threads, off_t end, char const *what)
+{
+  static off_t const offsets[] = {
+    /* Beyond the indexed part, then back to it */
+    3 * 1024 * 1024 + 17, 100, 5 * 1024 * 1024, 5 * 1024 * 1024 - 1,
+    /* Within the current frame, and around frame boundaries */
+    5 * 1024 * 1024 + 200000, 1024 * 1024 - 10, 1024 * 1024, 0,
+    /* Near and past the end */
+    DATA_SIZE - 1000, DATA_SIZE + 10, 2 * DATA_SIZE, 2 * 1024 * 1024 + 5
+  };
+  static char buf[READ_SIZE];
+  paxbuf_t pbuf;
+
+  tar_archive_create (&pbuf, filename, 0, PAXBUF_READ, BFACTOR);
+  if (paxbuf_push_decompress (pbuf, threads) || paxbuf_open (pbuf))
+    {
+      perror (filename);
+      exit (EXIT_FAILURE);
+    }
+  for (int i = 0; i < sizeof offsets / sizeof offsets[0]; i++)
+    {
+      off_t offset = offsets[i];
+      off_t pos = paxbuf_seek (pbuf, offset);
+      idx_t want;
+      bool ok;
+      idx_t n;
+
+      /* Past the end, the position is only known not to exceed
+	 OFFSET, and nothing is read.  */
+      if (offset < end ? pos != offset : pos < 0 || pos > offset)
+	{
+	  printf ("%s: seek to %jd: got %jd\n", what, (intmax_t) offset,
+		  (intmax_t) pos);
+	  failures++;
+	  continue;
+	}
+      want = pos >= end ? 0 : end - pos < READ_SIZE ? end - pos : READ_SIZE;
+      if (paxbuf_read (pbuf, buf, READ_SIZE, &n) == pax_io_failure)
+	{
+	  printf ("%s: read at %jd: %s\n", what, (intmax_t) offset,
+		  strerror (errno));
+	  failures++;
+	  continue;
+	}
+      ok = n == want;
+      for (idx_t j = 0; ok && j < n; j++)
+	ok = buf[j] == (pos + j < DATA_SIZE ? data[pos + j] : 0);
+      if (!ok)
+	{
+	  printf ("%s: wrong data at %jd\n", what, (intmax_t) offset);
+	  failures++;
+	}
+    }
+  paxbuf_close (pbuf);
+  paxbuf_destroy (&pbuf);
+}
+
+int
+main (void)
+{
+  static struct { int codec; char const *name; } const codecs[] = {
+    { PAXBUF_GZIP, "gzip" },
+    { PAXBUF_ZSTD, "zstd" }
+  };
+  char filename[] = "zseekcheckXXXXXX";
+  char what[64];
+  int fd;
+
+  fd = mkstemp (filename);
+  if (fd < 0)
+    {
+      perror ("mkstemp");
+      return EXIT_FAILURE;
+    }
+  close (fd);
+
+  /* Bytes from a small alphabet, which compress to about half.  */
+  data = ximalloc (DATA_SIZE);
+  for (idx_t i = 0; i < DATA_SIZE; i++)
+    data[i] = 'a' + next_random () % 16;
+
+  for (int c = 0; c < sizeof codecs / sizeof codecs[0]; c++)
+    {
+      int rc = write_stream (filename, codecs[c].codec);
+      if (rc == ENOSYS)
+	continue;
+      if (rc)
+	{
+	  printf ("%s: writing: %s\n", codecs[c].name, strerror (rc));
+	  failures++;
+	  continue;
+	}
+      for (int threads = 1; threads <= 4; threads += 3)
+	{
+	  sprintf (what, "%s, %d threads", codecs[c].name, threads);
+	  check_seeks (filename, threads, PADDED_SIZE, what);
+	}
+    }
+
+#if HAVE_ZLIB_H
+  {
+    static idx_t const members[] = { 700000, 1024 * 1024 + 3, 300000 };
+
+    write_gzip (filename, members, sizeof members / sizeof members[0]);
+    check_seeks (filename, 2, DATA_SIZE, "zlib members");
+    write_gzip (filename, nullptr, 0);
+    check_seeks (filename, 2, DATA_SIZE, "zlib single member");
+  }
+#endif
+  free (data);
+  unlink (filename);
+
+  if (failures)
+    {
+      printf ("%d failures\n", failures);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}